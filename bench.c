@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "lib_tar.h"
+
+/**
+ * Benchmark of the scanning functions on generated archives.
+ * Each measurement is printed on stdout as one JSON object per line, progress goes to stderr.
+ *
+ *   ./tar_bench [-n entries[,entries...]] [-d depth] [-l link_every] [-m max_file_size]
+ *               [-g big_member_mib] [-q queries] [-t dir] [-k]
+ */
+
+typedef struct bench_opts {
+    size_t depth;           // levels of directories above the files
+    size_t link_every;      // one entry in link_every is a symlink to the file before it, 0 for none
+    size_t max_size;        // file sizes are spread from 1 to max_size bytes
+    size_t big_mib;         // size of a last member written as a hole, 0 for none
+    size_t queries;         // calls measured per function, fewer on large archives
+    const char *dir;
+    int keep;
+} bench_opts_t;
+
+typedef struct bench_archive {
+    char path[4096];
+    size_t no_entries;
+    char **files;           // names of the regular files
+    size_t no_files;
+    char **links;
+    size_t no_links;
+    char **dirs;            // with their trailing slash
+    size_t no_dirs;
+} bench_archive_t;
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rng(void) { // xorshift64, the same archives and queries on every run
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void push(char ***names, size_t *no_names, const char *name) {
+    if ((*no_names & (*no_names - 1)) == 0) { // grown at every power of two
+        *names = (char**) realloc(*names, sizeof(char*) * (*no_names ? *no_names * 2 : 1));
+    }
+    (*names)[(*no_names)++] = strdup(name);
+}
+
+static void write_header(FILE *out, const char *name, char typeflag, size_t size, const char *linkname) {
+    char block[512];
+    tar_header_t *header = (tar_header_t*) block;
+    memset(block, 0, sizeof(block));
+    size_t len = strlen(name);
+    if (len > sizeof(header->name)) { // split on a slash into prefix and name, as ustar does
+        const char *slash = strchr(name + len - sizeof(header->name) - 1, '/');
+        memcpy(header->prefix, name, slash - name);
+        strncpy(header->name, slash + 1, sizeof(header->name));
+    } else strncpy(header->name, name, sizeof(header->name));
+    snprintf(header->mode, sizeof(header->mode), "%07o", typeflag == DIRTYPE ? 0755 : 0644);
+    snprintf(header->uid, sizeof(header->uid), "%07o", 1000);
+    snprintf(header->gid, sizeof(header->gid), "%07o", 1000);
+    snprintf(header->size, sizeof(header->size), "%011zo", size);
+    snprintf(header->mtime, sizeof(header->mtime), "%011o", 1639688000);
+    header->typeflag = typeflag;
+    if (linkname) strncpy(header->linkname, linkname, sizeof(header->linkname));
+    memcpy(header->magic, TMAGIC, TMAGLEN);
+    memcpy(header->version, TVERSION, TVERSLEN);
+    snprintf(header->chksum, sizeof(header->chksum), "%06lo", checksum(block));
+    header->chksum[7] = ' ';
+    fwrite(block, 1, 512, out);
+}
+
+/**
+ * Writes an archive of no_entries entries, 100 per directory, the directories nested opts->depth levels deep
+ * with 16 children per level. Files are filled with a repeated pattern, the big member is left as a hole.
+ */
+static int generate(bench_archive_t *archive, size_t no_entries, bench_opts_t *opts) {
+    memset(archive, 0, sizeof(*archive));
+    archive->no_entries = no_entries;
+    snprintf(archive->path, sizeof(archive->path), "%s/bench-%zu.tar", opts->dir, no_entries);
+    FILE *out = fopen(archive->path, "w");
+    if (!out) return -1;
+    char *payload = (char*) malloc(opts->max_size + 512);
+    for (size_t i = 0; i < opts->max_size + 512; i++) payload[i] = 'a' + i % 26;
+    long previous = -1;
+    char dir[1024], name[1200], last_file[1200] = "";
+    for (size_t i = 0; i < no_entries; i++) {
+        long id = i / 100;
+        if (id != previous) { // every directory of the new path that was not there before
+            size_t len = 0;
+            int changed = previous < 0;
+            for (size_t level = 0; level < opts->depth; level++) { // most significant digits at the top
+                int shift = 4 * (opts->depth - 1 - level);
+                long component = level == 0 ? id >> shift : (id >> shift) & 15;
+                long before = level == 0 ? previous >> shift : (previous >> shift) & 15;
+                if (component != before) changed = 1;
+                len += snprintf(dir + len, sizeof(dir) - len, "l%zu_%ld/", level, component);
+                if (changed) {
+                    write_header(out, dir, DIRTYPE, 0, NULL);
+                    push(&archive->dirs, &archive->no_dirs, dir);
+                }
+            }
+            previous = id;
+        }
+        if (opts->link_every && i % opts->link_every == opts->link_every - 1 && strncmp(last_file, dir, strlen(dir)) == 0
+            && strchr(last_file + strlen(dir), '/') == NULL) {
+            snprintf(name, sizeof(name), "%sl%zu", dir, i);
+            const char *target = strrchr(last_file, '/') ? strrchr(last_file, '/') + 1 : last_file; // a sibling
+            write_header(out, name, SYMTYPE, 0, target);
+            push(&archive->links, &archive->no_links, name);
+            continue;
+        }
+        size_t size = 1 + (i * 2654435761u) % opts->max_size;
+        snprintf(name, sizeof(name), "%sf%zu.txt", dir, i);
+        write_header(out, name, REGTYPE, size, NULL);
+        fwrite(payload + i % 26, 1, 512 * ((size + 511) / 512), out);
+        push(&archive->files, &archive->no_files, name);
+        strcpy(last_file, name);
+    }
+    if (opts->big_mib) {
+        size_t size = opts->big_mib * 1024 * 1024;
+        write_header(out, "big.bin", REGTYPE, size, NULL);
+        fseeko(out, size, SEEK_CUR); // sparse, only the pages read back take memory
+        push(&archive->files, &archive->no_files, "big.bin");
+    }
+    char zeros[1024] = {0};
+    fwrite(zeros, 1, sizeof(zeros), out);
+    free(payload);
+    fflush(out);
+    fsync(fileno(out)); // written back, so that a cold run can drop the pages
+    return fclose(out);
+}
+
+static void release(bench_archive_t *archive) {
+    for (size_t i = 0; i < archive->no_files; i++) free(archive->files[i]);
+    for (size_t i = 0; i < archive->no_links; i++) free(archive->links[i]);
+    for (size_t i = 0; i < archive->no_dirs; i++) free(archive->dirs[i]);
+    free(archive->files);
+    free(archive->links);
+    free(archive->dirs);
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Functions measured, each call made on a target drawn by pick() */
+enum { B_CHECK_ARCHIVE, B_EXISTS, B_IS_DIR, B_LIST, B_READ_FILE, B_VERIFY, B_COUNT };
+static const char *bench_names[B_COUNT] = {"check_archive", "exists", "is_dir", "list", "read_file", "verify_contents"};
+static const int bench_fns[B_COUNT] = {TAR_FN_CHECK_ARCHIVE, TAR_FN_EXISTS, TAR_FN_IS_DIR, TAR_FN_LIST, TAR_FN_READ_FILE,
+                                       TAR_FN_VERIFY_CONTENTS};
+
+/**
+ * @return the path to query: nine times out of ten an entry that exists, a missing one otherwise
+ */
+static char *pick(bench_archive_t *archive, int bench, char *missing) {
+    uint64_t r = rng();
+    if (bench == B_IS_DIR || bench == B_LIST) {
+        if (r % 10 == 9 || archive->no_dirs == 0) return missing;
+        return archive->dirs[(r / 10) % archive->no_dirs];
+    }
+    if (r % 10 == 9) return missing;
+    if (bench == B_READ_FILE && archive->no_links && r % 10 == 8) return archive->links[(r / 10) % archive->no_links];
+    return archive->files[(r / 10) % archive->no_files];
+}
+
+static void run_one(int fd, int bench, char *path, uint8_t *dest, char **entries) {
+    size_t len = 64 * 1024, no_entries = 128;
+    switch (bench) {
+        case B_CHECK_ARCHIVE: check_archive(fd); break;
+        case B_EXISTS: exists(fd, path); break;
+        case B_IS_DIR: is_dir(fd, path); break;
+        case B_LIST: list(fd, path, entries, &no_entries); break;
+        case B_READ_FILE: read_file(fd, path, 0, dest, &len); break;
+        case B_VERIFY: tar_verify_contents(fd, sysconf(_SC_NPROCESSORS_ONLN), NULL, 0, NULL, NULL, NULL); break;
+    }
+}
+
+/**
+ * Measures one function, cold drops the pages of the archive from the page cache before each call.
+ */
+static void measure(bench_archive_t *archive, int fd, int bench, int cold, bench_opts_t *opts) {
+    size_t calls = opts->queries;
+    size_t budget = 2 * 1000 * 1000 / (archive->no_entries + 1); // full scans of large archives are slow
+    if (calls > budget) calls = budget;
+    if ((bench == B_CHECK_ARCHIVE || bench == B_VERIFY) && calls > 20) calls = 20;
+    if (calls < 5) calls = 5;
+    double *us = (double*) malloc(sizeof(double) * calls);
+    uint8_t *dest = (uint8_t*) malloc(64 * 1024);
+    char **entries = (char**) malloc(sizeof(char*) * 128);
+    for (int i = 0; i < 128; i++) entries[i] = (char*) malloc(4096);
+    char missing[] = "no/such/entry";
+    if (!cold) run_one(fd, bench, pick(archive, bench, missing), dest, entries); // warm up
+    tar_stats_reset();
+    double total = 0;
+    for (size_t i = 0; i < calls; i++) {
+        char *path = pick(archive, bench, missing);
+        if (cold) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        double start = now_us();
+        run_one(fd, bench, path, dest, entries);
+        us[i] = now_us() - start;
+        total += us[i];
+    }
+    tar_stats_t stats;
+    tar_stats_get(&stats);
+    tar_fn_stats_t *fn = &stats.fn[bench_fns[bench]];
+    qsort(us, calls, sizeof(double), compare_double);
+    printf("{\"bench\":\"%s\",\"entries\":%zu,\"depth\":%zu,\"links\":%zu,\"big_mib\":%zu,\"cache\":\"%s\","
+           "\"calls\":%zu,\"ops_per_s\":%.1f,\"mean_us\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+           "\"syscalls_per_call\":%.1f,\"mb_per_s\":%.1f,\"headers_per_call\":%.1f}\n",
+           bench_names[bench], archive->no_entries, opts->depth, archive->no_links, opts->big_mib, cold ? "cold" : "warm",
+           calls, calls / (total / 1e6), total / calls, us[calls / 2], us[(calls * 99) / 100],
+           (double) fn->syscalls / calls, fn->bytes / total, (double) fn->headers / calls);
+    fflush(stdout);
+    for (int i = 0; i < 128; i++) free(entries[i]);
+    free(entries);
+    free(dest);
+    free(us);
+}
+
+int main(int argc, char **argv) {
+    bench_opts_t opts = {3, 50, 4096, 0, 200, ".", 0};
+    const char *sizes = "1000,10000,100000";
+    int c;
+    while ((c = getopt(argc, argv, "n:d:l:m:g:q:t:k")) != -1) {
+        switch (c) {
+            case 'n': sizes = optarg; break;
+            case 'd': opts.depth = strtoul(optarg, NULL, 10); break;
+            case 'l': opts.link_every = strtoul(optarg, NULL, 10); break;
+            case 'm': opts.max_size = strtoul(optarg, NULL, 10); break;
+            case 'g': opts.big_mib = strtoul(optarg, NULL, 10); break;
+            case 'q': opts.queries = strtoul(optarg, NULL, 10); break;
+            case 't': opts.dir = optarg; break;
+            case 'k': opts.keep = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [-n entries[,entries...]] [-d depth] [-l link_every] [-m max_file_size]"
+                                " [-g big_member_mib] [-q queries] [-t dir] [-k]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (opts.max_size == 0) opts.max_size = 1;
+    if (opts.depth == 0) opts.depth = 1;
+    if (opts.depth > 16) opts.depth = 16; // the path must fit the prefix and name fields
+    for (const char *size = sizes; *size; size += strcspn(size, ",") + (size[strcspn(size, ",")] == ',')) {
+        size_t no_entries = strtoul(size, NULL, 10);
+        if (no_entries == 0) continue;
+        bench_archive_t archive;
+        double start = now_us();
+        if (generate(&archive, no_entries, &opts) != 0) {
+            perror(archive.path);
+            return 1;
+        }
+        fprintf(stderr, "%s: %zu files, %zu symlinks, %zu directories, written in %.1fs\n", archive.path,
+                archive.no_files, archive.no_links, archive.no_dirs, (now_us() - start) / 1e6);
+        int fd = open(archive.path, O_RDONLY);
+        for (int cold = 0; cold <= 1; cold++) {
+            for (int bench = 0; bench < B_COUNT; bench++) measure(&archive, fd, bench, cold, &opts);
+        }
+        close(fd);
+        if (!opts.keep) unlink(archive.path);
+        release(&archive);
+    }
+    return 0;
+}
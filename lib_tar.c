@@ -1,5 +1,671 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // copy_file_range()
+#endif
 #include "lib_tar.h"
-#include <stdio.h> // todo remove only here to use print on debug
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <zlib.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define TAR_HAVE_URING 1
+#endif
+
+/**
+ * Counters of one call to a public function, see call_begin().
+ */
+typedef struct tar_call {
+    int fn;                 // TAR_FN_*, -1 for a call made from inside another counted call
+    struct timespec start;
+    uint64_t syscalls;      // added to atomically, the threads started by the call count here too
+    uint64_t bytes;
+    uint64_t headers;
+} tar_call_t;
+
+static tar_fn_stats_t fn_stats[TAR_FN_COUNT];
+static __thread tar_call_t *current_call; // call in progress on this thread, counted by count_io() and count_header()
+#ifdef TAR_TRACE
+typedef struct trace_hook {
+    tar_trace_cb_t callback;
+    void *arg;
+} trace_hook_t;
+
+static trace_hook_t *trace_hook; // replaced whole by tar_trace_set(), never freed as a call may still hold it
+#endif
+
+/**
+ * Starts counting a call to fn on this thread. A call made by another counted call, such as tar_open() from
+ * tar_extract(), is not counted on its own: what it does is counted in the outer call.
+ */
+static void call_begin(tar_call_t *call, int fn) {
+    call->fn = current_call ? -1 : fn;
+    if (call->fn < 0) return;
+    call->syscalls = call->bytes = call->headers = 0;
+    clock_gettime(CLOCK_MONOTONIC, &call->start);
+    current_call = call;
+}
+
+/**
+ * Adds a finished call to the statistics of its function and hands it to the tracing hook.
+ */
+static void call_end(tar_call_t *call) {
+    if (call->fn < 0) return;
+    current_call = NULL;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t ns = (end.tv_sec - call->start.tv_sec) * 1000000000ULL + end.tv_nsec - call->start.tv_nsec;
+    tar_fn_stats_t *stats = &fn_stats[call->fn];
+    __atomic_fetch_add(&stats->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->syscalls, call->syscalls, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->bytes, call->bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->headers, call->headers, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->wall_ns, ns, __ATOMIC_RELAXED);
+    int bucket = 0;
+    for (uint64_t us = ns / 1000; us && bucket < TAR_HIST_BUCKETS - 1; us >>= 1) bucket++;
+    __atomic_fetch_add(&stats->latency[bucket], 1, __ATOMIC_RELAXED);
+#ifdef TAR_TRACE
+    trace_hook_t *hook = __atomic_load_n(&trace_hook, __ATOMIC_ACQUIRE);
+    if (hook) {
+        tar_trace_t trace = {call->fn, call->syscalls, call->bytes, call->headers, ns};
+        hook->callback(&trace, hook->arg);
+    }
+#endif
+}
+
+/**
+ * Makes the threads started by a call count in it.
+ *
+ * @return the call counted on this thread before, to give back to call_adopt() once done
+ */
+static tar_call_t *call_adopt(tar_call_t *call) {
+    tar_call_t *previous = current_call;
+    current_call = call;
+    return previous;
+}
+
+/**
+ * Counts system calls reading the archive and the bytes they returned in the call in progress, if any.
+ */
+static void count_io(uint64_t syscalls, uint64_t bytes) {
+    tar_call_t *call = current_call;
+    if (!call) return;
+    __atomic_fetch_add(&call->syscalls, syscalls, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&call->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+static void count_header(void) {
+    tar_call_t *call = current_call;
+    if (call) __atomic_fetch_add(&call->headers, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * pread() that retries on EINTR and short reads, so that only the end of file stops it.
+ *
+ * @return the number of bytes read, -1 on error
+ */
+static ssize_t read_at(int fd, void *buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t got = pread(fd, (char*) buf + done, len - done, offset + done);
+        count_io(1, got > 0 ? got : 0);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) return -1;
+        if (got == 0) break; // end of file
+        done += got;
+    }
+    return done;
+}
+
+/* Uncompressed bytes between two checkpoints of a gzip archive, each checkpoint costs a 32 KiB window */
+#define TAR_GZ_SPAN (1024 * 1024)
+#define TAR_GZ_WINDOW 32768
+#define TAR_GZ_CHUNK (64 * 1024)
+
+/**
+ * State of the inflater at a deflate block boundary, enough to start decompressing from there.
+ */
+typedef struct gz_point {
+    off_t out;                          // uncompressed offset of the boundary
+    off_t in;                           // compressed offset of the first byte not fully consumed
+    int bits;                           // bits of the byte before in that belong to the next block, 0 to 7
+    int member;                         // 1 at the start of a gzip member after the first, in is then its header
+    unsigned char window[TAR_GZ_WINDOW]; // last 32 KiB of output before the boundary, the dictionary of what follows
+} gz_point_t;
+
+/**
+ * Checkpoint index of a gzip archive, so that any range of the uncompressed archive can be read by
+ * inflating from the nearest checkpoint before it instead of from the start of the file.
+ */
+typedef struct gz_index {
+    int fd;
+    gz_point_t *points;     // in increasing offsets
+    size_t no_points;
+    size_t cap_points;
+    off_t size;             // length of the uncompressed archive
+} gz_index_t;
+
+/**
+ * @return 1 if the file starts with the gzip magic bytes, 0 otherwise
+ */
+static int is_gzip(int fd) {
+    unsigned char magic[2];
+    return read_at(fd, magic, 2, 0) == 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+/**
+ * @return 1 if a gzip member starts at offset of the file, 0 otherwise
+ */
+static int gz_member_at(int fd, off_t offset) {
+    unsigned char magic[2];
+    return read_at(fd, magic, 2, offset) == 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+static void gz_free(gz_index_t *gz) {
+    if (!gz) return;
+    free(gz->points);
+    free(gz);
+}
+
+/**
+ * Records a checkpoint, window being the circular output buffer whose next byte to write is at size - left,
+ * or NULL for the start of a member that needs no dictionary.
+ */
+static int gz_add_point(gz_index_t *gz, int bits, off_t in, off_t out, size_t left, const unsigned char *window) {
+    if (gz->no_points == gz->cap_points) {
+        size_t cap = gz->cap_points ? gz->cap_points * 2 : 8;
+        gz_point_t *points = (gz_point_t*) realloc(gz->points, sizeof(gz_point_t) * cap);
+        if (!points) return -1;
+        gz->points = points;
+        gz->cap_points = cap;
+    }
+    gz_point_t *point = &gz->points[gz->no_points++];
+    point->out = out;
+    point->in = in;
+    point->bits = bits;
+    point->member = window == NULL;
+    if (!window) return 0;
+    if (left) memcpy(point->window, window + TAR_GZ_WINDOW - left, left);
+    if (left < TAR_GZ_WINDOW) memcpy(point->window + left, window, TAR_GZ_WINDOW - left);
+    return 0;
+}
+
+/**
+ * Inflates a whole gzip file once and keeps a checkpoint at the first block boundary after every span
+ * of output. The members of a multi-member file are inflated one after the other, each one starting with
+ * a checkpoint, and bytes after the last member that are not a gzip header are ignored, as gzip does.
+ *
+ * @return the index, or NULL if the file is not valid gzip or memory is exhausted
+ */
+static gz_index_t *gz_build(int fd, off_t span) {
+    gz_index_t *gz = (gz_index_t*) calloc(1, sizeof(gz_index_t));
+    unsigned char *input = (unsigned char*) malloc(TAR_GZ_CHUNK);
+    unsigned char *window = (unsigned char*) malloc(TAR_GZ_WINDOW);
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (!gz || !input || !window || inflateInit2(&strm, 47) != Z_OK) { // 47: gzip or zlib header, 32 KiB window
+        free(input); free(window); gz_free(gz);
+        return NULL;
+    }
+    gz->fd = fd;
+    off_t in_pos = 0, totin = 0, totout = 0, last = 0;
+    int ret = Z_OK;
+    strm.avail_out = 0;
+    do {
+        ssize_t got = read_at(fd, input, TAR_GZ_CHUNK, in_pos);
+        if (got <= 0) { // truncated or unreadable
+            ret = Z_DATA_ERROR;
+            break;
+        }
+        in_pos += got;
+        strm.next_in = input;
+        strm.avail_in = got;
+        do {
+            if (strm.avail_out == 0) {
+                strm.next_out = window;
+                strm.avail_out = TAR_GZ_WINDOW;
+            }
+            totin += strm.avail_in;
+            totout += strm.avail_out;
+            ret = inflate(&strm, Z_BLOCK); // returns at the end of each deflate block
+            totin -= strm.avail_in;
+            totout -= strm.avail_out;
+            if (ret == Z_STREAM_END && gz_member_at(fd, totin)) { // another member follows the trailer
+                if (inflateReset(&strm) != Z_OK || gz_add_point(gz, 0, totin, totout, 0, NULL) != 0) {
+                    ret = Z_MEM_ERROR;
+                    break;
+                }
+                ret = Z_OK;
+                last = totout;
+                continue;
+            }
+            if (ret == Z_NEED_DICT || ret == Z_MEM_ERROR || ret == Z_DATA_ERROR || ret == Z_STREAM_END) break;
+            // bit 128: at a block boundary, bit 64: after the last block
+            if ((strm.data_type & 128) && !(strm.data_type & 64) && (totout == 0 || totout - last > span)) {
+                if (gz_add_point(gz, strm.data_type & 7, totin, totout, strm.avail_out, window) != 0) {
+                    ret = Z_MEM_ERROR;
+                    break;
+                }
+                last = totout;
+            }
+        } while (strm.avail_in != 0);
+    } while (ret == Z_OK || ret == Z_BUF_ERROR);
+    inflateEnd(&strm);
+    free(input);
+    free(window);
+    if (ret != Z_STREAM_END || gz->no_points == 0) {
+        gz_free(gz);
+        return NULL;
+    }
+    gz->size = totout;
+    return gz;
+}
+
+/**
+ * Inflates from the last checkpoint at or before offset, drops the output up to offset and fills buf
+ * up to the end of the member holding offset.
+ *
+ * @return the number of bytes read, short at the end of the member, -1 on error
+ */
+static ssize_t gz_read_member(gz_index_t *gz, void *buf, size_t len, off_t offset) {
+    size_t lo = 0, hi = gz->no_points; // last point with out <= offset
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (gz->points[mid].out <= offset) lo = mid;
+        else hi = mid;
+    }
+    gz_point_t *point = &gz->points[lo];
+    unsigned char *input = (unsigned char*) malloc(TAR_GZ_CHUNK);
+    unsigned char *discard = (unsigned char*) malloc(TAR_GZ_WINDOW);
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    // raw deflate when the gzip header is behind us, the header and trailer of the member otherwise
+    if (!input || !discard || inflateInit2(&strm, point->member ? 31 : -15) != Z_OK) {
+        free(input); free(discard);
+        return -1;
+    }
+    off_t in_pos = point->in;
+    int ret = Z_OK;
+    if (point->bits) { // the block starts inside the previous byte
+        unsigned char byte;
+        if (read_at(gz->fd, &byte, 1, in_pos - 1) != 1) ret = Z_DATA_ERROR;
+        else inflatePrime(&strm, point->bits, byte >> (8 - point->bits));
+    }
+    if (ret == Z_OK && !point->member) inflateSetDictionary(&strm, point->window, TAR_GZ_WINDOW);
+    off_t skip = offset - point->out;
+    int filling = 0;
+    while (ret == Z_OK && !filling) {
+        if (skip == 0) { // reached offset, output goes to buf from now on
+            strm.next_out = (unsigned char*) buf;
+            strm.avail_out = len;
+            filling = 1;
+        } else {
+            size_t n = skip > TAR_GZ_WINDOW ? TAR_GZ_WINDOW : skip;
+            strm.next_out = discard;
+            strm.avail_out = n;
+            skip -= n;
+        }
+        while (strm.avail_out != 0) {
+            if (strm.avail_in == 0) {
+                ssize_t got = read_at(gz->fd, input, TAR_GZ_CHUNK, in_pos);
+                if (got <= 0) {
+                    ret = Z_DATA_ERROR;
+                    break;
+                }
+                in_pos += got;
+                strm.next_in = input;
+                strm.avail_in = got;
+            }
+            ret = inflate(&strm, Z_NO_FLUSH);
+            if (ret != Z_OK) break;
+        }
+    }
+    ssize_t result = (ret == Z_OK || ret == Z_STREAM_END) && filling ? (ssize_t) (len - strm.avail_out) : -1;
+    inflateEnd(&strm);
+    free(input);
+    free(discard);
+    return result;
+}
+
+/**
+ * pread() on the uncompressed archive, inflating member after member when the range crosses the end of one.
+ * Safe to call from several threads at once.
+ *
+ * @return the number of bytes read, short only at the end of the archive, -1 on error
+ */
+static ssize_t gz_read(gz_index_t *gz, void *buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len && offset + (off_t) done < gz->size) {
+        ssize_t got = gz_read_member(gz, (char*) buf + done, len - done, offset + done);
+        if (got < 0) return -1;
+        if (got == 0) break;
+        done += got;
+    }
+    return done;
+}
+
+/**
+ * Reads from the archive itself, or through the checkpoint index when gz is not NULL.
+ */
+static ssize_t source_read(int fd, gz_index_t *gz, void *buf, size_t len, off_t offset) {
+    return gz ? gz_read(gz, buf, len, offset) : read_at(fd, buf, len, offset);
+}
+
+/* Windows of the block reader start small and double up to this size while they are consumed entirely */
+#define TAR_WINDOW_MIN (64 * 1024)
+#define TAR_WINDOW_MAX (4 * 1024 * 1024)
+
+/**
+ * Reads an archive by large windows so that consecutive headers are decoded from memory
+ * instead of issuing one system call per 512-byte block.
+ */
+typedef struct block_reader {
+    int fd;
+    gz_index_t *gz;  // checkpoints of a compressed archive, NULL to read fd as is
+    char *window;
+    size_t size;     // allocated size of window
+    size_t len;      // valid bytes in window
+    off_t start;     // archive offset of window[0]
+} block_reader_t;
+
+static int reader_init(block_reader_t *reader, int fd) {
+    reader->fd = fd;
+    reader->gz = NULL;
+    reader->window = (char*) malloc(TAR_WINDOW_MIN);
+    reader->size = TAR_WINDOW_MIN;
+    reader->len = 0;
+    reader->start = 0;
+    if (!reader->window) return -1;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return 0;
+}
+
+/**
+ * Gives access to the 512-byte block at offset. Payloads that fit in the current window are skipped for free,
+ * a block outside of it refills the window from that offset, so larger payloads are never read.
+ *
+ * @return a pointer to the block, valid until the next call, or NULL at the end of the archive
+ */
+static char *reader_block(block_reader_t *reader, off_t offset) {
+    if (offset >= reader->start && offset + 512 <= reader->start + (off_t) reader->len) {
+        return reader->window + (offset - reader->start);
+    }
+    if (reader->len == reader->size && reader->size < TAR_WINDOW_MAX) { // last window was used up, widen the next one
+        char *window = (char*) realloc(reader->window, reader->size * 2);
+        if (window) {
+            reader->window = window;
+            reader->size *= 2;
+        }
+    }
+    ssize_t got = source_read(reader->fd, reader->gz, reader->window, reader->size, offset);
+    reader->start = offset;
+    reader->len = got < 0 ? 0 : got;
+    return reader->len >= 512 ? reader->window : NULL;
+}
+
+static void reader_free(block_reader_t *reader) {
+    free(reader->window);
+}
+
+/**
+ * Checks magic, version and checksum of a non-null header.
+ *
+ * @return zero if the header is valid, -1, -2 or -3 as check_archive() otherwise
+ */
+static int check_header(tar_header_t *header) {
+    if(strncmp(header->magic, TMAGIC, TMAGLEN) != 0) return -1; // magic value is not ustar
+    if(strncmp(header->version, TVERSION, TVERSLEN) != 0) return -2;   // version value is not 00
+    if(TAR_INT(header->chksum) != checksum((char*) header)) return -3;// invalid checksum-> dangerous file
+    return 0;
+}
+
+/* Number of 512-byte blocks holding a payload of the given size */
+#define TAR_BLOCKS(size) (((size) + 511) / 512)
+/* Longest name held by the prefix and name fields of a ustar header, with the slash joining them */
+#define TAR_NAME_MAX (155 + 1 + 100 + 1)
+/* Extended headers larger than this are skipped without being applied */
+#define TAR_EXT_MAX (1024 * 1024)
+
+/**
+ * @return 1 if blocks of payload follow a header of this type, as for files and extended headers, 0 otherwise
+ */
+static int has_payload(char typeflag) {
+    return typeflag != LNKTYPE && typeflag != SYMTYPE && typeflag != CHRTYPE && typeflag != BLKTYPE
+           && typeflag != DIRTYPE && typeflag != FIFOTYPE;
+}
+
+/**
+ * @return 1 for the headers that only describe the entry after them: PAX extended headers and GNU long names
+ */
+static int is_extended(char typeflag) {
+    return typeflag == XHDTYPE || typeflag == XGLTYPE || typeflag == GNUTYPE_LONGNAME || typeflag == GNUTYPE_LONGLINK;
+}
+
+/**
+ * Values that extended headers give to the entries after them, in place of the fields of their own header.
+ */
+typedef struct tar_ext {
+    char *name;             // next entry only, from 'x' or 'L'
+    char *linkname;         // next entry only, from 'x' or 'K'
+    int64_t size;           // next entry only, from 'x', -1 if unset
+    char *global_name;      // every entry that follows, from 'g'
+    char *global_linkname;
+    int64_t global_size;
+} tar_ext_t;
+
+static void ext_init(tar_ext_t *ext) {
+    memset(ext, 0, sizeof(*ext));
+    ext->size = ext->global_size = -1;
+}
+
+/**
+ * Forgets the values that applied to the entry just described.
+ */
+static void ext_next(tar_ext_t *ext) {
+    free(ext->name); free(ext->linkname);
+    ext->name = ext->linkname = NULL;
+    ext->size = -1;
+}
+
+static void ext_free(tar_ext_t *ext) {
+    ext_next(ext);
+    free(ext->global_name); free(ext->global_linkname);
+}
+
+/**
+ * Replaces *field with a copy of len bytes of value.
+ */
+static int ext_set(char **field, const char *value, size_t len) {
+    char *copy = strndup(value, len);
+    if (!copy) return -1;
+    free(*field);
+    *field = copy;
+    return 0;
+}
+
+/**
+ * Records what an extended header says about the entries after it.
+ * A PAX header is a list of "<length> <key>=<value>\n" records, of which path, linkpath and size are kept.
+ *
+ * @param payload The payload of the extended header, nul-terminated.
+ *
+ * @return zero on success, -1 if memory is exhausted
+ */
+static int ext_apply(tar_ext_t *ext, char typeflag, const char *payload, size_t len) {
+    if (typeflag == GNUTYPE_LONGNAME) return ext_set(&ext->name, payload, len);
+    if (typeflag == GNUTYPE_LONGLINK) return ext_set(&ext->linkname, payload, len);
+    int global = typeflag == XGLTYPE;
+    const char *p = payload, *end = payload + len;
+    while (p < end) {
+        char *after;
+        long record = strtol(p, &after, 10);
+        if (record <= 0 || record > end - p || *after != ' ' || p[record - 1] != '\n') break; // malformed, stop there
+        const char *key = after + 1, *last = p + record - 1;
+        const char *equal = key < last ? memchr(key, '=', last - key) : NULL;
+        if (equal) {
+            const char *value = equal + 1;
+            size_t key_len = equal - key;
+            int status = 0;
+            if (key_len == 4 && memcmp(key, "path", 4) == 0) {
+                status = ext_set(global ? &ext->global_name : &ext->name, value, last - value);
+            } else if (key_len == 8 && memcmp(key, "linkpath", 8) == 0) {
+                status = ext_set(global ? &ext->global_linkname : &ext->linkname, value, last - value);
+            } else if (key_len == 4 && memcmp(key, "size", 4) == 0) {
+                *(global ? &ext->global_size : &ext->size) = strtoll(value, NULL, 10);
+            }
+            if (status != 0) return -1;
+        }
+        p += record;
+    }
+    return 0;
+}
+
+/**
+ * Describes the entry of a header with the values of the extended headers before it.
+ *
+ * @param name_buf A buffer of TAR_NAME_MAX bytes, used when the name comes from the header.
+ * @param link_buf A buffer of sizeof(header->linkname) + 1 bytes, used when the link name comes from the header.
+ */
+static void ext_entry(tar_ext_t *ext, tar_header_t *header, char *name_buf, char *link_buf,
+                      char **name, char **linkname, size_t *size) {
+    if (ext->name || ext->global_name) *name = ext->name ? ext->name : ext->global_name;
+    else {
+        *name = name_buf;
+        if (strncmp(header->magic, TMAGIC, TMAGLEN) == 0 && header->prefix[0] != '\0') { // ustar splits long names
+            snprintf(name_buf, TAR_NAME_MAX, "%.*s/%.*s", (int) sizeof(header->prefix), header->prefix,
+                     (int) sizeof(header->name), header->name);
+        } else snprintf(name_buf, TAR_NAME_MAX, "%.*s", (int) sizeof(header->name), header->name);
+    }
+    if (ext->linkname || ext->global_linkname) *linkname = ext->linkname ? ext->linkname : ext->global_linkname;
+    else {
+        *linkname = link_buf;
+        snprintf(link_buf, sizeof(header->linkname) + 1, "%.*s", (int) sizeof(header->linkname), header->linkname);
+    }
+    int64_t value = ext->size >= 0 ? ext->size : ext->global_size >= 0 ? ext->global_size : TAR_INT(header->size);
+    *size = value < 0 ? 0 : value;
+}
+
+/**
+ * Walks the entries of an archive through a block reader, applying extended headers on the way,
+ * so that every scan sees the same names, sizes and payload offsets.
+ */
+typedef struct tar_walk {
+    block_reader_t reader;
+    off_t pos;              // offset of the next header
+    tar_ext_t ext;
+    int described;          // 1 once the current entry was described, its extended values are then dropped
+    char *name;             // current entry, set by walk_step() and walk_next()
+    char *linkname;
+    char typeflag;
+    size_t size;
+    off_t data_offset;
+    tar_header_t *header;   // header of the current entry, valid until the next step
+    char name_buf[TAR_NAME_MAX];
+    char link_buf[sizeof(((tar_header_t*) 0)->linkname) + 1];
+} tar_walk_t;
+
+static int walk_init(tar_walk_t *walk, int tar_fd) {
+    walk->pos = 0;
+    walk->described = 0;
+    ext_init(&walk->ext);
+    return reader_init(&walk->reader, tar_fd);
+}
+
+static void walk_free(tar_walk_t *walk) {
+    reader_free(&walk->reader);
+    ext_free(&walk->ext);
+}
+
+/**
+ * @return the header at the current position, valid until the next step, or NULL at the end of the archive
+ */
+static tar_header_t *walk_header(tar_walk_t *walk) {
+    char *buffer = reader_block(&walk->reader, walk->pos);
+    return buffer && *buffer != '\0' ? (tar_header_t*) buffer : NULL;
+}
+
+/**
+ * Moves past the header at the current position and its payload, whatever its type.
+ *
+ * @return 1 if it was the header of an entry, now described by walk,
+ *         zero if it was an extended header, recorded for the next entry,
+ *         -1 if the archive ends in the middle of an extended header or memory is exhausted
+ */
+static int walk_step(tar_walk_t *walk) {
+    if (walk->described) ext_next(&walk->ext);
+    walk->described = 0;
+    tar_header_t *header = (tar_header_t*) reader_block(&walk->reader, walk->pos);
+    if (!header) return -1;
+    count_header();
+    walk->pos += 512;
+    if (is_extended(header->typeflag)) {
+        char typeflag = header->typeflag;
+        int64_t value = TAR_INT(header->size);
+        size_t size = value < 0 ? 0 : value;
+        off_t data = walk->pos;
+        walk->pos += 512 * TAR_BLOCKS(size);
+        if (size > TAR_EXT_MAX) return 0; // not applied, the entry keeps the fields of its own header
+        char *payload = (char*) malloc(size + 1);
+        if (!payload) return -1;
+        for (size_t done = 0; done < size; done += 512) { // header is invalid from here on
+            char *block = reader_block(&walk->reader, data + done);
+            if (!block) {
+                free(payload);
+                return -1;
+            }
+            memcpy(payload + done, block, size - done < 512 ? size - done : 512);
+        }
+        payload[size] = '\0';
+        int status = ext_apply(&walk->ext, typeflag, payload, strnlen(payload, size));
+        free(payload);
+        return status;
+    }
+    ext_entry(&walk->ext, header, walk->name_buf, walk->link_buf, &walk->name, &walk->linkname, &walk->size);
+    walk->typeflag = header->typeflag;
+    walk->data_offset = walk->pos;
+    walk->header = header;
+    walk->described = 1;
+    if (has_payload(header->typeflag)) walk->pos += 512 * TAR_BLOCKS(walk->size); // go to next header
+    return 1;
+}
+
+/**
+ * Moves to the next entry of the archive.
+ *
+ * @return 1 if walk describes the next entry, zero at the end of the archive or if it cannot be read further
+ */
+static int walk_next(tar_walk_t *walk) {
+    while (walk_header(walk) != NULL) {
+        int status = walk_step(walk);
+        if (status != 0) return status > 0;
+    }
+    return 0;
+}
+
+static int check_archive_impl(int tar_fd) {
+    int result = 0;
+    tar_walk_t walk; // explicit offsets, the file descriptor pointer is never moved
+    if(walk_init(&walk, tar_fd) != 0) return EXIT_FAILURE;
+    tar_header_t *header;
+    while((header = walk_header(&walk)) != NULL){ // stops at the end of archive '\0'
+        int status = check_header(header);
+        if (status < 0) { // if it is invalid archive
+            result = status;
+            break;
+        }
+        result++; // one header successfully passed, extended headers included
+        if (walk_step(&walk) < 0) break; // the payload of an extended header is cut
+    }
+    walk_free(&walk); //garbage buffer
+    return result;
+}
 
 /**
  * Checks whether the archive is valid.
@@ -17,28 +683,161 @@
  *         -3 if the archive contains a header with an invalid checksum value
  */
 int check_archive(int tar_fd) {
-    int result = 0;
-    char *buffer = (char*)malloc(sizeof(char)*512);
-    if(!buffer) return EXIT_FAILURE;
-    while(read(tar_fd, buffer, 512)){
-        if (*buffer == AREGTYPE) break; //end of archive/file '\0'
-        tar_header_t *header = (tar_header_t*) buffer;
-        // hardcoded value to test if strcmp don't work
-        if(strncmp(header->magic, TMAGIC, TMAGLEN) != 0) result = -1; // magic value is not ustar
-        else if(strncmp(header->version, TVERSION, TVERSLEN) != 0) result = -2;   // version value is not 00
-        else if(TAR_INT(header->chksum) != checksum(buffer)) result = -3;// invalid checksum-> dangerous file
-        if (result < 0) break; // if it is invalid archive
-        if(header->typeflag == REGTYPE ){
-            size_t size = TAR_INT(header->size);
-            if(size != 0) lseek(tar_fd, 512*(size/512 +1), SEEK_CUR);
-        }
-        result++; // one header successfully passed
-    }
-    free(buffer); //garbage buffer
-    lseek(tar_fd, 0, SEEK_SET); //reset file descriptor pointer
+    tar_call_t call;
+    call_begin(&call, TAR_FN_CHECK_ARCHIVE);
+    int result = check_archive_impl(tar_fd);
+    call_end(&call);
+    return result;
+}
+
+/* Smallest byte range of the archive given to a thread by check_archive_parallel() */
+#define TAR_CHECK_RANGE_MIN (1024 * 1024)
+
+typedef struct check_job {
+    int tar_fd;
+    off_t start;             // byte range of the archive in which this job looks for headers
+    off_t end;
+    off_t from;              // first valid header found in the range, -1 if none
+    off_t next;              // offset of the first header past the range, reached by walking from from
+    int count;               // headers walked from from up to next
+    int status;              // error of the invalid header that stopped the walk, zero if none
+    int ended;               // 1 if the walk stopped before next: end of archive, invalid or cut header
+    int failed;              // 1 if memory is exhausted
+    int on_thread;           // 1 if the job runs on its own thread, 0 if the caller runs it
+    tar_call_t *call;        // call of the caller, counting the reads of every job
+} check_job_t;
+
+/**
+ * Walks and checks the headers from offset from, as check_archive() does, until the next header lies past the
+ * range of the job. The walk goes on after an extended header so that next never depends on one left behind.
+ */
+static void check_walk(check_job_t *job, off_t from) {
+    tar_walk_t walk;
+    job->from = from;
+    job->count = 0;
+    job->status = 0;
+    job->ended = 1;
+    job->failed = walk_init(&walk, job->tar_fd) != 0;
+    if (job->failed) return;
+    walk.pos = from;
+    int step = 1;
+    job->ended = 0;
+    while (!job->ended && (walk.pos < job->end || step == 0)) {
+        tar_header_t *header = walk_header(&walk);
+        if (header) job->status = check_header(header);
+        if (!header || job->status < 0) { // end of archive or invalid header
+            job->ended = 1;
+            break;
+        }
+        job->count++;
+        step = walk_step(&walk);
+        job->ended = step < 0; // the payload of an extended header is cut
+    }
+    job->next = walk.pos;
+    walk_free(&walk);
+}
+
+/**
+ * Finds the first block of the range that is a valid header and walks the headers from there.
+ * The block may be the payload of a file that looks like a header, the caller then walks the range again.
+ */
+static void *check_worker(void *arg) {
+    check_job_t *job = (check_job_t*) arg;
+    tar_call_t *previous = call_adopt(job->call);
+    block_reader_t reader;
+    off_t from = -1;
+    if (reader_init(&reader, job->tar_fd) == 0) {
+        for (off_t offset = job->start; offset < job->end && from < 0; offset += 512) {
+            char *block = reader_block(&reader, offset);
+            if (!block) break;
+            if (*block != '\0' && check_header((tar_header_t*) block) == 0) from = offset;
+        }
+        reader_free(&reader);
+    }
+    if (from >= 0) check_walk(job, from);
+    call_adopt(previous);
+    return NULL;
+}
+
+static int check_archive_parallel_impl(int tar_fd, int no_threads) {
+    if (no_threads <= 1) return check_archive(tar_fd); // a single pass is cheaper without other threads
+    struct stat st;
+    if (fstat(tar_fd, &st) != 0) return EXIT_FAILURE;
+    if (no_threads > st.st_size / TAR_CHECK_RANGE_MIN + 1) no_threads = st.st_size / TAR_CHECK_RANGE_MIN + 1;
+    pthread_t *threads = (pthread_t*) malloc(sizeof(pthread_t) * no_threads);
+    check_job_t *jobs = (check_job_t*) malloc(sizeof(check_job_t) * no_threads);
+    if (!threads || !jobs) {
+        free(threads); free(jobs);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < no_threads; i++) { // block aligned ranges, the last one runs to the end of the file
+        jobs[i] = (check_job_t) {tar_fd, st.st_size / no_threads * i / 512 * 512, 0, -1, 0, 0, 0, 1, 0, 0, current_call};
+        if (i > 0) jobs[i - 1].end = jobs[i].start;
+    }
+    jobs[no_threads - 1].end = st.st_size;
+    for (int i = 1; i < no_threads; i++) {
+        jobs[i].on_thread = pthread_create(&threads[i], NULL, check_worker, &jobs[i]) == 0;
+    }
+    check_walk(&jobs[0], 0); // the first range starts with a header
+    for (int i = 1; i < no_threads; i++) {
+        if (jobs[i].on_thread) pthread_join(threads[i], NULL);
+        else check_worker(&jobs[i]); // a range whose thread could not be created
+    }
+
+    // chain the ranges: the walk of a range is kept if it starts where the walk of the previous ones stopped
+    int result = 0, failed = 0;
+    off_t pos = 0;
+    for (int i = 0; i < no_threads; i++) {
+        if (pos >= jobs[i].end) continue; // the range lies in the payload of an earlier file
+        if (jobs[i].from != pos) check_walk(&jobs[i], pos); // the header found by the job was in a payload
+        if (jobs[i].failed) {
+            failed = 1;
+            break;
+        }
+        result += jobs[i].count;
+        if (jobs[i].status < 0) result = jobs[i].status; // first invalid header in archive order
+        if (jobs[i].ended) break;
+        pos = jobs[i].next;
+    }
+    free(threads); free(jobs);
+    return failed ? EXIT_FAILURE : result;
+}
+
+/**
+ * Same as check_archive(), with the headers checked by several threads.
+ * Each thread takes a byte range of the file, finds its first valid header and walks the headers from there.
+ * The walks are then chained in archive order, a range whose first header was found in the payload of a file
+ * is walked again from the header the previous ranges lead to.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ * @param no_threads The number of threads checking headers, 1 or less falls back to check_archive().
+ *
+ * @return the same value as check_archive(): the number of non-null headers,
+ *         or the error of the first invalid header in archive order.
+ */
+int check_archive_parallel(int tar_fd, int no_threads) {
+    tar_call_t call;
+    call_begin(&call, TAR_FN_CHECK_ARCHIVE_PARALLEL);
+    int result = check_archive_parallel_impl(tar_fd, no_threads);
+    call_end(&call);
     return result;
 }
 
+static int exists_impl(int tar_fd, char *path) {
+    if(path == NULL) return 0;
+    tar_walk_t walk; // explicit offsets, the file descriptor pointer is never moved
+    if(walk_init(&walk, tar_fd) != 0) return EXIT_FAILURE;
+    while(walk_next(&walk)){ // payloads of every type are skipped, extended headers give the full names
+        // if it exists
+        if (strncmp(walk.name, path, strlen(path) - 1) == 0){
+            walk_free(&walk); //garbage buffer
+            return 1;  //  we found the directory
+        }
+    }
+    walk_free(&walk); //garbage buffer
+    return 0; // not exists xor not valid archive
+}
+
 /**
  * Checks whether an entry exists in the archive.
  *
@@ -49,26 +848,26 @@ int check_archive(int tar_fd) {
  *         any other value otherwise.
  */
 int exists(int tar_fd, char *path) {
+    tar_call_t call;
+    call_begin(&call, TAR_FN_EXISTS);
+    int result = exists_impl(tar_fd, path);
+    call_end(&call);
+    return result;
+}
+
+static int is_dir_impl(int tar_fd, char *path) {
     if(path == NULL) return 0;
-    char *buffer = (char *) malloc(sizeof(char)*512);
-    if(!buffer) return EXIT_FAILURE;
-    while(read(tar_fd, buffer, 512)){
-        tar_header_t *header = (tar_header_t*) buffer;
-        // if it exists
-        if (strncmp(header->name, path, strlen(path) - 1) == 0){
-            lseek(tar_fd, 0, SEEK_SET); // reset file descriptor pointer
-            free(buffer); //garbage buffer
+    tar_walk_t walk; // explicit offsets, the file descriptor pointer is never moved
+    if(walk_init(&walk, tar_fd) != 0) return EXIT_FAILURE;
+    while(walk_next(&walk)){
+        // if it is the directory we search for
+        if (strcmp(walk.name, path) == 0 && walk.typeflag == DIRTYPE){
+            walk_free(&walk); //garbage buffer
             return 1;  //  we found the directory
         }
-        // if it is a simple file
-        if( header->typeflag == REGTYPE ) {
-            size_t size = TAR_INT(header->size); // get the size of this file
-            if(size != 0) lseek (tar_fd, 512*(size/512 +1), SEEK_CUR);  // Go to next header
-        }
     }
-    free(buffer); //garbage buffer
-    lseek(tar_fd, 0, SEEK_SET); // reset file descriptor pointer
-    return 0; // not exists xor not valid archive
+    walk_free(&walk); //garbage buffer
+    return 0; // not found xor was a file xor not a valid archive
 }
 
 /**
@@ -81,25 +880,25 @@ int exists(int tar_fd, char *path) {
  *         any other value otherwise.
  */
 int is_dir(int tar_fd, char *path) {
+    tar_call_t call;
+    call_begin(&call, TAR_FN_IS_DIR);
+    int result = is_dir_impl(tar_fd, path);
+    call_end(&call);
+    return result;
+}
+
+static int is_file_impl(int tar_fd, char *path) {
     if(path == NULL) return 0;
-    char *buffer = (char *) malloc(sizeof(char)*512);
-    if(!buffer) return EXIT_FAILURE;
-    while(read(tar_fd, buffer, 512)){
-        tar_header_t *header = (tar_header_t*) buffer;
-        // if it is the directory we search for
-        if (strcmp(header->name, path) == 0 &&  header->typeflag == DIRTYPE){
-            free(buffer); //garbage buffer
-            lseek(tar_fd, 0, SEEK_SET); // reset file descriptor pointer
+    tar_walk_t walk; // explicit offsets, the file descriptor pointer is never moved
+    if(walk_init(&walk, tar_fd) != 0) return EXIT_FAILURE;
+    while(walk_next(&walk)){
+        // if it is the file we search for
+        if (strcmp(walk.name, path) == 0 && walk.typeflag == REGTYPE){
+            walk_free(&walk); //garbage buffer
             return 1;  //  we found the directory
         }
-        // if it is a simple file
-        if( header->typeflag == REGTYPE ) {
-            size_t size = TAR_INT(header->size); // get the size of this file
-            if(size != 0) lseek (tar_fd, 512*(size/512 +1), SEEK_CUR);  // Go to next header
-        }
     }
-    free(buffer); //garbage buffer
-    lseek(tar_fd, 0, SEEK_SET); // reset file descriptor pointer
+    walk_free(&walk); //garbage buffer
     return 0; // not found xor was a file xor not a valid archive
 }
 
@@ -112,26 +911,25 @@ int is_dir(int tar_fd, char *path) {
  * @return zero if no entry at the given path exists in the archive or the entry is not a file,
  *         any other value otherwise.
  */
-int is_file(int tar_fd, char *path){
-    if(path == NULL) return 0;
-    char *buffer = (char *) malloc(sizeof(char)*512);
-    if(!buffer) return EXIT_FAILURE;
-    while(read(tar_fd, buffer, 512)){
-        tar_header_t *header = (tar_header_t*) buffer;
-        // if it is the file we search for
-        if (strcmp(header->name, path) == 0 && header->typeflag == REGTYPE){
-            free(buffer); //garbage buffer
-            lseek(tar_fd, 0, SEEK_SET); // reset file descriptor pointer
+int is_file(int tar_fd, char *path) {
+    tar_call_t call;
+    call_begin(&call, TAR_FN_IS_FILE);
+    int result = is_file_impl(tar_fd, path);
+    call_end(&call);
+    return result;
+}
+
+static int is_symlink_impl(int tar_fd, char *path) {
+    tar_walk_t walk; // explicit offsets, the file descriptor pointer is never moved
+    if(walk_init(&walk, tar_fd) != 0) return EXIT_FAILURE;
+    while(walk_next(&walk)){
+        // if it is the symlink we search for
+        if (strcmp(walk.name, path) == 0 && walk.typeflag == SYMTYPE){
+            walk_free(&walk); //garbage buffer
             return 1;  //  we found the directory
         }
-        // if it is a simple file but not the one we search for
-        if( header->typeflag == REGTYPE ) {
-            size_t size = TAR_INT(header->size); // get the size of this file
-            if(size != 0) lseek (tar_fd, 512*(size/512 +1), SEEK_CUR);  // Go to next header
-        }
     }
-    free(buffer); //garbage buffer
-    lseek(tar_fd, 0, SEEK_SET); // reset file descriptor pointer
+    walk_free(&walk); //garbage buffer
     return 0; // not found xor was a file xor not a valid archive
 }
 
@@ -144,36 +942,98 @@ int is_file(int tar_fd, char *path){
  *         any other value otherwise.
  */
 int is_symlink(int tar_fd, char *path) {
-    char *buffer = (char *) malloc(sizeof(char)*512);
-    if(!buffer) return EXIT_FAILURE;
-    while(read(tar_fd, buffer, 512)){
-        tar_header_t *header = (tar_header_t*) buffer;
-        // if it is the directory we search for
-        //printf("H: -  %s *** P: -  %s *** T: -  %c\n", header->name, path, header->typeflag);
-        if (strcmp(header->name, path) == 0 &&  header->typeflag == SYMTYPE){
-            free(buffer); //garbage buffer
-            lseek(tar_fd, 0, SEEK_SET); // reset file descriptor pointer
-            return 1;  //  we found the directory
-        }
-        // if it is a simple file
-        if( header->typeflag == REGTYPE ) {
-            size_t size = TAR_INT(header->size); // get the size of this file
-            if(size != 0) lseek (tar_fd, 512*(size/512 +1), SEEK_CUR);  // Go to next header
-        }
-    }
-    free(buffer); //garbage buffer
-    lseek(tar_fd, 0, SEEK_SET); // reset file descriptor pointer
-    return 0; // not found xor was a file xor not a valid archive
+    tar_call_t call;
+    call_begin(&call, TAR_FN_IS_SYMLINK);
+    int result = is_symlink_impl(tar_fd, path);
+    call_end(&call);
+    return result;
 }
 
 
 /**
- * Lists the entries at a given path in the archive.
- * list() does not recurse into the directories listed at the given path.
- *
- * Example:
- *  dir/          list(..., "dir/", ...) lists "dir/a", "dir/b", "dir/c/" and "dir/e/"
- *   ├── a
+ * @return the length of the directory holding name, trailing slash included, 0 for a top-level entry
+ */
+static size_t parent_len(const char *name) {
+    size_t len = strlen(name);
+    if (len > 0 && name[len - 1] == '/') len--; // a directory is held by the directory above it
+    while (len > 0 && name[len - 1] != '/') len--;
+    return len;
+}
+
+static int list_hops(int tar_fd, char *path, char **entries, size_t *no_entries, int hops);
+static int find_file_hops(int tar_fd, char *path, off_t *data_offset, size_t *size, int hops);
+
+/* Longest path built while resolving a symlink */
+#define TAR_PATH_MAX 4096
+/* Symlinks followed while resolving one path before giving up, as the MAXSYMLINKS of Linux */
+#define TAR_MAX_HOPS 40
+
+/**
+ * Joins the target of a symlink to the directory holding the link and removes the empty, "." and ".." components.
+ * An absolute target starts from the root of the archive, and ".." never climbs above it.
+ * The result has no trailing slash.
+ *
+ * @param link_name The name of the symlink entry.
+ * @param target The link name stored in the symlink header.
+ * @param out Set to the normalized path.
+ *
+ * @return zero on success, -1 if the path does not fit in out_len bytes or is empty
+ */
+static int normalize_link(const char *link_name, const char *target, char *out, size_t out_len) {
+    size_t used = 0;
+    size_t base = target[0] == '/' ? 0 : parent_len(link_name);
+    for (int part = 0; part < 2; part++) { // the directory of the link, then the target
+        const char *p = part == 0 ? link_name : target;
+        const char *end = part == 0 ? link_name + base : target + strlen(target);
+        while (p < end) {
+            const char *slash = memchr(p, '/', end - p);
+            size_t len = (slash ? slash : end) - p;
+            if (len == 2 && p[0] == '.' && p[1] == '.') { // drop the last component, if any
+                if (used > 0) used--;
+                while (used > 0 && out[used - 1] != '/') used--;
+            } else if (len > 0 && !(len == 1 && p[0] == '.')) {
+                if (used + len + 2 > out_len) return -1;
+                memcpy(out + used, p, len);
+                used += len;
+                out[used++] = '/';
+            }
+            p += len + 1;
+        }
+    }
+    if (used == 0) return -1;
+    out[used - 1] = '\0'; // no trailing slash
+    return 0;
+}
+
+/**
+ * Computes the path a symlink points to, for list() and read_file().
+ * The target is taken relative to the directory holding the link, or from the root of the archive
+ * when nothing exists there. A directory target gets a trailing slash so that is_dir() finds it.
+ *
+ * @return zero on success, -1 if the target is empty or too long
+ */
+static int link_target(int tar_fd, const char *name, const char *linkname, char *target, size_t target_len) {
+    if (normalize_link(name, linkname, target, target_len) != 0 || !exists(tar_fd, target)) {
+        if (linkname[0] == '\0') return -1;
+        snprintf(target, target_len, "%s", linkname);
+    }
+    size_t len = strlen(target);
+    if (!is_file(tar_fd, target) && !is_symlink(tar_fd, target)
+        && target[len - 1] != '/' && len + 2 <= target_len) strcat(target, "/");
+    return 0;
+}
+
+static int list_impl(int tar_fd, char *path, char **entries, size_t *no_entries) {
+    return list_hops(tar_fd, path, entries, no_entries, 0);
+}
+
+/**
+ * Lists the entries at a given path in the archive.
+ * list() does not recurse into the directories listed at the given path.
+ *
+ * Example:
+ *  dir/          list(..., "dir/", ...) lists "dir/a", "dir/b", "dir/c/" and "dir/e/"
+ *   ├── a
  *   ├── b
  *   ├── c/
  *   │   └── d
@@ -190,49 +1050,50 @@ int is_symlink(int tar_fd, char *path) {
  *         any other value otherwise.
  */
 int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
+    tar_call_t call;
+    call_begin(&call, TAR_FN_LIST);
+    int result = list_impl(tar_fd, path, entries, no_entries);
+    call_end(&call);
+    return result;
+}
+
+/**
+ * list() once hops symlinks were followed to reach path.
+ */
+static int list_hops(int tar_fd, char *path, char **entries, size_t *no_entries, int hops) {
     if(!exists(tar_fd, path)) return 0;
-    char *buffer = (char *) malloc(sizeof(char)*512);
-    char *temp = (char*) malloc(sizeof(char)*100); // same length as the linkname or the name of a header
-    if(!buffer || !temp) return EXIT_FAILURE;
-    strcpy(temp, path);
+    tar_walk_t walk; // explicit offsets, the file descriptor pointer is never moved
+    if(walk_init(&walk, tar_fd) != 0) return EXIT_FAILURE;
     if(is_symlink(tar_fd, path)){
-        while(read(tar_fd, buffer, 512)){
-            tar_header_t *header = (tar_header_t*)buffer;
-            if(strcmp(header->name, path) == 0 && header->typeflag == SYMTYPE) {
-                lseek(tar_fd, 0, SEEK_SET); // reset file descriptor pointer before recursion
-                if(!is_file(tar_fd, header->linkname)){
-                    int i = strlen(header->linkname)-1; while(header->linkname[i] != '/') i--;
-                    if (header->linkname[i+1] != '\0') strcat(header->linkname, "/");
+        while(walk_next(&walk)){
+            if(strcmp(walk.name, path) == 0 && walk.typeflag == SYMTYPE) {
+                char target[TAR_PATH_MAX];
+                int R = 0;
+                if(hops < TAR_MAX_HOPS && link_target(tar_fd, walk.name, walk.linkname, target, sizeof(target)) == 0){
+                    R = list_hops(tar_fd, target, entries, no_entries, hops + 1); // bounded, a symlink loop ends here
                 }
-                int R = list(tar_fd, header->linkname, entries, no_entries);
-                free(buffer);
+                else *no_entries = 0;
+                walk_free(&walk);
                 return R;
             }
-            if(header->typeflag == REGTYPE && TAR_INT(header->size) != 0){
-                lseek(tar_fd, 512*(TAR_INT(header->size)/512 +1), SEEK_CUR); // go to next header
-            }
         }
     }
-    if(!is_dir(tar_fd, temp)){
-        free(buffer); free(temp); //garbage collection
-        lseek(tar_fd, 0, SEEK_SET); //reset file descriptor pointer
+    if(!is_dir(tar_fd, path)){
+        walk_free(&walk); //garbage collection
         *no_entries = 0;
         return 0;
     }
+    walk_free(&walk);
+    if(walk_init(&walk, tar_fd) != 0) return EXIT_FAILURE;
     int entered = 0;
-    tar_header_t *header = (tar_header_t*)buffer;
-    lseek(tar_fd, 512, SEEK_CUR);  // go to next header / first file or dir and not the path given in arg to avoid it in the result
-    while(read(tar_fd, buffer, 512) && entered < *no_entries){
-        if(header->typeflag == REGTYPE && TAR_INT(header->size) != 0){
-            lseek(tar_fd, 512*(TAR_INT(header->size)/512 +1), SEEK_CUR); // go to next header
-        }
-        if(path_helper(path, header->name) && not_in_entries(entries, header->name, entered)) {
-            if(header->typeflag == SYMTYPE) strcpy(entries[entered++], header->linkname);
-            else strcpy(entries[entered++], header->name);
+    walk_next(&walk); // skip the first entry, not the path given in arg to avoid it in the result
+    while(entered < *no_entries && walk_next(&walk)){
+        if(path_helper(path, walk.name) && not_in_entries(entries, walk.name, entered)) {
+            if(walk.typeflag == SYMTYPE) strcpy(entries[entered++], walk.linkname);
+            else strcpy(entries[entered++], walk.name);
         }
     }
-    free(buffer); free(temp); //garbage collection
-    lseek(tar_fd, 0, SEEK_SET);//reset file descriptor pointer
+    walk_free(&walk); //garbage collection
     *no_entries = entered;
     return 1;
 }
@@ -245,9 +1106,10 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
  * @return 0 if ... 1 else
  */
 int path_helper(char *path, char* headerPath){
-    if(strncmp(path, headerPath, strlen(path)-1) != 0) return 0; // check first part of path
-    for(int i = strlen(path); i < strlen(headerPath); i++) {
-        if(headerPath[i] == '/' && i+1 < strlen(headerPath) && headerPath[i+1] != '\0') return 0;
+    size_t path_len = strlen(path), header_len = strlen(headerPath); // computed once, not on every iteration
+    if(strncmp(path, headerPath, path_len-1) != 0) return 0; // check first part of path
+    for(size_t i = path_len; i < header_len; i++) {
+        if(headerPath[i] == '/' && i+1 < header_len && headerPath[i+1] != '\0') return 0;
     }
     return 1;
 }
@@ -257,6 +1119,19 @@ int not_in_entries(char** entries, char* path, int len){
     return 1;
 }
 
+static ssize_t read_file_impl(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len) {
+    off_t data_offset;
+    size_t size;
+    int status = find_file_hops(tar_fd, path, &data_offset, &size, 0);
+    if(status != 0) return status;
+    if(offset >= size) return -2; // offset is outside of file length
+    size_t temp = size - offset; // get the file size without the offset
+    ssize_t got = read_at(tar_fd, dest, temp > *len ? *len:temp, data_offset + offset); // read the file partially or in its entirety dependant of len
+    if(got < 0) return -1;
+    *len = got;
+    return temp - *len; // return size stay to read
+}
+
 /**
  * Reads a file at a given path in the archive.
  *
@@ -276,65 +1151,3196 @@ int not_in_entries(char** entries, char* path, int len){
  *
  */
 ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len) {
-    printf("--- %s\n", path);
+    tar_call_t call;
+    call_begin(&call, TAR_FN_READ_FILE);
+    ssize_t result = read_file_impl(tar_fd, path, offset, dest, len);
+    call_end(&call);
+    return result;
+}
+
+/**
+ * Copies want bytes of the archive from offset in to the current position of out_fd, inside the kernel when it can.
+ * copy_file_range() is tried first, then sendfile(), then pread() and write().
+ *
+ * @param gz The checkpoints of a compressed archive, whose bytes can only be copied through user space, or NULL.
+ * @param done Set to the number of bytes written to out_fd, short of want only if the archive ends first or on error.
+ *
+ * @return zero on success, -1 if out_fd could not be written
+ */
+static int copy_out(int tar_fd, gz_index_t *gz, off_t in, int out_fd, size_t want, size_t *done) {
+    int fallback = gz ? 2 : 0; // 0 copy_file_range(), 1 sendfile(), 2 pread() and write()
+    char buffer[64 * 1024];
+    *done = 0;
+    while (*done < want) {
+        ssize_t got;
+#ifdef __linux__
+        if (fallback < 2) {
+            if (fallback == 0) got = copy_file_range(tar_fd, &in, out_fd, NULL, want - *done, 0);
+            else got = sendfile(out_fd, tar_fd, &in, want - *done);
+            count_io(1, got > 0 ? got : 0);
+        } else
+#else
+        fallback = 2;
+#endif
+        {
+            got = source_read(tar_fd, gz, buffer, want - *done < sizeof(buffer) ? want - *done : sizeof(buffer), in);
+            if (got > 0) {
+                ssize_t written = 0;
+                while (written < got) {
+                    ssize_t w = write(out_fd, buffer + written, got - written);
+                    if (w < 0 && errno == EINTR) continue;
+                    if (w < 0) break;
+                    written += w;
+                }
+                if (written < got) { // what reached out_fd is counted, the rest is an error
+                    *done += written;
+                    return -1;
+                }
+                in += got;
+            }
+        }
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0 && fallback < 2 && *done == 0 && errno != EFBIG && errno != ENOSPC) {
+            fallback++; // e.g. EXDEV, EINVAL, EBADF on O_APPEND or ENOSYS, this kernel or pair of files cannot do it
+            continue;
+        }
+        if (got < 0) return -1;
+        if (got == 0) break; // the archive is shorter than its headers say
+        *done += got;
+    }
+    return 0;
+}
+
+static ssize_t tar_sendfile_impl(int tar_fd, char *path, int out_fd, size_t offset, size_t *len) {
+    off_t data_offset;
+    size_t size;
+    int status = find_file_hops(tar_fd, path, &data_offset, &size, 0);
+    if (status != 0) return status;
+    if (offset >= size) return -2; // offset is outside of file length
+    size_t temp = size - offset; // get the file size without the offset
+    size_t want = temp > *len ? *len : temp;
+    size_t done;
+    status = copy_out(tar_fd, NULL, data_offset + offset, out_fd, want, &done);
+    *len = done;
+    if (status != 0) return -3;
+    return temp - done; // return size stay to copy
+}
+
+/**
+ * Copies a file at a given path in the archive to another file descriptor, e.g. a socket or a file,
+ * without bringing its bytes through user space. copy_file_range() is tried first, then sendfile(),
+ * and only when the kernel refuses both are the bytes moved with pread() and write().
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive to copy. If the entry is a symlink, it is resolved as read_file() does.
+ * @param out_fd A file descriptor written at its current position, which is advanced.
+ * @param offset An offset in the file from which to start copying from, zero indicates the start of the file.
+ * @param len An in-out argument.
+ *            The caller set it to the number of bytes to copy at most.
+ *            The callee set it to the number of bytes written to out_fd.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the offset is outside the file total length,
+ *         -3 if out_fd could not be written, len is then set to the bytes written before the error,
+ *         zero if the file was copied in its entirety,
+ *         a positive value if the file was partially copied, representing the remaining bytes left to be copied to reach
+ *         the end of the file.
+ */
+ssize_t tar_sendfile(int tar_fd, char *path, int out_fd, size_t offset, size_t *len) {
+    tar_call_t call;
+    call_begin(&call, TAR_FN_SENDFILE);
+    ssize_t result = tar_sendfile_impl(tar_fd, path, out_fd, offset, len);
+    call_end(&call);
+    return result;
+}
+
+/**
+ * Finds the payload of the file at path for read_file() and tar_sendfile(), once hops symlinks were followed.
+ *
+ * @param data_offset Set to the offset of the first byte of the file in the archive.
+ * @param size Set to the size of the file.
+ *
+ * @return zero on success, -1 if no file exists at the given path, -2 if its header could not be found again
+ */
+static int find_file_hops(int tar_fd, char *path, off_t *data_offset, size_t *size, int hops) {
     if(!exists(tar_fd, path)) return -1;
-    char* buffer = (char*)malloc(sizeof(char)*512);
-    if(!buffer) return EXIT_FAILURE;
+    tar_walk_t walk; // explicit offsets, the file descriptor pointer is never moved
+    if(walk_init(&walk, tar_fd) != 0) return EXIT_FAILURE;
     if(is_symlink(tar_fd, path)){
-        while(read(tar_fd, buffer, 512)){
-            tar_header_t *header = (tar_header_t*)buffer;
-            if(strcmp(header->name, path) == 0 && header->typeflag == SYMTYPE) {
-                lseek(tar_fd, 0, SEEK_SET); // reset file descriptor pointer before recursion
-                if(!is_file(tar_fd, header->linkname)){
-                    int i = strlen(header->linkname)-1; while(header->linkname[i] != '/') i--;
-                    if (header->linkname[i+1] != '\0') strcat(header->linkname, "/");
+        while(walk_next(&walk)){
+            if(strcmp(walk.name, path) == 0 && walk.typeflag == SYMTYPE) {
+                char target[TAR_PATH_MAX];
+                int R = -1;
+                if(hops < TAR_MAX_HOPS && link_target(tar_fd, walk.name, walk.linkname, target, sizeof(target)) == 0){
+                    R = find_file_hops(tar_fd, target, data_offset, size, hops + 1); // bounded, a symlink loop ends here
                 }
-                ssize_t R = read_file(tar_fd, header->linkname, offset, dest, len);
-                free(buffer);
+                walk_free(&walk);
                 return R;
             }
-            if (header->typeflag == REGTYPE && TAR_INT(header->size)) { //if it is a simple file with size >0
-                int size = TAR_INT(header->size); // get size
-                lseek(tar_fd, 512*(size/512 +1), SEEK_CUR); // move to next header
-            }
         }
     }
     if(is_file(tar_fd, path)){
-        while(read(tar_fd, buffer, 512)){
-            tar_header_t *header = (tar_header_t*)buffer;
-            if(strcmp(path, header->name) == 0 && header->typeflag == REGTYPE) break; // we are on the good header
-            if (header->typeflag == REGTYPE && TAR_INT(header->size)) { //if it is file but not the good one
-                int size = TAR_INT(header->size); // get size
-                lseek(tar_fd, 512*(size/512 +1), SEEK_CUR); // move to next header
+        int R = -2;
+        while(walk_next(&walk)){
+            if(strcmp(path, walk.name) == 0 && walk.typeflag == REGTYPE) { // we are on the good header
+                *size = walk.size;
+                *data_offset = walk.data_offset;
+                R = 0;
+                break;
             }
         }
-        tar_header_t *header = (tar_header_t*)buffer;
-        if(offset >= TAR_INT(header->size)) {
-            free(buffer);
-            lseek(tar_fd, 0, SEEK_SET);
-            return -2; // offset is outside of file length
-        }
-        size_t temp = TAR_INT(header->size) - offset; // get the file size without the offset
-        lseek(tar_fd, offset, SEEK_CUR); // move to after the offset
-        *len = read(tar_fd, dest, temp > *len ? *len:temp); // read the file partially or in its entirety dependant of len
-        lseek(tar_fd, 0, SEEK_SET); // reset file descriptor  pointer
-        free(buffer); // garbage buffer
-        return temp - *len; // return size stay to read
+        walk_free(&walk); // garbage buffer
+        return R;
     }
-    free(buffer);
-    lseek(tar_fd, 0, SEEK_SET);
+    walk_free(&walk);
     return -1; //exclusive return error
 }
 
 
+/**
+ * Reference implementation, also used on machines without SSE2.
+ */
+static long checksum_scalar(const char *buffer) {
+    long result = 0;
+    for (int i = 0; i < 512; i++) result += buffer[i]; // no branch in the loop, the chksum field is fixed below
+    for (int i = 148; i <= 155; i++) result -= buffer[i];
+    return result + 8 * 32; // header checksum counted as 8 spaces
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/*
+ * The SIMD kernels sum the bytes with psadbw, which only adds unsigned bytes. Flipping the top bit of every
+ * byte turns a signed char c into the unsigned c + 128, so 128 * 512 is taken off the total afterwards.
+ */
+__attribute__((target("sse2")))
+static long checksum_sse2(const char *buffer) {
+    __m128i sum = _mm_setzero_si128();
+    const __m128i flip = _mm_set1_epi8((char) 0x80);
+    for (int i = 0; i < 512; i += 16) {
+        __m128i bytes = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (buffer + i)), flip);
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(bytes, _mm_setzero_si128()));
+    }
+    long result = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8)) - 128 * 512;
+    for (int i = 148; i <= 155; i++) result -= buffer[i];
+    return result + 8 * 32;
+}
+
+__attribute__((target("avx2")))
+static long checksum_avx2(const char *buffer) {
+    __m256i sum = _mm256_setzero_si256();
+    const __m256i flip = _mm256_set1_epi8((char) 0x80);
+    for (int i = 0; i < 512; i += 32) {
+        __m256i bytes = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (buffer + i)), flip);
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+    }
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    long result = _mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_srli_si128(half, 8)) - 128 * 512;
+    for (int i = 148; i <= 155; i++) result -= buffer[i];
+    return result + 8 * 32;
+}
+#endif
+
+static long (*checksum_kernel)(const char *buffer) = checksum_scalar;
+static pthread_once_t checksum_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Picks the widest checksum kernel the CPU supports, once per process.
+ */
+static void pick_checksum_kernel(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if ((char) 0x80 > 0) return; // the kernels assume a signed char, as the scalar loop sums char values
+    if (__builtin_cpu_supports("avx2")) checksum_kernel = checksum_avx2;
+    else if (__builtin_cpu_supports("sse2")) checksum_kernel = checksum_sse2;
+#endif
+}
+
 /** @param: buffer A buffer which contains 512 characters including the header
  * @return the checksum excluding the header
  */
 long checksum(char* buffer){
-    long result = 0; // long to compare with TAR_INT without any conversion error
-    for(int i = 0; i < 512; i++){
-        if(i >= 148 && i <= 155) result += 32; // add 4 bytes (sizeof(int))
-        else result = result + *(buffer + i); //exclude header checksum
+    pthread_once(&checksum_once, pick_checksum_kernel);
+    return checksum_kernel(buffer);
+}
+
+#define SWAR_ONES  0x0101010101010101ULL
+#define SWAR_HIGHS 0x8080808080808080ULL
+
+/**
+ * @return a word with the top bit set in every byte of x equal to c, and nothing else
+ */
+static inline uint64_t swar_eq(uint64_t x, uint8_t c) {
+    uint64_t y = x ^ (SWAR_ONES * c);
+    return ~(((y & ~SWAR_HIGHS) + ~SWAR_HIGHS) | y) & SWAR_HIGHS;
+}
+
+/**
+ * @return the number of low-order bytes of x, that is the first bytes in memory, flagged in the byte mask
+ */
+static inline int swar_run(uint64_t mask) {
+    uint64_t holes = ~mask & SWAR_HIGHS;
+    return holes ? __builtin_ctzll(holes) / 8 : 8;
+}
+
+/**
+ * @return a mask covering the n first bytes in memory of a word, 0 <= n <= 8
+ */
+static inline uint64_t swar_prefix(int n) {
+    return n == 8 ? ~0ULL : (1ULL << (8 * n)) - 1;
+}
+
+/**
+ * Parses the octal digits at the start of an 8-byte chunk.
+ *
+ * @param chunk The bytes of the chunk, first byte in the low-order byte.
+ * @param spaces Set to 1 to turn leading spaces into zeroes, kept to 1 if the chunk holds nothing else.
+ * @param no_digits Set to the number of digits parsed, 8 if the number may continue in the next chunk.
+ *
+ * @return the value of the parsed digits
+ */
+static inline uint64_t swar_octal8(uint64_t chunk, int *spaces, int *no_digits) {
+    int lead = *spaces ? swar_run(swar_eq(chunk, ' ')) : 0;
+    *spaces = lead == 8;
+    uint64_t lead_mask = swar_prefix(lead);
+    chunk = (chunk & ~lead_mask) | ((SWAR_ONES * '0') & lead_mask);
+    int n = swar_run(swar_eq(chunk & (SWAR_ONES * 0xf8), '0')); // '0' to '7' share their five top bits
+    *no_digits = n;
+    uint64_t digits = (chunk - SWAR_ONES * '0') & swar_prefix(n);
+    if (n == 0) return 0;
+    digits = __builtin_bswap64(digits) >> (8 * (8 - n)); // last digit in the low-order byte
+    digits = (digits & 0x00ff00ff00ff00ffULL) + ((digits >> 8) & 0x00ff00ff00ff00ffULL) * 8;
+    digits = (digits & 0x0000ffff0000ffffULL) + ((digits >> 16) & 0x0000ffff0000ffffULL) * 64;
+    return (digits & 0xffffffffULL) + (digits >> 32) * 4096;
+}
+
+/**
+ * Parses an octal numeric field of a header without calling strtol().
+ * Leading spaces are skipped and parsing stops at the first byte that is not an octal digit,
+ * so fields written by tar give the same value as strtol(field, NULL, 8), without reading past the field.
+ * A field whose first byte has its high bit set holds a big-endian two's complement number instead,
+ * the base-256 encoding GNU tar uses for sizes of 8 GiB and more.
+ *
+ * @param field The first byte of the field.
+ * @param len The length of the field, e.g. 8 for mode or chksum and 12 for size or mtime.
+ *
+ * @return the value of the field
+ */
+int64_t tar_octal(const char *field, size_t len) {
+    if (len > 0 && (field[0] & 0x80)) { // base-256, 0x80 for a positive number and 0xff for a negative one
+        uint64_t result = field[0] & 0x40 ? ~(uint64_t) 0x3f : 0;
+        result |= field[0] & 0x3f;
+        for (size_t i = 1; i < len; i++) result = (result << 8) | (uint8_t) field[i];
+        return (int64_t) result;
+    }
+    uint64_t result = 0;
+    int spaces = 1;
+    for (size_t done = 0; done < len; done += 8) {
+        uint64_t chunk = 0; // bytes past the field stay nul and stop the parsing
+        if (len - done >= 8) {
+            memcpy(&chunk, field + done, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            chunk = __builtin_bswap64(chunk);
+#endif
+        } else {
+            for (size_t i = 0; i < len - done; i++) chunk |= (uint64_t) (uint8_t) field[done + i] << (8 * i);
+        }
+        int n;
+        uint64_t value = swar_octal8(chunk, &spaces, &n);
+        result = (result << (3 * n)) | value;
+        if (n < 8) break;
+    }
+    return (int64_t) result;
+}
+
+/* Archives are cached by aligned blocks of this size */
+#define TAR_CACHE_BLOCK (16 * 1024)
+
+typedef struct cache_block {
+    dev_t dev;                  // archive holding the block, shared by every handle on the same file
+    ino_t ino;
+    off_t offset;               // multiple of TAR_CACHE_BLOCK
+    size_t len;                 // short only for the last block of the archive
+    struct cache_block *prev;   // least recently used list, most recent first
+    struct cache_block *next;
+    struct cache_block *chain;  // next block of the same bucket
+    uint8_t data[TAR_CACHE_BLOCK];
+} cache_block_t;
+
+struct tar_cache {
+    pthread_mutex_t lock;
+    size_t max_blocks;          // memory budget divided by the block size
+    size_t no_blocks;
+    cache_block_t **buckets;    // chained hash table
+    size_t no_buckets;          // always a power of two
+    cache_block_t *head;
+    cache_block_t *tail;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+static size_t cache_bucket(tar_cache_t *cache, dev_t dev, ino_t ino, off_t offset) {
+    uint64_t hash = ((uint64_t) dev * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t) ino * 0xC2B2AE3D27D4EB4FULL)
+                    ^ (uint64_t) (offset / TAR_CACHE_BLOCK);
+    hash ^= hash >> 29;
+    hash *= 0xBF58476D1CE4E5B9ULL;
+    hash ^= hash >> 32;
+    return hash & (cache->no_buckets - 1);
+}
+
+static void cache_unlink(tar_cache_t *cache, cache_block_t *block) {
+    if (block->prev) block->prev->next = block->next;
+    else cache->head = block->next;
+    if (block->next) block->next->prev = block->prev;
+    else cache->tail = block->prev;
+}
+
+static void cache_push(tar_cache_t *cache, cache_block_t *block) {
+    block->prev = NULL;
+    block->next = cache->head;
+    if (cache->head) cache->head->prev = block;
+    cache->head = block;
+    if (!cache->tail) cache->tail = block;
+}
+
+/**
+ * @return the cached block, or NULL. The lock must be held.
+ */
+static cache_block_t *cache_find(tar_cache_t *cache, dev_t dev, ino_t ino, off_t offset) {
+    cache_block_t *block = cache->buckets[cache_bucket(cache, dev, ino, offset)];
+    while (block && (block->offset != offset || block->ino != ino || block->dev != dev)) block = block->chain;
+    return block;
+}
+
+/**
+ * Copies len bytes from skip into the cached block at offset and marks it as the most recently used.
+ *
+ * @return the number of bytes copied, short at the end of the archive, or -1 if the block is not cached
+ */
+static ssize_t cache_get(tar_cache_t *cache, dev_t dev, ino_t ino, off_t offset, size_t skip, uint8_t *dest, size_t len) {
+    pthread_mutex_lock(&cache->lock);
+    cache_block_t *block = cache_find(cache, dev, ino, offset);
+    ssize_t copied = -1;
+    if (block) {
+        copied = skip >= block->len ? 0 : (block->len - skip < len ? block->len - skip : len);
+        memcpy(dest, block->data + skip, copied);
+        cache_unlink(cache, block);
+        cache_push(cache, block);
+        cache->hits++;
+    } else cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
+    return copied;
+}
+
+/**
+ * Hands a block read by the caller over to the cache, evicting the least recently used one if the budget is used up.
+ * A block cached by another thread in the meantime is kept and the new one freed.
+ */
+static void cache_put(tar_cache_t *cache, cache_block_t *block) {
+    cache_block_t *evicted = NULL;
+    pthread_mutex_lock(&cache->lock);
+    if (cache_find(cache, block->dev, block->ino, block->offset)) evicted = block;
+    else {
+        if (cache->no_blocks == cache->max_blocks) {
+            evicted = cache->tail;
+            cache_unlink(cache, evicted);
+            cache_block_t **link = &cache->buckets[cache_bucket(cache, evicted->dev, evicted->ino, evicted->offset)];
+            while (*link != evicted) link = &(*link)->chain;
+            *link = evicted->chain;
+            cache->no_blocks--;
+            cache->evictions++;
+        }
+        size_t bucket = cache_bucket(cache, block->dev, block->ino, block->offset);
+        block->chain = cache->buckets[bucket];
+        cache->buckets[bucket] = block;
+        cache_push(cache, block);
+        cache->no_blocks++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    free(evicted);
+}
+
+/**
+ * Drops the blocks of an archive that reach past offset, which an append changed.
+ */
+static void cache_drop(tar_cache_t *cache, dev_t dev, ino_t ino, off_t offset) {
+    pthread_mutex_lock(&cache->lock);
+    cache_block_t *block = cache->head;
+    while (block) {
+        cache_block_t *next = block->next;
+        if (block->dev == dev && block->ino == ino && block->offset + TAR_CACHE_BLOCK > offset) {
+            cache_unlink(cache, block);
+            cache_block_t **link = &cache->buckets[cache_bucket(cache, dev, ino, block->offset)];
+            while (*link != block) link = &(*link)->chain;
+            *link = block->chain;
+            cache->no_blocks--;
+            free(block);
+        }
+        block = next;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+struct tar_handle {
+    int tar_fd;
+    tar_entry_t *entries;   // every header of the archive, in archive order
+    size_t no_entries;
+    size_t cap_entries;
+    size_t *buckets;        // open addressing table of indexes into entries, SIZE_MAX when empty
+    size_t no_buckets;      // always a power of two
+    size_t no_names;        // number of distinct names in the table
+    pthread_mutex_t lock;   // serialises the lazy setup done behind the queries
+    const uint8_t *map;     // whole archive once tar_map() succeeded, NULL otherwise
+    size_t map_len;
+    char *strings;          // names loaded from an index file, entries pointing here are not freed one by one
+    size_t strings_len;
+    size_t *first_child;    // directory tree over the live entries, SIZE_MAX ends a list of children
+    size_t *next_sibling;
+    size_t first_root;      // first top-level entry
+    size_t *link_cache;     // final target of each symlink once resolved, see follow_link()
+    gz_index_t *gz;         // checkpoints of a gzip archive, offsets of the entries are then uncompressed offsets
+    tar_cache_t *cache;     // shared block cache of tar_open_cached(), NULL otherwise
+    dev_t dev;              // identity of the archive in the cache
+    ino_t ino;
+    tar_handle_t **layers;  // archives merged by tar_union_open(), base first, NULL for a single archive
+    size_t no_layers;
+    uint32_t *entry_layer;  // layer holding the payload of each entry, allocated along with entries
+    off_t end;              // offset of the end of archive marker, where tar_refresh() looks for appended headers
+    off_t last_header;      // offset of the last header before end, hashed into the index files
+    tar_entry_t **sorted;   // visible entries by name for tar_find(), built on first use
+    size_t no_sorted;
+};
+
+/* Type of the entries of a union hiding a path of the layers below, never answered by a lookup */
+#define WHITEOUT_TYPE '\x01'
+
+/**
+ * Reads from the archive, uncompressed offsets of a gzip archive being served through its checkpoints.
+ */
+static ssize_t handle_read(tar_handle_t *handle, void *buf, size_t len, off_t offset) {
+    return source_read(handle->tar_fd, handle->gz, buf, len, offset);
+}
+
+/**
+ * Reads len bytes of the archive at offset through the block cache of the handle, which must have one.
+ * Blocks missing from the cache are read whole and added to it.
+ *
+ * @return the number of bytes read, short only at the end of the archive, -1 on error
+ */
+static ssize_t cached_read(tar_handle_t *handle, uint8_t *dest, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        off_t at = offset + done;
+        off_t start = at - at % TAR_CACHE_BLOCK;
+        size_t skip = at - start;
+        size_t want = TAR_CACHE_BLOCK - skip < len - done ? TAR_CACHE_BLOCK - skip : len - done;
+        ssize_t got = cache_get(handle->cache, handle->dev, handle->ino, start, skip, dest + done, want);
+        if (got < 0) {
+            cache_block_t *block = (cache_block_t*) malloc(sizeof(cache_block_t));
+            if (!block) return -1;
+            ssize_t read = handle_read(handle, block->data, TAR_CACHE_BLOCK, start);
+            if (read < 0) {
+                free(block);
+                return -1;
+            }
+            block->dev = handle->dev;
+            block->ino = handle->ino;
+            block->offset = start;
+            block->len = read;
+            got = skip >= (size_t) read ? 0 : ((size_t) read - skip < want ? (size_t) read - skip : want);
+            memcpy(dest + done, block->data + skip, got);
+            cache_put(handle->cache, block);
+        }
+        if (got == 0) break; // end of archive
+        done += got;
+    }
+    return done;
+}
+
+/**
+ * FNV-1a hash of a nul-terminated entry name.
+ */
+static uint64_t hash_name(const char *name) {
+    uint64_t hash = 14695981039346656037ULL;
+    while (*name) {
+        hash ^= (unsigned char) *name++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @return the bucket holding name, or the empty bucket where it should be inserted
+ */
+static size_t find_bucket(tar_handle_t *handle, const char *name) {
+    size_t mask = handle->no_buckets - 1;
+    size_t i = hash_name(name) & mask;
+    while (handle->buckets[i] != SIZE_MAX && strcmp(handle->entries[handle->buckets[i]].name, name) != 0) {
+        i = (i + 1) & mask; // linear probing
+    }
+    return i;
+}
+
+/**
+ * @return the bucket holding name followed by a slash, or the empty bucket where that directory should be inserted
+ */
+static size_t find_dir_bucket(tar_handle_t *handle, const char *name) {
+    size_t len = strlen(name);
+    size_t mask = handle->no_buckets - 1;
+    size_t i = ((hash_name(name) ^ '/') * 1099511628211ULL) & mask; // hash_name() of the name and the slash
+    while (handle->buckets[i] != SIZE_MAX) {
+        const char *entry = handle->entries[handle->buckets[i]].name;
+        if (strncmp(entry, name, len) == 0 && entry[len] == '/' && entry[len + 1] == '\0') break;
+        i = (i + 1) & mask; // linear probing
+    }
+    return i;
+}
+
+static int grow_buckets(tar_handle_t *handle) {
+    size_t *old = handle->buckets;
+    size_t no_old = handle->no_buckets;
+    handle->no_buckets = no_old ? no_old * 2 : 64;
+    handle->buckets = (size_t*) malloc(sizeof(size_t) * handle->no_buckets);
+    if (!handle->buckets) {
+        handle->buckets = old;
+        handle->no_buckets = no_old;
+        return -1;
+    }
+    memset(handle->buckets, 0xff, sizeof(size_t) * handle->no_buckets); // all SIZE_MAX
+    for (size_t i = 0; i < no_old; i++) {
+        if (old[i] != SIZE_MAX) handle->buckets[find_bucket(handle, handle->entries[old[i]].name)] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/**
+ * @return 1 if str points into the names loaded from an index file, 0 if it was allocated on its own
+ */
+static int in_strings(tar_handle_t *handle, const char *str) {
+    return handle->strings && str >= handle->strings && str < handle->strings + handle->strings_len;
+}
+
+/**
+ * Makes the last entry of handle->entries the one answered for its name.
+ */
+static int index_last_entry(tar_handle_t *handle) {
+    if ((handle->no_names + 1) * 2 > handle->no_buckets && grow_buckets(handle) != 0) return -1;
+    size_t idx = handle->no_entries - 1;
+    tar_entry_t *entry = &handle->entries[idx];
+    if (entry->typeflag == LNKTYPE) { // a hard link shares the payload of its target
+        size_t target = handle->buckets[find_bucket(handle, entry->linkname)];
+        if (target != SIZE_MAX && handle->entries[target].typeflag == SYMTYPE) { // a hard link to a symlink is one
+            char *linkname = strdup(handle->entries[target].linkname);
+            if (!linkname) return -1;
+            if (!in_strings(handle, entry->linkname)) free(entry->linkname);
+            entry->linkname = linkname;
+        }
+        if (target != SIZE_MAX) {
+            entry->typeflag = handle->entries[target].typeflag;
+            entry->size = handle->entries[target].size;
+            entry->data_offset = handle->entries[target].data_offset;
+        }
+    }
+    size_t bucket = find_bucket(handle, entry->name);
+    if (handle->buckets[bucket] == SIZE_MAX) handle->no_names++;
+    handle->buckets[bucket] = idx; // later headers shadow earlier ones
+    return 0;
+}
+
+/**
+ * @return the slot past the last entry, grown if needed, or NULL if memory is exhausted
+ */
+static tar_entry_t *new_entry(tar_handle_t *handle) {
+    if (handle->no_entries == handle->cap_entries) {
+        size_t cap = handle->cap_entries ? handle->cap_entries * 2 : 64;
+        tar_entry_t *entries = (tar_entry_t*) realloc(handle->entries, sizeof(tar_entry_t) * cap);
+        if (!entries) return NULL;
+        handle->entries = entries;
+        if (handle->layers) {
+            uint32_t *entry_layer = (uint32_t*) realloc(handle->entry_layer, sizeof(uint32_t) * cap);
+            if (!entry_layer) return NULL;
+            handle->entry_layer = entry_layer;
+        }
+        handle->cap_entries = cap;
+    }
+    return &handle->entries[handle->no_entries];
+}
+
+/**
+ * Appends an entry to the index, copying its name and link name.
+ */
+static int push_entry(tar_handle_t *handle, const char *name, const char *linkname, char typeflag, size_t size,
+                      off_t data_offset) {
+    tar_entry_t *entry = new_entry(handle);
+    if (!entry) return -1;
+    entry->name = strdup(name);
+    entry->linkname = strdup(linkname);
+    if (!entry->name || !entry->linkname) {
+        free(entry->name); free(entry->linkname);
+        return -1;
+    }
+    entry->typeflag = typeflag;
+    entry->size = size;
+    entry->data_offset = data_offset;
+    handle->no_entries++;
+    return index_last_entry(handle);
+}
+
+/**
+ * Appends the entry described by walk to the index.
+ */
+static int add_entry(tar_handle_t *handle, tar_walk_t *walk) {
+    return push_entry(handle, walk->name, walk->linkname, walk->typeflag, walk->size, walk->data_offset);
+}
+
+/**
+ * @return an empty handle on tar_fd, NULL if memory is exhausted
+ */
+static tar_handle_t *new_handle(int tar_fd) {
+    tar_handle_t *handle = (tar_handle_t*) calloc(1, sizeof(tar_handle_t));
+    if (!handle) return NULL;
+    handle->tar_fd = tar_fd;
+    pthread_mutex_init(&handle->lock, NULL);
+    return handle;
+}
+
+/**
+ * @return 1 if the entry at idx is the one answered for its name, 0 if a later header shadows it
+ */
+static int is_live(tar_handle_t *handle, size_t idx) {
+    return handle->buckets[find_bucket(handle, handle->entries[idx].name)] == idx;
+}
+
+/**
+ * @return 1 if the entry at idx is live and not a whiteout of a union, 0 otherwise
+ */
+static int is_visible(tar_handle_t *handle, size_t idx) {
+    return handle->entries[idx].typeflag != WHITEOUT_TYPE && is_live(handle, idx);
+}
+
+/**
+ * Looks up the directory holding the entry at idx, which must be live.
+ *
+ * @param buffer A buffer for the name of the directory, grown as needed.
+ * @return the index of the directory, SIZE_MAX for a top-level entry or a directory without header
+ */
+static size_t find_parent(tar_handle_t *handle, size_t idx, char **buffer, size_t *buffer_len) {
+    const char *name = handle->entries[idx].name;
+    size_t len = parent_len(name);
+    if (len == 0) return SIZE_MAX;
+    if (len + 1 > *buffer_len) {
+        char *grown = (char*) realloc(*buffer, len + 1);
+        if (!grown) return SIZE_MAX;
+        *buffer = grown;
+        *buffer_len = len + 1;
+    }
+    memcpy(*buffer, name, len);
+    (*buffer)[len] = '\0';
+    size_t parent = handle->buckets[find_bucket(handle, *buffer)];
+    return parent != SIZE_MAX && handle->entries[parent].typeflag == WHITEOUT_TYPE ? SIZE_MAX : parent;
+}
+
+/* Values of the symlink cache besides the index of the final target */
+#define LINK_UNRESOLVED SIZE_MAX
+#define LINK_DANGLING   (SIZE_MAX - 1)
+#define LINK_LOOP       (SIZE_MAX - 2)
+
+/**
+ * Forgets every resolved symlink, for a handle whose entries changed.
+ */
+static int reset_link_cache(tar_handle_t *handle) {
+    free(handle->link_cache);
+    handle->link_cache = (size_t*) malloc(sizeof(size_t) * handle->cap_entries);
+    if (!handle->link_cache) return -1;
+    memset(handle->link_cache, 0xff, sizeof(size_t) * handle->cap_entries); // all LINK_UNRESOLVED
+    return 0;
+}
+
+/**
+ * Links every live entry to the directory holding it, in archive order.
+ * A directory that holds entries but has no header of its own is added as an implicit entry
+ * with a data offset of -1, so that it can be listed like any other.
+ */
+static int build_tree(tar_handle_t *handle) {
+    char *buffer = NULL;
+    size_t buffer_len = 0;
+    for (size_t i = 0; i < handle->no_entries; i++) { // implicit directories are appended and visited in turn
+        if (!is_visible(handle, i) || parent_len(handle->entries[i].name) == 0) continue;
+        if (find_parent(handle, i, &buffer, &buffer_len) != SIZE_MAX) continue;
+        tar_entry_t *entry = new_entry(handle);
+        if (!entry || !buffer) {
+            free(buffer);
+            return -1;
+        }
+        entry->name = strdup(buffer);
+        entry->linkname = strdup("");
+        if (!entry->name || !entry->linkname) {
+            free(entry->name); free(entry->linkname); free(buffer);
+            return -1;
+        }
+        entry->typeflag = DIRTYPE;
+        entry->size = 0;
+        entry->data_offset = -1;
+        handle->no_entries++;
+        if (index_last_entry(handle) != 0) {
+            free(buffer);
+            return -1;
+        }
+    }
+    free(handle->first_child);
+    free(handle->next_sibling);
+    handle->first_child = (size_t*) malloc(sizeof(size_t) * handle->cap_entries);
+    handle->next_sibling = (size_t*) malloc(sizeof(size_t) * handle->cap_entries);
+    if (!handle->first_child || !handle->next_sibling) {
+        free(buffer);
+        return -1;
+    }
+    memset(handle->first_child, 0xff, sizeof(size_t) * handle->cap_entries); // all SIZE_MAX
+    memset(handle->next_sibling, 0xff, sizeof(size_t) * handle->cap_entries);
+    handle->first_root = SIZE_MAX;
+    free(handle->sorted); // sorted again on the next tar_find()
+    handle->sorted = NULL;
+    if (reset_link_cache(handle) != 0) {
+        free(buffer);
+        return -1;
+    }
+    for (size_t i = handle->no_entries; i-- > 0;) { // prepending backwards keeps the archive order
+        if (!is_visible(handle, i)) continue;
+        size_t parent = find_parent(handle, i, &buffer, &buffer_len);
+        size_t *first = parent == SIZE_MAX ? &handle->first_root : &handle->first_child[parent];
+        handle->next_sibling[i] = *first;
+        *first = i;
+    }
+    free(buffer);
+    return 0;
+}
+
+static tar_handle_t *load_embedded(int tar_fd);
+
+static tar_handle_t *tar_open_impl(int tar_fd) {
+    int gzip = is_gzip(tar_fd);
+    tar_handle_t *handle = gzip ? NULL : load_embedded(tar_fd);
+    if (handle) return handle;
+    handle = new_handle(tar_fd);
+    if (!handle) return NULL;
+    if (gzip && !(handle->gz = gz_build(tar_fd, TAR_GZ_SPAN))) {
+        tar_close(handle);
+        return NULL;
+    }
+    tar_walk_t walk;
+    if (walk_init(&walk, tar_fd) != 0) {
+        walk_free(&walk); tar_close(handle);
+        return NULL;
+    }
+    walk.reader.gz = handle->gz;
+    if (grow_buckets(handle) != 0) {
+        walk_free(&walk); tar_close(handle);
+        return NULL;
+    }
+    while (walk_header(&walk) != NULL) { // stop at the end of archive
+        handle->last_header = walk.pos;
+        int status = walk_step(&walk);
+        if (status < 0 || (status > 0 && add_entry(handle, &walk) != 0)) {
+            walk_free(&walk); tar_close(handle);
+            return NULL;
+        }
+    }
+    handle->end = walk.pos;
+    walk_free(&walk); //garbage buffer
+    if (build_tree(handle) != 0) {
+        tar_close(handle);
+        return NULL;
+    }
+    return handle;
+}
+
+/**
+ * Walks the headers of an archive once and builds an in-memory index keyed on the entry names.
+ * When the same name appears several times, the last header wins, as with tar itself.
+ * Hard links are indexed with the type, size and data offset of the entry they point to.
+ * A directory that holds entries but has no header of its own is indexed as well, with a data offset of -1.
+ * An archive written by tar_writer_close() is not walked: the index it ends with is loaded instead,
+ * provided its checksum and the headers it describes still match.
+ * A gzip-compressed archive (.tar.gz) is inflated once to keep a checkpoint every MiB of output,
+ * after which every read of the handle only inflates from the checkpoint before it.
+ * A file of several gzip members, as written by appending to it with gzip, reads as their concatenation.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file. It is not closed by tar_close().
+ *
+ * @return a handle to pass to the tar_* queries, or NULL if the archive could not be read or memory is exhausted.
+ */
+tar_handle_t *tar_open(int tar_fd) {
+    tar_call_t call;
+    call_begin(&call, TAR_FN_OPEN);
+    tar_handle_t *result = tar_open_impl(tar_fd);
+    call_end(&call);
+    return result;
+}
+
+/**
+ * Releases the index built by tar_open().
+ *
+ * @param handle A handle returned by tar_open(), may be NULL.
+ */
+void tar_close(tar_handle_t *handle) {
+    if (!handle) return;
+    for (size_t i = 0; i < handle->no_entries; i++) {
+        if (!in_strings(handle, handle->entries[i].name)) free(handle->entries[i].name);
+        if (!in_strings(handle, handle->entries[i].linkname)) free(handle->entries[i].linkname);
+    }
+    free(handle->entries);
+    free(handle->strings);
+    free(handle->first_child);
+    free(handle->next_sibling);
+    free(handle->link_cache);
+    free(handle->sorted);
+    free(handle->buckets);
+    if (handle->map) munmap((void*) handle->map, handle->map_len);
+    gz_free(handle->gz);
+    for (size_t k = 0; k < handle->no_layers; k++) tar_close(handle->layers[k]);
+    free(handle->layers);
+    free(handle->entry_layer);
+    pthread_mutex_destroy(&handle->lock);
+    free(handle);
+}
+
+/**
+ * Looks an entry up in the index.
+ * A path without a trailing slash also matches the directory of the same name.
+ *
+ * @param handle A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ *
+ * @return the indexed entry, or NULL if no entry at the given path exists in the archive.
+ */
+const tar_entry_t *tar_lookup(tar_handle_t *handle, char *path) {
+    if (!handle || !path || !*path) return NULL;
+    size_t idx = handle->buckets[find_bucket(handle, path)];
+    if (idx != SIZE_MAX && handle->entries[idx].typeflag != WHITEOUT_TYPE) return &handle->entries[idx];
+    if (path[strlen(path) - 1] == '/') return NULL;
+    idx = handle->buckets[find_dir_bucket(handle, path)];
+    return idx != SIZE_MAX && handle->entries[idx].typeflag != WHITEOUT_TYPE ? &handle->entries[idx] : NULL;
+}
+
+/**
+ * Follows a symlink entry to the entry it points to, the same way read_file() and list() do.
+ */
+static const tar_entry_t *resolve_path(tar_handle_t *handle, char *path, int *hops);
+
+/**
+ * Follows a symlink entry, and the symlinks it leads to, up to an entry that is not a symlink.
+ * The outcome is cached per symlink, so each one is resolved once for the life of the handle.
+ * Threads race at most to store the same value, the cache is read and written atomically.
+ *
+ * @param hops An in-out argument, the number of symlinks followed so far, above TAR_MAX_HOPS on a loop.
+ *
+ * @return the final entry, or NULL if the chain is dangling or loops
+ */
+static const tar_entry_t *follow_link(tar_handle_t *handle, const tar_entry_t *entry, int *hops) {
+    if (!entry || entry->typeflag != SYMTYPE) return entry;
+    size_t idx = entry - handle->entries;
+    size_t cached = __atomic_load_n(&handle->link_cache[idx], __ATOMIC_ACQUIRE);
+    if (cached == LINK_DANGLING) return NULL;
+    if (cached == LINK_LOOP) *hops = TAR_MAX_HOPS + 1;
+    if (cached == LINK_LOOP) return NULL;
+    if (cached < handle->no_entries) return &handle->entries[cached];
+    int start = *hops; // hops of the links followed before this one, a longer chain is not a loop of its own
+    if (++*hops > TAR_MAX_HOPS) return NULL;
+
+    char target[TAR_PATH_MAX];
+    const tar_entry_t *result = NULL;
+    if (normalize_link(entry->name, entry->linkname, target, sizeof(target)) == 0) {
+        result = resolve_path(handle, target, hops);
+    }
+    if (!result && *hops <= TAR_MAX_HOPS && entry->linkname[0] != '\0') { // target written from the archive root
+        snprintf(target, sizeof(target), "%s", entry->linkname);
+        result = resolve_path(handle, target, hops);
+    }
+    if (result) cached = result - handle->entries;
+    else if (*hops <= TAR_MAX_HOPS) cached = LINK_DANGLING;
+    else if (*hops - start > TAR_MAX_HOPS) cached = LINK_LOOP;
+    else return NULL; // the budget ran out in the chain leading here, another start may resolve this link
+    __atomic_store_n(&handle->link_cache[idx], cached, __ATOMIC_RELEASE);
+    return result;
+}
+
+/**
+ * Finds the entry at path, following symlinks met on the way, for the last component as well as
+ * for the directories leading to it, e.g. "dir/link/file" when "dir/link" points to a directory.
+ *
+ * @param path A path to an entry in the archive, modified during the call and restored before returning.
+ * @param hops An in-out argument, the number of symlinks followed so far, above TAR_MAX_HOPS on a loop.
+ *
+ * @return the entry, or NULL if it does not exist
+ */
+static const tar_entry_t *resolve_path(tar_handle_t *handle, char *path, int *hops) {
+    const tar_entry_t *entry = tar_lookup(handle, path);
+    if (entry) return follow_link(handle, entry, hops); // the common case, a single lookup
+    for (char *slash = strchr(path, '/'); slash && slash[1] != '\0'; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        const tar_entry_t *dir = tar_lookup(handle, path);
+        *slash = '/';
+        if (!dir) return NULL; // every directory holding an entry is indexed, even without header
+        if (dir->typeflag != SYMTYPE) continue;
+        dir = follow_link(handle, dir, hops);
+        if (!dir || dir->typeflag != DIRTYPE) return NULL;
+        char rest[TAR_PATH_MAX];
+        if (++*hops > TAR_MAX_HOPS) return NULL; // counted even when cached, a malformed archive cannot recurse forever
+        if (snprintf(rest, sizeof(rest), "%s%s", dir->name, slash + 1) >= (int) sizeof(rest)) return NULL;
+        return resolve_path(handle, rest, hops);
+    }
+    return NULL;
+}
+
+/**
+ * Resolves path to an entry that is not a symlink, as read_file() and list() need it.
+ */
+static const tar_entry_t *resolve_entry(tar_handle_t *handle, char *path) {
+    const tar_entry_t *entry = NULL;
+    tar_resolve(handle, path, &entry);
+    return entry;
+}
+
+/**
+ * Resolves a path to the entry it designates, following symlinks met on the way.
+ * Targets are taken relative to the directory holding the symlink, with "." and ".." resolved; a target that
+ * does not exist there is looked up from the root of the archive. Each symlink is resolved once for the life
+ * of the handle.
+ *
+ * @param handle A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ * @param entry Set to the entry reached, which is not a symlink, or NULL.
+ *
+ * @return zero on success,
+ *         -1 if no entry at the given path exists in the archive or a symlink on the way is dangling,
+ *         -2 if more than 40 symlinks had to be followed, which includes every symlink loop.
+ */
+int tar_resolve(tar_handle_t *handle, char *path, const tar_entry_t **entry) {
+    *entry = NULL;
+    char buffer[TAR_PATH_MAX];
+    if (!handle || !path || snprintf(buffer, sizeof(buffer), "%s", path) >= (int) sizeof(buffer)) return -1;
+    int hops = 0;
+    *entry = resolve_path(handle, buffer, &hops);
+    if (*entry) return 0;
+    return hops > TAR_MAX_HOPS ? -2 : -1;
+}
+
+int tar_exists(tar_handle_t *handle, char *path) {
+    return tar_lookup(handle, path) != NULL;
+}
+
+int tar_is_dir(tar_handle_t *handle, char *path) {
+    const tar_entry_t *entry = tar_lookup(handle, path);
+    return entry && entry->typeflag == DIRTYPE;
+}
+
+int tar_is_file(tar_handle_t *handle, char *path) {
+    const tar_entry_t *entry = tar_lookup(handle, path);
+    return entry && (entry->typeflag == REGTYPE || entry->typeflag == AREGTYPE);
+}
+
+int tar_is_symlink(tar_handle_t *handle, char *path) {
+    const tar_entry_t *entry = tar_lookup(handle, path);
+    return entry && entry->typeflag == SYMTYPE;
+}
+
+static int tar_list_impl(tar_handle_t *handle, char *path, char **entries, size_t *no_entries) {
+    const tar_entry_t *dir = resolve_entry(handle, path);
+    if (!dir || dir->typeflag != DIRTYPE) {
+        *no_entries = 0;
+        return 0;
+    }
+    size_t entered = 0;
+    for (size_t i = handle->first_child[dir - handle->entries]; i != SIZE_MAX && entered < *no_entries; i = handle->next_sibling[i]) {
+        strcpy(entries[entered++], handle->entries[i].name);
+    }
+    *no_entries = entered;
+    return 1;
+}
+
+int tar_list(tar_handle_t *handle, char *path, char **entries, size_t *no_entries) {
+    tar_call_t call;
+    call_begin(&call, TAR_FN_HANDLE_LIST);
+    int result = tar_list_impl(handle, path, entries, no_entries);
+    call_end(&call);
+    return result;
+}
+
+/**
+ * Lists the entries at a given path one at a time, so that a directory of any size can be paged through.
+ *
+ * @param handle A handle returned by tar_open().
+ * @param path A path to a directory in the archive. If the entry is a symlink, it is resolved as list() does.
+ * @param cursor An in-out argument. The caller sets it to zero to start listing, then passes it back unchanged.
+ * @param entry Set to the next entry of the directory.
+ *
+ * @return 1 if an entry was returned,
+ *         zero if every entry of the directory was already returned,
+ *         -1 if no directory at the given path exists in the archive.
+ */
+int tar_list_next(tar_handle_t *handle, char *path, size_t *cursor, const tar_entry_t **entry) {
+    const tar_entry_t *dir = resolve_entry(handle, path);
+    if (!dir || dir->typeflag != DIRTYPE) return -1;
+    if (*cursor == SIZE_MAX) return 0; // the last entry was already returned
+    size_t next = *cursor == 0 ? handle->first_child[dir - handle->entries] : *cursor - 1;
+    if (next >= handle->no_entries) return 0;
+    *entry = &handle->entries[next];
+    size_t after = handle->next_sibling[next];
+    *cursor = after == SIZE_MAX ? SIZE_MAX : after + 1;
+    return 1;
+}
+
+/**
+ * @return the mapping of the archive and its length, NULL if tar_map() did not succeed yet
+ */
+static const uint8_t *get_map(tar_handle_t *handle, size_t *map_len) {
+    pthread_mutex_lock(&handle->lock);
+    const uint8_t *map = handle->map;
+    *map_len = handle->map_len;
+    pthread_mutex_unlock(&handle->lock);
+    return map;
+}
+
+static ssize_t tar_read_file_impl(tar_handle_t *handle, char *path, size_t offset, uint8_t *dest, size_t *len) {
+    const tar_entry_t *entry = resolve_entry(handle, path);
+    if (!entry || (entry->typeflag != REGTYPE && entry->typeflag != AREGTYPE)) return -1;
+    if (handle->layers) handle = handle->layers[handle->entry_layer[entry - handle->entries]]; // same offsets there
+    if (offset >= entry->size) return -2; // offset is outside of file length
+    size_t temp = entry->size - offset; // get the file size without the offset
+    size_t map_len;
+    const uint8_t *map = get_map(handle, &map_len);
+    if (map && entry->data_offset + entry->size <= map_len) { // no system call when mapped
+        *len = temp > *len ? *len : temp;
+        memcpy(dest, map + entry->data_offset + offset, *len);
+        return temp - *len;
+    }
+    ssize_t got;
+    if (handle->cache && entry->size <= handle->cache->max_blocks * TAR_CACHE_BLOCK / 8) {
+        got = cached_read(handle, dest, temp > *len ? *len : temp, entry->data_offset + offset);
+    } else got = handle_read(handle, dest, temp > *len ? *len : temp, entry->data_offset + offset);
+    if (got < 0) return -1;
+    *len = got;
+    return temp - *len; // return size stay to read
+}
+
+ssize_t tar_read_file(tar_handle_t *handle, char *path, size_t offset, uint8_t *dest, size_t *len) {
+    tar_call_t call;
+    call_begin(&call, TAR_FN_HANDLE_READ_FILE);
+    ssize_t result = tar_read_file_impl(handle, path, offset, dest, len);
+    call_end(&call);
+    return result;
+}
+
+/**
+ * Maps the whole archive in memory. Once mapped, tar_read_file() copies straight from the mapping
+ * without any system call and tar_map_entry() can hand out pointers into it.
+ * Mapping twice only updates the access pattern hint.
+ *
+ * @param handle A handle returned by tar_open().
+ * @param advice TAR_MAP_SEQUENTIAL or TAR_MAP_RANDOM, passed to the kernel with madvise().
+ *
+ * @return zero on success, -1 if the archive could not be mapped, is compressed or is a union of archives.
+ */
+int tar_map(tar_handle_t *handle, int advice) {
+    if (handle->gz || handle->layers) return -1;
+    int result = 0;
+    pthread_mutex_lock(&handle->lock);
+    if (!handle->map) {
+        struct stat st;
+        void *map = MAP_FAILED;
+        if (fstat(handle->tar_fd, &st) == 0 && st.st_size > 0) {
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, handle->tar_fd, 0);
+        }
+        if (map == MAP_FAILED) result = -1;
+        else {
+            handle->map = (const uint8_t*) map;
+            handle->map_len = st.st_size;
+        }
+    }
+    if (handle->map) madvise((void*) handle->map, handle->map_len, advice == TAR_MAP_SEQUENTIAL ? MADV_SEQUENTIAL : MADV_RANDOM);
+    pthread_mutex_unlock(&handle->lock);
+    return result;
+}
+
+/**
+ * Gives access to the content of a file without copying it.
+ * The archive is mapped with TAR_MAP_RANDOM if tar_map() was not called before.
+ *
+ * @param handle A handle returned by tar_open().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved as read_file() does.
+ * @param ptr Set to the first byte of the file inside the mapping, valid until tar_close().
+ * @param len Set to the size of the file.
+ *
+ * @return zero on success,
+ *         -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the archive could not be mapped.
+ */
+int tar_map_entry(tar_handle_t *handle, char *path, const uint8_t **ptr, size_t *len) {
+    const tar_entry_t *entry = resolve_entry(handle, path);
+    if (!entry || (entry->typeflag != REGTYPE && entry->typeflag != AREGTYPE)) return -1;
+    size_t map_len;
+    const uint8_t *map = get_map(handle, &map_len);
+    if (!map && tar_map(handle, TAR_MAP_RANDOM) != 0) return -2;
+    if (!map) map = get_map(handle, &map_len);
+    if (entry->data_offset + entry->size > map_len) return -2; // truncated archive
+    *ptr = map + entry->data_offset;
+    *len = entry->size;
+    if (entry->size > 0) { // prefetch the pages of this entry only
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t start = entry->data_offset & ~(page - 1);
+        madvise((void*) (map + start), entry->data_offset + entry->size - start, MADV_WILLNEED);
+    }
+    return 0;
+}
+
+#define TAR_INDEX_MAGIC "TARIDX3"   /* 7 characters and a null */
+
+/*
+ * Layout of an index file, in the byte order of the machine that wrote it:
+ * an index_file_header_t, no_entries index_file_entry_t, no_buckets uint64_t buckets of the hash table,
+ * no_entries uint64_t first children then no_entries uint64_t next siblings of the directory tree,
+ * then strings_len bytes of nul-terminated names and link names.
+ * UINT64_MAX stands for SIZE_MAX in the buckets and the tree.
+ */
+typedef struct index_file_header {
+    char magic[8];
+    uint64_t archive_size;      // the archive as it was when the index was written
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t header_hash;       // hash of the first and the last header, see archive_hash()
+    uint64_t no_entries;
+    uint64_t no_buckets;
+    uint64_t no_names;
+    uint64_t first_root;
+    uint64_t strings_len;
+    uint64_t last_header;       // offset of the last header
+    uint64_t archive_end;       // offset of the end of archive marker, after the last header or payload
+} index_file_header_t;
+
+typedef struct index_file_entry {
+    uint64_t name;              // offsets in the strings
+    uint64_t linkname;
+    uint64_t size;
+    int64_t data_offset;
+    char typeflag;
+    char padding[7];
+} index_file_entry_t;
+
+/**
+ * Hashes the first and the last header of an archive, copied one after the other in blocks.
+ *
+ * @return the hash, never 0
+ */
+static uint64_t headers_hash(const char *blocks) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < 1024; i++) {
+        hash ^= (unsigned char) blocks[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash | 1;
+}
+
+/**
+ * Hashes the first header of the archive and the one at last_header, which catches an archive rewritten
+ * in place with the same size and mtime.
+ *
+ * @param end The offset of the end of archive marker, zero for an empty archive without headers.
+ *
+ * @return the hash, 0 if the headers could not be read
+ */
+static uint64_t archive_hash(int tar_fd, off_t last_header, off_t end) {
+    if (end == 0) return 1;
+    char blocks[1024];
+    if (read_at(tar_fd, blocks, 512, 0) != 512) return 0;
+    if (read_at(tar_fd, blocks + 512, 512, last_header) != 512) return 0;
+    return headers_hash(blocks);
+}
+
+/**
+ * Lays the index of a handle out as described above, after header, whose fields about the archive are kept.
+ *
+ * @return the index in a buffer of *len bytes to release with free(), NULL if memory is exhausted
+ */
+static char *index_serialize(tar_handle_t *handle, index_file_header_t *header, size_t *len) {
+    memcpy(header->magic, TAR_INDEX_MAGIC, sizeof(header->magic));
+    header->no_entries = handle->no_entries;
+    header->no_buckets = handle->no_buckets;
+    header->no_names = handle->no_names;
+    header->first_root = handle->first_root == SIZE_MAX ? UINT64_MAX : handle->first_root;
+    header->strings_len = 0;
+    for (size_t i = 0; i < handle->no_entries; i++) {
+        header->strings_len += strlen(handle->entries[i].name) + strlen(handle->entries[i].linkname) + 2;
+    }
+    *len = sizeof(*header) + sizeof(index_file_entry_t) * header->no_entries
+           + sizeof(uint64_t) * (header->no_buckets + 2 * header->no_entries) + header->strings_len;
+    char *file = (char*) calloc(1, *len);
+    if (!file) return NULL;
+    memcpy(file, header, sizeof(*header));
+    index_file_entry_t *entries = (index_file_entry_t*) (file + sizeof(*header));
+    uint64_t *buckets = (uint64_t*) (entries + header->no_entries);
+    uint64_t *first_child = buckets + header->no_buckets;
+    uint64_t *next_sibling = first_child + header->no_entries;
+    char *strings = (char*) (next_sibling + header->no_entries);
+    size_t used = 0;
+    for (size_t i = 0; i < handle->no_entries; i++) {
+        tar_entry_t *entry = &handle->entries[i];
+        entries[i].name = used;
+        strcpy(strings + used, entry->name);
+        used += strlen(entry->name) + 1;
+        entries[i].linkname = used;
+        strcpy(strings + used, entry->linkname);
+        used += strlen(entry->linkname) + 1;
+        entries[i].size = entry->size;
+        entries[i].data_offset = entry->data_offset;
+        entries[i].typeflag = entry->typeflag;
+        first_child[i] = handle->first_child[i] == SIZE_MAX ? UINT64_MAX : handle->first_child[i];
+        next_sibling[i] = handle->next_sibling[i] == SIZE_MAX ? UINT64_MAX : handle->next_sibling[i];
+    }
+    for (size_t i = 0; i < handle->no_buckets; i++) buckets[i] = handle->buckets[i] == SIZE_MAX ? UINT64_MAX : handle->buckets[i];
+    return file;
+}
+
+/**
+ * Writes the index of a handle to a file, so that tar_open_indexed() can load it instead of walking the archive.
+ * The file is written next to its final path and renamed, a reader never sees it half written.
+ *
+ * @param handle A handle returned by tar_open().
+ * @param idx_path The path of the index file, e.g. "archive.tar.idx".
+ *
+ * @return zero on success, -1 if the file could not be written, the archive is compressed or is a union of archives.
+ */
+int tar_index_save(tar_handle_t *handle, const char *idx_path) {
+    if (handle->gz || handle->layers) return -1; // neither checkpoints nor layers are part of the index file
+    struct stat st;
+    if (fstat(handle->tar_fd, &st) != 0) return -1;
+    index_file_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.archive_size = st.st_size;
+    header.mtime_sec = st.st_mtim.tv_sec;
+    header.mtime_nsec = st.st_mtim.tv_nsec;
+    header.last_header = handle->last_header;
+    header.archive_end = handle->end;
+    header.header_hash = archive_hash(handle->tar_fd, handle->last_header, handle->end);
+    if (header.header_hash == 0) return -1;
+    size_t len;
+    char *file = index_serialize(handle, &header, &len);
+    if (!file) return -1;
+
+    char *tmp_path = (char*) malloc(strlen(idx_path) + 5);
+    if (!tmp_path) {
+        free(file);
+        return -1;
+    }
+    sprintf(tmp_path, "%s.tmp", idx_path);
+    int result = -1;
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        size_t done = 0;
+        while (done < len) {
+            ssize_t written = write(fd, file + done, len - done);
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) break;
+            done += written;
+        }
+        if (close(fd) == 0 && done == len && rename(tmp_path, idx_path) == 0) result = 0;
+        else unlink(tmp_path);
+    }
+    free(tmp_path); free(file);
+    return result;
+}
+
+/**
+ * @return 1 if the child and sibling links of a loaded index form a tree below first_root, in which every
+ *         entry is reached at most once and every link leads, 0 if a damaged index would make a listing loop
+ */
+static int index_is_tree(tar_handle_t *handle) {
+    size_t n = handle->no_entries;
+    char *seen = (char*) calloc(n + 1, 1);
+    size_t *stack = (size_t*) malloc(sizeof(size_t) * (2 * n + 1)); // each entry pushes at most two others
+    size_t depth = 0;
+    int valid = seen && stack;
+    if (valid && handle->first_root != SIZE_MAX) stack[depth++] = handle->first_root;
+    while (valid && depth > 0) {
+        size_t i = stack[--depth];
+        if (seen[i]) valid = 0;
+        else {
+            seen[i] = 1;
+            if (handle->next_sibling[i] != SIZE_MAX) stack[depth++] = handle->next_sibling[i];
+            if (handle->first_child[i] != SIZE_MAX) stack[depth++] = handle->first_child[i];
+        }
+    }
+    for (size_t i = 0; valid && i < n; i++) { // a link outside the tree could only start a cycle of its own
+        if ((handle->first_child[i] != SIZE_MAX && !seen[handle->first_child[i]])
+            || (handle->next_sibling[i] != SIZE_MAX && !seen[handle->next_sibling[i]])) valid = 0;
+    }
+    free(seen);
+    free(stack);
+    return valid;
+}
+
+/**
+ * Builds a handle on tar_fd from an index laid out by index_serialize(), checking that every offset
+ * stays inside it, that the hash table has free buckets to end a probe, that the directory tree has no
+ * cycle and that neither an entry nor the end of archive reaches past limit. The handle keeps file for its names,
+ * it is released in any case.
+ *
+ * @return the handle, or NULL if the index is damaged or memory is exhausted
+ */
+static tar_handle_t *index_parse(int tar_fd, char *file, size_t file_len, off_t limit) {
+    index_file_header_t *header = (index_file_header_t*) file;
+    size_t per_entry = sizeof(index_file_entry_t) + 2 * sizeof(uint64_t); // an entry and its two tree links
+    size_t remaining = file_len >= sizeof(index_file_header_t) ? file_len - sizeof(index_file_header_t) : 0;
+    // each section is taken from what is left of the file, so that no size is computed beyond it
+    int valid = file_len >= sizeof(index_file_header_t)
+                && memcmp(header->magic, TAR_INDEX_MAGIC, sizeof(header->magic)) == 0
+                && header->no_entries <= remaining / per_entry;
+    if (valid) remaining -= per_entry * header->no_entries;
+    valid = valid && header->no_buckets <= remaining / sizeof(uint64_t);
+    if (valid) remaining -= sizeof(uint64_t) * header->no_buckets;
+    valid = valid && header->strings_len == remaining && header->strings_len > 0
+            && header->no_buckets > 0 && (header->no_buckets & (header->no_buckets - 1)) == 0
+            && header->no_names <= header->no_buckets / 2
+            && (header->first_root == UINT64_MAX || header->first_root < header->no_entries)
+            && header->archive_end <= (uint64_t) limit && header->archive_end % 512 == 0
+            && header->last_header < header->archive_end + (header->archive_end == 0);
+    index_file_entry_t *entries = NULL;
+    uint64_t *buckets = NULL, *first_child = NULL, *next_sibling = NULL;
+    char *strings = NULL;
+    if (valid) {
+        entries = (index_file_entry_t*) (file + sizeof(index_file_header_t));
+        buckets = (uint64_t*) (entries + header->no_entries);
+        first_child = buckets + header->no_buckets;
+        next_sibling = first_child + header->no_entries;
+        strings = (char*) (next_sibling + header->no_entries);
+        valid = strings[header->strings_len - 1] == '\0';
+    }
+    tar_handle_t *handle = NULL;
+    if (valid) handle = new_handle(tar_fd);
+    if (handle) {
+        handle->entries = (tar_entry_t*) malloc(sizeof(tar_entry_t) * (header->no_entries + 1));
+        handle->buckets = (size_t*) malloc(sizeof(size_t) * header->no_buckets);
+        handle->first_child = (size_t*) malloc(sizeof(size_t) * (header->no_entries + 1));
+        handle->next_sibling = (size_t*) malloc(sizeof(size_t) * (header->no_entries + 1));
+    }
+    valid = handle && handle->entries && handle->buckets && handle->first_child && handle->next_sibling;
+    for (size_t i = 0; valid && i < header->no_entries; i++) {
+        uint64_t payload = has_payload(entries[i].typeflag) ? entries[i].size : 0;
+        valid = entries[i].name < header->strings_len && entries[i].linkname < header->strings_len
+                && (first_child[i] == UINT64_MAX || first_child[i] < header->no_entries)
+                && (next_sibling[i] == UINT64_MAX || next_sibling[i] < header->no_entries)
+                && entries[i].data_offset >= -1 && payload <= (uint64_t) limit
+                && entries[i].data_offset <= limit - (off_t) payload;
+        if (!valid) break;
+        handle->first_child[i] = first_child[i] == UINT64_MAX ? SIZE_MAX : first_child[i];
+        handle->next_sibling[i] = next_sibling[i] == UINT64_MAX ? SIZE_MAX : next_sibling[i];
+        handle->entries[i] = (tar_entry_t) {strings + entries[i].name, strings + entries[i].linkname,
+                                            entries[i].typeflag, entries[i].size, entries[i].data_offset};
+        handle->no_entries++;
+    }
+    size_t occupied = 0;
+    for (size_t i = 0; valid && i < header->no_buckets; i++) {
+        valid = buckets[i] == UINT64_MAX || buckets[i] < header->no_entries;
+        handle->buckets[i] = buckets[i] == UINT64_MAX ? SIZE_MAX : buckets[i];
+        occupied += buckets[i] != UINT64_MAX;
+    }
+    if (valid && occupied != header->no_names) valid = 0; // less than half full, find_bucket() always ends
+    if (handle) {
+        handle->cap_entries = header->no_entries + 1;
+        handle->no_buckets = header->no_buckets;
+        handle->no_names = header->no_names;
+        handle->first_root = header->first_root == UINT64_MAX ? SIZE_MAX : header->first_root;
+        handle->strings = file; // names and link names point into the file, kept until tar_close()
+        handle->strings_len = file_len;
+        handle->end = header->archive_end;
+        handle->last_header = header->last_header;
+        file = NULL;
+    }
+    if (valid && !index_is_tree(handle)) valid = 0;
+    if (valid && reset_link_cache(handle) != 0) valid = 0;
+    free(file);
+    if (!valid) {
+        tar_close(handle);
+        return NULL;
+    }
+    return handle;
+}
+
+/**
+ * Loads an index file written by tar_index_save() in a single read.
+ *
+ * @return a handle on tar_fd, or NULL if the file is missing, damaged or older than the archive
+ */
+static tar_handle_t *load_index(int tar_fd, const char *idx_path) {
+    struct stat st, idx_st;
+    int fd = open(idx_path, O_RDONLY);
+    if (fd < 0) return NULL;
+    char *file = NULL;
+    if (fstat(fd, &idx_st) == 0 && fstat(tar_fd, &st) == 0 && (size_t) idx_st.st_size >= sizeof(index_file_header_t)) {
+        file = (char*) malloc(idx_st.st_size);
+        if (file && read_at(fd, file, idx_st.st_size, 0) != idx_st.st_size) {
+            free(file);
+            file = NULL;
+        }
+    }
+    close(fd);
+    if (!file) return NULL;
+    index_file_header_t *header = (index_file_header_t*) file;
+    uint64_t header_hash = header->header_hash;
+    if (header->archive_size != (uint64_t) st.st_size
+        || header->mtime_sec != st.st_mtim.tv_sec || header->mtime_nsec != st.st_mtim.tv_nsec) {
+        free(file);
+        return NULL;
+    }
+    tar_handle_t *handle = index_parse(tar_fd, file, idx_st.st_size, st.st_size);
+    if (handle && archive_hash(tar_fd, handle->last_header, handle->end) != header_hash) {
+        tar_close(handle);
+        return NULL;
+    }
+    return handle;
+}
+
+static tar_handle_t *tar_open_indexed_impl(int tar_fd, const char *idx_path) {
+    if (is_gzip(tar_fd)) return tar_open(tar_fd);
+    tar_handle_t *handle = load_index(tar_fd, idx_path);
+    if (handle) return handle;
+    handle = tar_open(tar_fd);
+    if (handle) tar_index_save(handle, idx_path); // best effort, a failure only costs the next open a walk
+    return handle;
+}
+
+/**
+ * Opens an archive through an index file kept next to it.
+ * The index is loaded when it matches the size, the modification time and the first and last headers
+ * of the archive. Otherwise the archive is walked as tar_open() does and the index file is rewritten.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file. It is not closed by tar_close().
+ * @param idx_path The path of the index file, e.g. "archive.tar.idx".
+ *
+ * @return a handle to pass to the tar_* queries, or NULL if the archive could not be read or memory is exhausted.
+ */
+tar_handle_t *tar_open_indexed(int tar_fd, const char *idx_path) {
+    tar_call_t call;
+    call_begin(&call, TAR_FN_OPEN_INDEXED);
+    tar_handle_t *result = tar_open_indexed_impl(tar_fd, idx_path);
+    call_end(&call);
+    return result;
+}
+
+/**
+ * Forward-only reader of an archive, for file descriptors that cannot seek such as pipes and sockets.
+ * Everything is read through one fixed window, payloads that are not wanted are read and dropped.
+ */
+struct tar_iter {
+    int fd;
+    char *window;
+    size_t pos;                   // next unread byte of window
+    size_t len;                   // valid bytes in window
+    off_t offset;                 // stream offset of window[pos]
+    size_t remaining;             // payload bytes of the current entry not read yet
+    size_t padding;               // bytes between the end of the payload and the next header
+    int done;
+    tar_ext_t ext;                // extended headers met since the last entry
+    tar_entry_t entry;
+    char name[TAR_NAME_MAX];
+    char linkname[sizeof(((tar_header_t*) 0)->linkname) + 1];
+};
+
+/**
+ * Takes the next len bytes of the stream, copied to dest or dropped when dest is NULL.
+ * A large read with an empty window goes straight to dest.
+ *
+ * @return the number of bytes taken, short only at the end of the stream, -1 on error
+ */
+static ssize_t iter_take(tar_iter_t *iter, char *dest, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        if (iter->pos == iter->len) {
+            ssize_t got;
+            if (dest && len - done >= TAR_WINDOW_MIN) got = read(iter->fd, dest + done, len - done);
+            else got = read(iter->fd, iter->window, TAR_WINDOW_MIN);
+            count_io(1, got > 0 ? got : 0);
+            if (got < 0 && errno == EINTR) continue;
+            if (got < 0) return -1;
+            if (got == 0) break; // end of stream
+            if (dest && len - done >= TAR_WINDOW_MIN) {
+                done += got;
+                iter->offset += got;
+                continue;
+            }
+            iter->pos = 0;
+            iter->len = got;
+        }
+        size_t chunk = iter->len - iter->pos;
+        if (chunk > len - done) chunk = len - done;
+        if (dest) memcpy(dest + done, iter->window + iter->pos, chunk);
+        iter->pos += chunk;
+        iter->offset += chunk;
+        done += chunk;
+    }
+    return done;
+}
+
+/**
+ * Starts reading an archive from the current position of a file descriptor.
+ *
+ * @param fd A file descriptor the archive is read from with read(), e.g. a pipe. It is not closed by tar_iter_close().
+ *
+ * @return an iterator to pass to tar_iter_next(), or NULL if memory is exhausted.
+ */
+tar_iter_t *tar_iter_open(int fd) {
+    tar_iter_t *iter = (tar_iter_t*) calloc(1, sizeof(tar_iter_t));
+    if (!iter) return NULL;
+    iter->window = (char*) malloc(TAR_WINDOW_MIN);
+    if (!iter->window) {
+        free(iter);
+        return NULL;
+    }
+    iter->fd = fd;
+    ext_init(&iter->ext);
+    return iter;
+}
+
+static int tar_iter_next_impl(tar_iter_t *iter, const tar_entry_t **entry) {
+    *entry = NULL;
+    if (iter->done) return 0;
+    size_t skip = iter->remaining + iter->padding;
+    if (iter_take(iter, NULL, skip) != (ssize_t) skip) return -4;
+    iter->remaining = iter->padding = 0;
+    ext_next(&iter->ext); // the extended values of the previous entry
+    char block[512];
+    tar_header_t *header = (tar_header_t*) block;
+    while (1) {
+        ssize_t got = iter_take(iter, block, sizeof(block));
+        if (got < 0 || (got > 0 && got < 512)) return -4;
+        if (got == 0 || *block == '\0') { // end of archive, with or without its zero blocks
+            iter->done = 1;
+            return 0;
+        }
+        count_header();
+        int status = check_header(header);
+        if (status == -1 && memcmp(header->magic, "ustar  ", 8) == 0) { // GNU tar, whose long names are read too
+            status = TAR_INT(header->chksum) == checksum(block) ? 0 : -3;
+        }
+        if (status < 0) return status;
+        if (!is_extended(header->typeflag)) break;
+        int64_t value = TAR_INT(header->size);
+        size_t size = value < 0 ? 0 : value, padding = 512 * TAR_BLOCKS(size) - size;
+        char *payload = size <= TAR_EXT_MAX ? (char*) malloc(size + 1) : NULL; // a larger one is dropped
+        if (!payload && size <= TAR_EXT_MAX) return -4;
+        got = iter_take(iter, payload, size);
+        if (got != (ssize_t) size || iter_take(iter, NULL, padding) != (ssize_t) padding) {
+            free(payload);
+            return -4;
+        }
+        if (payload) {
+            payload[size] = '\0';
+            status = ext_apply(&iter->ext, header->typeflag, payload, strnlen(payload, size));
+            free(payload);
+            if (status != 0) return -4;
+        }
+    }
+    ext_entry(&iter->ext, header, iter->name, iter->linkname, &iter->entry.name, &iter->entry.linkname,
+              &iter->entry.size);
+    iter->entry.typeflag = header->typeflag;
+    iter->entry.data_offset = iter->offset;
+    if (has_payload(header->typeflag)) {
+        iter->remaining = iter->entry.size;
+        iter->padding = 512 * TAR_BLOCKS(iter->entry.size) - iter->entry.size;
+    }
+    *entry = &iter->entry;
+    return 1;
+}
+
+/**
+ * Moves to the next entry of the archive. Whatever is left of the payload of the current entry is read and dropped.
+ *
+ * @param iter An iterator returned by tar_iter_open().
+ * @param entry Set to the next entry, valid until the next call. Its data offset counts from the start of the stream.
+ *
+ * @return 1 if an entry was returned,
+ *         zero at the end of the archive,
+ *         -1, -2 or -3 as check_archive() if the header is invalid,
+ *         -4 if the stream ends in the middle of an entry or cannot be read.
+ */
+int tar_iter_next(tar_iter_t *iter, const tar_entry_t **entry) {
+    tar_call_t call;
+    call_begin(&call, TAR_FN_ITER_NEXT);
+    int result = tar_iter_next_impl(iter, entry);
+    call_end(&call);
+    return result;
+}
+
+static ssize_t tar_iter_read_impl(tar_iter_t *iter, uint8_t *dest, size_t len) {
+    if (len > iter->remaining) len = iter->remaining;
+    ssize_t got = iter_take(iter, (char*) dest, len);
+    if (got != (ssize_t) len) return -1;
+    iter->remaining -= len;
+    return len;
+}
+
+/**
+ * Reads the payload of the entry last returned by tar_iter_next(), continuing where the previous call stopped.
+ *
+ * @param iter An iterator returned by tar_iter_open().
+ * @param dest A destination buffer to read the payload into.
+ * @param len The size of dest.
+ *
+ * @return the number of bytes copied to dest, zero once the whole payload was read, -1 on error or a truncated stream.
+ */
+ssize_t tar_iter_read(tar_iter_t *iter, uint8_t *dest, size_t len) {
+    tar_call_t call;
+    call_begin(&call, TAR_FN_ITER_READ);
+    ssize_t result = tar_iter_read_impl(iter, dest, len);
+    call_end(&call);
+    return result;
+}
+
+/**
+ * Releases an iterator. The file descriptor is left open, positioned somewhere after the last entry returned.
+ *
+ * @param iter An iterator returned by tar_iter_open(), may be NULL.
+ */
+void tar_iter_close(tar_iter_t *iter) {
+    if (!iter) return;
+    ext_free(&iter->ext);
+    free(iter->window);
+    free(iter);
+}
+
+/**
+ * Calls a function on every entry of an archive read in one forward pass, as tar_iter_next() does.
+ * The callback may read the payload of the entry with tar_iter_read(), what it leaves is dropped.
+ *
+ * @param fd A file descriptor the archive is read from with read(), e.g. a pipe.
+ * @param callback Called once per entry with the iterator, the entry and arg. A non-zero return value stops the walk.
+ * @param arg Passed to callback unchanged.
+ *
+ * @return the number of entries passed to callback, or the negative value of tar_iter_next() on error,
+ *         or -5 if memory is exhausted.
+ */
+int tar_iter_each(int fd, tar_iter_cb_t callback, void *arg) {
+    tar_iter_t *iter = tar_iter_open(fd);
+    if (!iter) return -5;
+    const tar_entry_t *entry;
+    int count = 0;
+    int status;
+    while ((status = tar_iter_next(iter, &entry)) > 0) {
+        count++;
+        if (callback(iter, entry, arg) != 0) break;
+    }
+    tar_iter_close(iter);
+    return status < 0 ? status : count;
+}
+
+static int tar_stat_many_impl(int tar_fd, char **paths, size_t n, tar_stat_t *results) {
+    size_t no_buckets = 16;
+    while (no_buckets < 2 * n) no_buckets *= 2;
+    size_t mask = no_buckets - 1;
+    size_t *buckets = (size_t*) malloc(sizeof(size_t) * no_buckets);
+    tar_walk_t walk;
+    if (!buckets || walk_init(&walk, tar_fd) != 0) {
+        if (buckets) walk_free(&walk);
+        free(buckets);
+        return -1;
+    }
+    memset(buckets, 0xff, sizeof(size_t) * no_buckets); // all SIZE_MAX
+    for (size_t i = 0; i < n; i++) {
+        results[i] = (tar_stat_t) {0, AREGTYPE, 0, -1};
+        size_t b = hash_name(paths[i]) & mask;
+        while (buckets[b] != SIZE_MAX && strcmp(paths[buckets[b]], paths[i]) != 0) b = (b + 1) & mask;
+        if (buckets[b] == SIZE_MAX) buckets[b] = i; // a repeated path shares the slot of its first occurrence
+    }
+
+    int status;
+    while (walk_header(&walk) != NULL && (status = walk_step(&walk)) >= 0) { // stop at the end of archive
+        if (status == 0) continue; // an extended header, applied to the next entry
+        size_t b = hash_name(walk.name) & mask;
+        while (buckets[b] != SIZE_MAX && strcmp(paths[buckets[b]], walk.name) != 0) b = (b + 1) & mask;
+        if (buckets[b] != SIZE_MAX) results[buckets[b]] = (tar_stat_t) {1, walk.typeflag, walk.size, walk.data_offset};
+    }
+    walk_free(&walk); //garbage buffer
+
+    int found = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t b = hash_name(paths[i]) & mask;
+        while (strcmp(paths[buckets[b]], paths[i]) != 0) b = (b + 1) & mask;
+        results[i] = results[buckets[b]];
+        found += results[i].exists;
+    }
+    free(buckets);
+    return found;
+}
+
+/**
+ * Finds the type, size and data offset of many paths in a single pass over the archive, without an index.
+ * The requested names are kept in a temporary hash set, so the cost is one scan plus a lookup per header.
+ * When the same name appears several times, the last header wins, as with tar_open().
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param paths The paths to look up, each equal to the name of a header to match it: unlike exists(),
+ *              a directory is only found with the trailing slash of its header, e.g. "dir/".
+ * @param n The number of paths.
+ * @param results An array of n results, results[i] is set for paths[i].
+ *
+ * @return the number of paths found in the archive, or -1 if the archive could not be read or memory is exhausted.
+ */
+int tar_stat_many(int tar_fd, char **paths, size_t n, tar_stat_t *results) {
+    tar_call_t call;
+    call_begin(&call, TAR_FN_STAT_MANY);
+    int result = tar_stat_many_impl(tar_fd, paths, n, results);
+    call_end(&call);
+    return result;
+}
+
+/* Reads read_files_batch() keeps in flight at once */
+#define TAR_BATCH_DEPTH 256
+
+/**
+ * State shared by the reads of one read_files_batch() call, whichever way they are issued.
+ */
+typedef struct batch {
+    int tar_fd;
+    tar_read_t *reqs;
+    size_t *pending;        // indexes into reqs of the reads to issue
+    off_t *at;              // archive offset of each pending read
+    size_t no_pending;
+    size_t next;            // next pending read to take, shared by the threads of the pool
+    tar_call_t *call;       // call of the caller, counting the reads of every thread
+} batch_t;
+
+/**
+ * Completes pending read k once got bytes arrived, reading the rest synchronously after a short or failed read.
+ */
+static void batch_complete(batch_t *batch, size_t k, ssize_t got) {
+    tar_read_t *req = &batch->reqs[batch->pending[k]];
+    if (got < 0) got = 0; // retried below with pread(), e.g. on a kernel without IORING_OP_READ
+    if ((size_t) got < req->len) {
+        ssize_t rest = read_at(batch->tar_fd, req->dest + got, req->len - got, batch->at[k] + got);
+        if (rest < 0) {
+            req->status = -1;
+            batch->pending[k] = SIZE_MAX;
+            return;
+        }
+        got += rest;
+    }
+    req->len = got;
+    req->status -= got; // return size stay to read
+    batch->pending[k] = SIZE_MAX; // completed
+}
+
+static void *batch_worker(void *arg) {
+    batch_t *batch = (batch_t*) arg;
+    tar_call_t *previous = call_adopt(batch->call);
+    size_t k;
+    while ((k = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->no_pending) {
+        batch_complete(batch, k, 0);
+    }
+    call_adopt(previous);
+    return NULL;
+}
+
+/**
+ * Issues the pending reads with pread() from a pool of threads.
+ */
+static void batch_pread(batch_t *batch) {
+    pthread_t threads[TAR_BATCH_THREADS];
+    int no_threads = 0;
+    while (no_threads < TAR_BATCH_THREADS && (size_t) no_threads + 1 < batch->no_pending
+           && pthread_create(&threads[no_threads], NULL, batch_worker, batch) == 0) no_threads++;
+    batch_worker(batch); // the calling thread takes its share, and everything if no thread could start
+    for (int i = 0; i < no_threads; i++) pthread_join(threads[i], NULL);
+}
+
+#ifdef TAR_HAVE_URING
+/**
+ * Issues the pending reads through an io_uring, driven with the raw system calls so that no library is needed.
+ *
+ * @return zero once every read completed, -1 if no ring could be set up and nothing was issued
+ */
+static int batch_uring(batch_t *batch) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    unsigned depth = batch->no_pending < TAR_BATCH_DEPTH ? batch->no_pending : TAR_BATCH_DEPTH;
+    int ring = syscall(__NR_io_uring_setup, depth, &params);
+    if (ring < 0) return -1;
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    int single = params.features & IORING_FEAT_SINGLE_MMAP; // both rings share one mapping
+    if (single && cq_len > sq_len) sq_len = cq_len;
+    char *sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+    char *cq = single ? sq : mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring,
+                                  IORING_OFF_CQ_RING);
+    struct io_uring_sqe *sqes = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring,
+                                     IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        if (sq != MAP_FAILED) munmap(sq, sq_len);
+        if (!single && cq != MAP_FAILED) munmap(cq, cq_len);
+        if (sqes != MAP_FAILED) munmap(sqes, sqes_len);
+        close(ring);
+        return -1;
+    }
+    unsigned *sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    unsigned sq_mask = *(unsigned*) (sq + params.sq_off.ring_mask);
+    unsigned *sq_array = (unsigned*) (sq + params.sq_off.array);
+    unsigned *cq_head = (unsigned*) (cq + params.cq_off.head);
+    unsigned *cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    unsigned cq_mask = *(unsigned*) (cq + params.cq_off.ring_mask);
+    struct io_uring_cqe *cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+    size_t in_flight = 0, done = 0; // reads in the ring, to_submit of them not handed to the kernel yet
+    unsigned to_submit = 0;
+    int broken = 0;                 // no more submissions, the reads already submitted are waited for
+    while (done < batch->no_pending && (!broken || in_flight > to_submit)) {
+        while (!broken && batch->next < batch->no_pending && in_flight < params.sq_entries) { // keep the queue full
+            size_t k = batch->next++;
+            tar_read_t *req = &batch->reqs[batch->pending[k]];
+            unsigned tail = *sq_tail;
+            struct io_uring_sqe *sqe = &sqes[tail & sq_mask];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = batch->tar_fd;
+            sqe->addr = (uint64_t) (uintptr_t) req->dest;
+            sqe->len = req->len < (1U << 30) ? req->len : (1U << 30); // a larger file ends as a short read
+            sqe->off = batch->at[k];
+            sqe->user_data = k;
+            sq_array[tail & sq_mask] = tail & sq_mask;
+            __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+            to_submit++;
+            in_flight++;
+        }
+        int got = syscall(__NR_io_uring_enter, ring, broken ? 0 : to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        count_io(1, 0);
+        if (got < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            if (broken) break; // cannot even wait, the reads in flight are failed below
+            broken = 1;
+        }
+        if (got > 0) to_submit -= got;
+        unsigned head = *cq_head;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &cqes[head & cq_mask];
+            if (cqe->res > 0) count_io(0, cqe->res);
+            batch_complete(batch, cqe->user_data, cqe->res);
+            head++;
+            in_flight--;
+            done++;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+    size_t submitted = batch->next - to_submit; // the reads before were handed to the kernel, in order
+    close(ring); // every submitted read has completed, unless waiting failed above
+    munmap(sqes, sqes_len);
+    if (!single) munmap(cq, cq_len);
+    munmap(sq, sq_len);
+    for (size_t k = 0; done < batch->no_pending && k < batch->no_pending; k++) { // the ring broke
+        if (batch->pending[k] == SIZE_MAX) continue;
+        if (k >= submitted) batch_complete(batch, k, 0); // never submitted, read with pread()
+        else { // still owned by the kernel, which may write to dest until it cancels the read
+            batch->reqs[batch->pending[k]].status = -1;
+            batch->pending[k] = SIZE_MAX;
+        }
+    }
+    return 0;
+}
+#endif
+
+static int read_files_batch_impl(int tar_fd, tar_read_t *reqs, size_t n, int flags) {
+    char **paths = (char**) malloc(sizeof(char*) * n + 1);
+    tar_stat_t *stats = (tar_stat_t*) malloc(sizeof(tar_stat_t) * n + 1);
+    batch_t batch = {tar_fd, reqs, (size_t*) malloc(sizeof(size_t) * n + 1), (off_t*) malloc(sizeof(off_t) * n + 1),
+                     0, 0, current_call};
+    int result = -1;
+    if (paths && stats && batch.pending && batch.at) {
+        for (size_t i = 0; i < n; i++) paths[i] = reqs[i].path;
+        if (tar_stat_many(tar_fd, paths, n, stats) >= 0) result = 0;
+    }
+    for (size_t i = 0; result == 0 && i < n; i++) {
+        tar_stat_t *stat = &stats[i];
+        if (!stat->exists || (stat->typeflag != REGTYPE && stat->typeflag != AREGTYPE)) {
+            reqs[i].status = read_file(tar_fd, reqs[i].path, reqs[i].offset, reqs[i].dest, &reqs[i].len);
+        } else if (reqs[i].offset >= stat->size) {
+            reqs[i].status = -2; // offset is outside of file length
+        } else {
+            reqs[i].status = stat->size - reqs[i].offset; // lowered by what is read
+            if (reqs[i].len > (size_t) reqs[i].status) reqs[i].len = reqs[i].status;
+            batch.pending[batch.no_pending] = i;
+            batch.at[batch.no_pending++] = stat->data_offset + reqs[i].offset;
+        }
+    }
+    if (result == 0 && batch.no_pending > 0) {
+#ifdef TAR_HAVE_URING
+        if ((flags & TAR_BATCH_PREAD) || batch_uring(&batch) != 0) batch_pread(&batch);
+#else
+        (void) flags;
+        batch_pread(&batch);
+#endif
+    }
+    free(paths);
+    free(stats);
+    free(batch.pending);
+    free(batch.at);
+    return result;
+}
+
+/**
+ * Reads many files of an archive at once, the way read_file() reads one.
+ * The entries are found in a single pass over the archive, then every payload read is issued through
+ * io_uring with up to 256 reads in flight, or from a pool of threads calling pread() where io_uring is not
+ * available. Symlinks and hard links are read with read_file() itself.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param reqs The reads to do. For each one, path, offset, dest and len are the arguments of read_file(),
+ *             len is set to the number of bytes read and status to what read_file() would return.
+ *             A read that failed has status -1, its dest may have been written in part.
+ * @param n The number of reads.
+ * @param flags Zero, or TAR_BATCH_PREAD to use the pool of threads even where io_uring is available.
+ *
+ * @return zero once every read has its status, -1 if the archive could not be read or memory is exhausted.
+ */
+int read_files_batch(int tar_fd, tar_read_t *reqs, size_t n, int flags) {
+    tar_call_t call;
+    call_begin(&call, TAR_FN_READ_FILES_BATCH);
+    int result = read_files_batch_impl(tar_fd, reqs, n, flags);
+    call_end(&call);
+    return result;
+}
+
+/**
+ * Entries of a subtree sorted by what tar_extract() does with them, directories in pre-order.
+ */
+typedef struct extract_plan {
+    size_t *dirs, no_dirs;
+    mode_t *dir_modes;      // mode given to each directory at the end, (mode_t) -1 for one that already existed
+    size_t *files, no_files;
+    size_t *links, no_links;
+} extract_plan_t;
+
+/**
+ * Adds the entry at idx and, for a directory, everything below it to the plan.
+ */
+static void plan_subtree(tar_handle_t *handle, size_t idx, extract_plan_t *plan) {
+    tar_entry_t *entry = &handle->entries[idx];
+    if (entry->typeflag == DIRTYPE) {
+        plan->dirs[plan->no_dirs++] = idx;
+        for (size_t i = handle->first_child[idx]; i != SIZE_MAX; i = handle->next_sibling[i]) {
+            plan_subtree(handle, i, plan);
+        }
+    } else if (entry->typeflag == SYMTYPE) plan->links[plan->no_links++] = idx;
+    else if (entry->typeflag == REGTYPE || entry->typeflag == AREGTYPE) plan->files[plan->no_files++] = idx;
+}
+
+/**
+ * Joins the destination directory and the name of an entry, refusing names that would escape it.
+ *
+ * @return zero on success, -1 if the name is absolute, holds a ".." component or is too long
+ */
+static int extract_path(const char *dest_dir, const char *name, char *out, size_t out_len) {
+    if (name[0] == '/') return -1;
+    for (const char *p = name; *p; p = strchr(p, '/') ? strchr(p, '/') + 1 : p + strlen(p)) {
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0')) return -1;
+    }
+    return snprintf(out, out_len, "%s/%s", dest_dir, name) < (int) out_len ? 0 : -1;
+}
+
+/**
+ * @return the permission bits stored in the header of an entry without setuid, setgid and sticky bits,
+ *         or dflt for a directory without header. They are given to open() or mkdir(), which take the umask off.
+ */
+static mode_t entry_mode(tar_handle_t *handle, const tar_entry_t *entry, mode_t dflt) {
+    tar_header_t header;
+    if (entry->data_offset < 512 || handle_read(handle, &header, 512, entry->data_offset - 512) != 512) return dflt;
+    return TAR_INT(header.mode) & 0777;
+}
+
+/* Files of the plan split in one range per thread, a thread that runs out takes from the others */
+typedef struct extract_range {
+    size_t next;            // next file to take, advanced atomically by the owner and the thieves
+    size_t end;
+} extract_range_t;
+
+typedef struct extract_job {
+    tar_handle_t *handle;
+    const char *dest_dir;
+    extract_plan_t *plan;
+    extract_range_t *ranges;
+    int no_ranges;
+    int first;              // range owned by this thread
+    size_t errors;
+    uint64_t bytes;
+    tar_call_t *call;       // call of the caller, counting the reads of every thread
+} extract_job_t;
+
+static void extract_file(extract_job_t *job, size_t idx) {
+    tar_handle_t *handle = job->handle;
+    tar_entry_t *entry = &handle->entries[idx];
+    char path[TAR_PATH_MAX];
+    int fd = -1;
+    if (extract_path(job->dest_dir, entry->name, path, sizeof(path)) == 0) {
+        unlink(path); // an earlier extraction is replaced, as tar does, so that the file is created with its mode
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, entry_mode(handle, entry, 0644));
+    }
+    if (fd < 0) {
+        job->errors++;
+        return;
+    }
+    size_t done;
+    if (copy_out(handle->tar_fd, handle->gz, entry->data_offset, fd, entry->size, &done) != 0 || done != entry->size) job->errors++;
+    close(fd);
+    job->bytes += done;
+}
+
+static void *extract_worker(void *arg) {
+    extract_job_t *job = (extract_job_t*) arg;
+    tar_call_t *previous = call_adopt(job->call);
+    for (int r = 0; r < job->no_ranges; r++) { // its own range first, then steal from the next ones
+        extract_range_t *range = &job->ranges[(job->first + r) % job->no_ranges];
+        size_t k;
+        while ((k = __atomic_fetch_add(&range->next, 1, __ATOMIC_RELAXED)) < range->end) {
+            extract_file(job, job->plan->files[k]);
+        }
+    }
+    call_adopt(previous);
+    return NULL;
+}
+
+static double extract_ms(struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - start->tv_sec) * 1e3 + (end.tv_nsec - start->tv_nsec) / 1e6;
+    *start = end;
+    return ms;
+}
+
+static int tar_extract_impl(int tar_fd, char *subtree, const char *dest_dir, int no_threads, tar_extract_stats_t *stats) {
+    struct timespec clock;
+    clock_gettime(CLOCK_MONOTONIC, &clock);
+    tar_extract_stats_t local;
+    if (!stats) stats = &local;
+    memset(stats, 0, sizeof(*stats));
+    tar_handle_t *handle = tar_open(tar_fd);
+    if (!handle) return -1;
+    extract_plan_t plan = {0};
+    size_t cap = handle->no_entries + 1;
+    plan.dirs = (size_t*) malloc(sizeof(size_t) * cap);
+    plan.dir_modes = (mode_t*) malloc(sizeof(mode_t) * cap);
+    plan.files = (size_t*) malloc(sizeof(size_t) * cap);
+    plan.links = (size_t*) malloc(sizeof(size_t) * cap);
+    const tar_entry_t *top = subtree && *subtree ? tar_lookup(handle, subtree) : NULL;
+    int result = plan.dirs && plan.dir_modes && plan.files && plan.links && (top || !subtree || !*subtree) ? 0 : -1;
+    if (result == 0 && top) plan_subtree(handle, top - handle->entries, &plan);
+    for (size_t i = handle->first_root; result == 0 && !top && i != SIZE_MAX; i = handle->next_sibling[i]) {
+        plan_subtree(handle, i, &plan);
+    }
+    stats->plan_ms = extract_ms(&clock);
+
+    char path[TAR_PATH_MAX];
+    size_t errors = 0;
+    for (size_t i = 1; result == 0 && top && i <= parent_len(top->name); i++) { // the directories above the subtree
+        if (top->name[i - 1] != '/') continue;
+        snprintf(path, sizeof(path), "%s/%.*s", dest_dir, (int) i, top->name);
+        mkdir(path, 0755); // may already exist
+    }
+    for (size_t d = 0; result == 0 && d < plan.no_dirs; d++) {
+        tar_entry_t *entry = &handle->entries[plan.dirs[d]];
+        struct stat st;
+        plan.dir_modes[d] = (mode_t) -1;
+        if (extract_path(dest_dir, entry->name, path, sizeof(path)) != 0) errors++;
+        else if (mkdir(path, entry_mode(handle, entry, 0755)) != 0) errors += errno != EEXIST;
+        else if (stat(path, &st) != 0) errors++;
+        else { // created with the umask taken off by the kernel, writable by its owner until it is filled
+            plan.dir_modes[d] = st.st_mode & 0777;
+            if ((st.st_mode & 0700) != 0700 && chmod(path, st.st_mode | 0700) != 0) errors++;
+        }
+    }
+    stats->no_dirs = plan.no_dirs;
+    stats->dirs_ms = extract_ms(&clock);
+
+    if (result == 0 && plan.no_files > 0) {
+        if (no_threads < 1) no_threads = 1;
+        if ((size_t) no_threads > plan.no_files) no_threads = plan.no_files;
+        extract_range_t *ranges = (extract_range_t*) malloc(sizeof(extract_range_t) * no_threads);
+        extract_job_t *jobs = (extract_job_t*) malloc(sizeof(extract_job_t) * no_threads);
+        pthread_t *threads = (pthread_t*) malloc(sizeof(pthread_t) * no_threads);
+        if (!ranges || !jobs || !threads) result = -1;
+        for (int t = 0; result == 0 && t < no_threads; t++) {
+            ranges[t] = (extract_range_t) {plan.no_files * t / no_threads, plan.no_files * (t + 1) / no_threads};
+            jobs[t] = (extract_job_t) {handle, dest_dir, &plan, ranges, no_threads, t, 0, 0, current_call};
+        }
+        int started = 1; // the calling thread runs the first job
+        while (result == 0 && started < no_threads
+               && pthread_create(&threads[started], NULL, extract_worker, &jobs[started]) == 0) started++;
+        if (result == 0) extract_worker(&jobs[0]); // it also steals the ranges of threads that could not start
+        for (int t = 1; result == 0 && t < started; t++) pthread_join(threads[t], NULL);
+        for (int t = 0; result == 0 && t < no_threads; t++) {
+            errors += jobs[t].errors;
+            stats->bytes += jobs[t].bytes;
+        }
+        free(ranges);
+        free(jobs);
+        free(threads);
+    }
+    stats->no_files = plan.no_files;
+    stats->files_ms = extract_ms(&clock);
+
+    for (size_t l = 0; result == 0 && l < plan.no_links; l++) {
+        tar_entry_t *entry = &handle->entries[plan.links[l]];
+        if (extract_path(dest_dir, entry->name, path, sizeof(path)) != 0) {
+            errors++;
+            continue;
+        }
+        unlink(path); // an earlier extraction is replaced, as tar does
+        if (symlink(entry->linkname, path) != 0) errors++;
+    }
+    for (size_t d = plan.no_dirs; result == 0 && d-- > 0;) { // children before parents, a parent may be read-only
+        tar_entry_t *entry = &handle->entries[plan.dirs[d]];
+        if (plan.dir_modes[d] != (mode_t) -1 && extract_path(dest_dir, entry->name, path, sizeof(path)) == 0
+            && chmod(path, plan.dir_modes[d]) != 0) errors++;
+    }
+    stats->no_links = plan.no_links;
+    stats->links_ms = extract_ms(&clock);
+
+    free(plan.dirs);
+    free(plan.dir_modes);
+    free(plan.files);
+    free(plan.links);
+    tar_close(handle);
+    return result == 0 ? (int) errors : -1;
+}
+
+/**
+ * Extracts a whole archive, or the subtree at a path, below a directory of the file system.
+ * Directories are created first, parents before children, then regular files are written by a pool of
+ * threads that take work from each other when they run out, copying inside the kernel where it can.
+ * Symlinks are created last, and the permission bits of the headers are applied, to directories at the very end
+ * so that a read-only directory can still be filled. As tar does without -p, the umask of the process is taken
+ * off these bits, 0755 for a directory without header, and setuid, setgid and sticky bits are never applied.
+ * An existing file is replaced, an existing directory keeps its mode. Hard links are extracted as copies of their target.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param subtree A path to an entry in the archive, or NULL or "" for the whole archive.
+ *                The entry itself is extracted, it is not followed if it is a symlink.
+ * @param dest_dir An existing directory. Each entry is written at dest_dir/name, a name that would
+ *                 escape dest_dir through ".." or a leading '/' is refused.
+ * @param no_threads The number of threads writing files, values below 1 count as 1.
+ * @param stats Set to the counts and the time taken by each phase, may be NULL.
+ *
+ * @return the number of entries that could not be extracted,
+ *         -1 if the archive could not be read, memory is exhausted or no entry exists at subtree.
+ */
+int tar_extract(int tar_fd, char *subtree, const char *dest_dir, int no_threads, tar_extract_stats_t *stats) {
+    tar_call_t call;
+    call_begin(&call, TAR_FN_EXTRACT);
+    int result = tar_extract_impl(tar_fd, subtree, dest_dir, no_threads, stats);
+    call_end(&call);
+    return result;
+}
+
+/**
+ * Creates a block cache that handles opened with tar_open_cached() share, on the same archive or on different ones.
+ * Blocks of the archives are kept in memory as they are read by tar_read_file() and the least recently used
+ * ones are evicted once the budget is used up, so that hot entries are read again without any system call.
+ *
+ * @param budget The memory given to cached contents, in bytes. It is rounded down to blocks of 16 KiB.
+ *
+ * @return the cache, or NULL if the budget is below one block or memory is exhausted.
+ */
+tar_cache_t *tar_cache_create(size_t budget) {
+    if (budget < TAR_CACHE_BLOCK) return NULL;
+    tar_cache_t *cache = (tar_cache_t*) calloc(1, sizeof(tar_cache_t));
+    if (!cache) return NULL;
+    cache->max_blocks = budget / TAR_CACHE_BLOCK;
+    cache->no_buckets = 16;
+    while (cache->no_buckets < cache->max_blocks) cache->no_buckets *= 2;
+    cache->buckets = (cache_block_t**) calloc(cache->no_buckets, sizeof(cache_block_t*));
+    if (!cache->buckets) {
+        free(cache);
+        return NULL;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+/**
+ * Releases a cache and every block in it. The handles using it must be closed first.
+ *
+ * @param cache A cache returned by tar_cache_create(), may be NULL.
+ */
+void tar_cache_destroy(tar_cache_t *cache) {
+    if (!cache) return;
+    while (cache->head) {
+        cache_block_t *block = cache->head;
+        cache->head = block->next;
+        free(block);
+    }
+    free(cache->buckets);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+/**
+ * Reads the counters of a cache, which are kept since its creation.
+ *
+ * @param cache A cache returned by tar_cache_create().
+ * @param stats Set to the counters and the memory in use.
+ */
+void tar_cache_stats(tar_cache_t *cache, tar_cache_stats_t *stats) {
+    pthread_mutex_lock(&cache->lock);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    stats->bytes = cache->no_blocks * TAR_CACHE_BLOCK;
+    stats->budget = cache->max_blocks * TAR_CACHE_BLOCK;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Opens an archive as tar_open() does and serves tar_read_file() through a shared block cache.
+ * Blocks are keyed on the device and inode of the archive and their offset, so that handles opened on the
+ * same file through different descriptors share them. An archive must not be rewritten while cached.
+ * Reads of files larger than an eighth of the budget bypass the cache, as do reads of a mapped archive.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file. It is not closed by tar_close().
+ * @param cache A cache returned by tar_cache_create(), which must outlive the handle.
+ *
+ * @return a handle to pass to the tar_* queries, or NULL if the archive could not be read or memory is exhausted.
+ */
+tar_handle_t *tar_open_cached(int tar_fd, tar_cache_t *cache) {
+    struct stat st;
+    if (!cache || fstat(tar_fd, &st) != 0) return NULL;
+    tar_handle_t *handle = tar_open(tar_fd);
+    if (!handle) return NULL;
+    handle->cache = cache;
+    handle->dev = st.st_dev;
+    handle->ino = st.st_ino;
+    return handle;
+}
+
+/**
+ * Reads the statistics of every counted function, accumulated since the start or the last tar_stats_reset().
+ * The counters are updated as calls end and are read one by one, the copy is not a snapshot of a single instant.
+ *
+ * @param stats Set to the counters, stats->fn[TAR_FN_*] for each function.
+ */
+void tar_stats_get(tar_stats_t *stats) {
+    for (int fn = 0; fn < TAR_FN_COUNT; fn++) {
+        tar_fn_stats_t *from = &fn_stats[fn], *to = &stats->fn[fn];
+        to->calls = __atomic_load_n(&from->calls, __ATOMIC_RELAXED);
+        to->syscalls = __atomic_load_n(&from->syscalls, __ATOMIC_RELAXED);
+        to->bytes = __atomic_load_n(&from->bytes, __ATOMIC_RELAXED);
+        to->headers = __atomic_load_n(&from->headers, __ATOMIC_RELAXED);
+        to->wall_ns = __atomic_load_n(&from->wall_ns, __ATOMIC_RELAXED);
+        for (int i = 0; i < TAR_HIST_BUCKETS; i++) to->latency[i] = __atomic_load_n(&from->latency[i], __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Sets every counter back to zero. Calls in progress are counted when they end.
+ */
+void tar_stats_reset(void) {
+    for (int fn = 0; fn < TAR_FN_COUNT; fn++) {
+        tar_fn_stats_t *stats = &fn_stats[fn];
+        __atomic_store_n(&stats->calls, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->syscalls, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->bytes, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->headers, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->wall_ns, 0, __ATOMIC_RELAXED);
+        for (int i = 0; i < TAR_HIST_BUCKETS; i++) __atomic_store_n(&stats->latency[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @param fn One of TAR_FN_*.
+ *
+ * @return the name of the counted function, e.g. "read_file", or NULL if fn is out of range.
+ */
+const char *tar_fn_name(int fn) {
+    static const char *names[TAR_FN_COUNT] = {
+        "check_archive", "check_archive_parallel", "exists", "is_dir", "is_file", "is_symlink", "list", "read_file",
+        "tar_sendfile", "tar_open", "tar_list", "tar_read_file", "tar_open_indexed", "tar_iter_next", "tar_iter_read",
+        "tar_stat_many", "read_files_batch", "tar_extract", "tar_union_open",
+        "tar_refresh", "tar_find", "tar_verify_contents"
+    };
+    return fn >= 0 && fn < TAR_FN_COUNT ? names[fn] : NULL;
+}
+
+#ifdef TAR_TRACE
+/**
+ * Installs a hook called at the end of every counted call, with what that call did.
+ * Only built when the library is compiled with -DTAR_TRACE, e.g. with "make clean trace".
+ * The callback and its argument are published together, so this may be called while other threads use
+ * the library: a call ending meanwhile sees either the previous pair or the new one, and may still run
+ * the previous callback after this returns. Each hook installed stays allocated until the process exits.
+ *
+ * @param callback Called on the thread that made the call, NULL to remove the hook.
+ * @param arg Passed to callback.
+ *
+ * @return zero, or -1 if memory is exhausted and the previous hook was kept.
+ */
+int tar_trace_set(tar_trace_cb_t callback, void *arg) {
+    trace_hook_t *hook = NULL;
+    if (callback) {
+        hook = (trace_hook_t*) malloc(sizeof(trace_hook_t));
+        if (!hook) return -1;
+        *hook = (trace_hook_t) {callback, arg};
+    }
+    __atomic_store_n(&trace_hook, hook, __ATOMIC_RELEASE);
+    return 0;
+}
+#endif
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+/**
+ * @return 1 if key is among the sorted names, 0 otherwise
+ */
+static int has_name(char **names, size_t no_names, const char *key) {
+    return no_names && bsearch(&key, names, no_names, sizeof(char*), compare_names) != NULL;
+}
+
+/**
+ * Tells whether a whiteout of an upper layer hides name, a path of a lower one.
+ *
+ * @param removed Sorted paths removed by ".wh.<name>" files, without trailing slash, along with what is below them.
+ * @param opaque Sorted directories made opaque by ".wh..wh..opq" files, with their trailing slash,
+ *               or "" for the root: everything below them is hidden, not the directories themselves.
+ */
+static int is_whited_out(const char *name, char **removed, size_t no_removed, char **opaque, size_t no_opaque) {
+    char prefix[TAR_PATH_MAX];
+    size_t len = strlen(name);
+    if (len >= sizeof(prefix)) return 0;
+    if (has_name(opaque, no_opaque, "")) return 1;
+    for (size_t i = 0; i < len; i++) { // every directory above name, then name itself
+        prefix[i] = name[i];
+        if (name[i] != '/') continue;
+        prefix[i + 1] = '\0';
+        if (i + 1 < len && has_name(opaque, no_opaque, prefix)) return 1;
+        prefix[i] = '\0';
+        if (has_name(removed, no_removed, prefix)) return 1;
+        prefix[i] = '/';
+    }
+    prefix[len] = '\0';
+    return name[len - 1] != '/' && has_name(removed, no_removed, prefix);
+}
+
+/**
+ * Merges the live entries of a layer into a union, above the layers merged before it,
+ * then hides the entries of those layers that its whiteout files remove.
+ */
+static int union_add_layer(tar_handle_t *handle, uint32_t layer) {
+    tar_handle_t *from = handle->layers[layer];
+    size_t first = handle->no_entries; // entries of the lower layers end here
+    char **removed = (char**) malloc(sizeof(char*) * (from->no_entries + 1));
+    char **opaque = (char**) malloc(sizeof(char*) * (from->no_entries + 1));
+    size_t no_removed = 0, no_opaque = 0;
+    int result = removed && opaque ? 0 : -1;
+    for (size_t i = 0; i < from->no_entries && result == 0; i++) {
+        tar_entry_t *source = &from->entries[i];
+        // directories without header are rebuilt over the union, an unresolved hard link has no payload to read
+        if (source->data_offset < 0 || source->typeflag == LNKTYPE || !is_live(from, i)) continue;
+        size_t dir_len = parent_len(source->name);
+        const char *base = source->name + dir_len;
+        if (strncmp(base, ".wh.", 4) == 0) {
+            char *path = strcmp(base, ".wh..wh..opq") == 0 ? strndup(source->name, dir_len)
+                                                           : (char*) malloc(strlen(source->name) - 3);
+            if (!path) result = -1;
+            else if (strcmp(base, ".wh..wh..opq") == 0) opaque[no_opaque++] = path;
+            else {
+                sprintf(path, "%.*s%s", (int) dir_len, source->name, base + 4);
+                size_t len = strlen(path);
+                if (len > 0 && path[len - 1] == '/') path[len - 1] = '\0';
+                removed[no_removed++] = path;
+            }
+            continue;
+        }
+        tar_entry_t *entry = new_entry(handle);
+        if (!entry) {
+            result = -1;
+            break;
+        }
+        entry->name = strdup(source->name);
+        entry->linkname = strdup(source->linkname);
+        if (!entry->name || !entry->linkname) {
+            free(entry->name); free(entry->linkname);
+            result = -1;
+            break;
+        }
+        entry->typeflag = source->typeflag;
+        entry->size = source->size;
+        entry->data_offset = source->data_offset;
+        handle->entry_layer[handle->no_entries++] = layer;
+        result = index_last_entry(handle);
+    }
+    if (result == 0 && (no_removed || no_opaque)) {
+        qsort(removed, no_removed, sizeof(char*), compare_names);
+        qsort(opaque, no_opaque, sizeof(char*), compare_names);
+        for (size_t i = 0; i < first && result == 0; i++) {
+            if (!is_visible(handle, i) || !is_whited_out(handle->entries[i].name, removed, no_removed, opaque, no_opaque)) {
+                continue;
+            }
+            tar_entry_t *entry = new_entry(handle); // shadows the hidden entry, as a later header would
+            if (!entry) {
+                result = -1;
+                break;
+            }
+            entry->name = strdup(handle->entries[i].name);
+            entry->linkname = strdup("");
+            if (!entry->name || !entry->linkname) {
+                free(entry->name); free(entry->linkname);
+                result = -1;
+                break;
+            }
+            entry->typeflag = WHITEOUT_TYPE;
+            entry->size = 0;
+            entry->data_offset = -1;
+            handle->entry_layer[handle->no_entries++] = layer;
+            result = index_last_entry(handle);
+        }
+    }
+    for (size_t i = 0; i < no_removed; i++) free(removed[i]);
+    for (size_t i = 0; i < no_opaque; i++) free(opaque[i]);
+    free(removed);
+    free(opaque);
+    return result;
+}
+
+static tar_handle_t *tar_union_open_impl(int *fds, size_t n) {
+    if (n == 0 || n > UINT32_MAX) return NULL;
+    tar_handle_t *handle = new_handle(-1);
+    if (!handle) return NULL;
+    handle->layers = (tar_handle_t**) calloc(n, sizeof(tar_handle_t*));
+    if (!handle->layers || grow_buckets(handle) != 0) {
+        tar_close(handle);
+        return NULL;
+    }
+    handle->no_layers = n;
+    for (size_t k = 0; k < n; k++) {
+        handle->layers[k] = tar_open(fds[k]);
+        if (!handle->layers[k] || union_add_layer(handle, k) != 0) {
+            tar_close(handle);
+            return NULL;
+        }
+    }
+    if (build_tree(handle) != 0) {
+        tar_close(handle);
+        return NULL;
+    }
+    return handle;
+}
+
+/**
+ * Opens a stack of archives, such as the layers of a container image, as one archive.
+ * Each layer is indexed as tar_open() does, then the layers are merged into one index, so that a query is
+ * answered by a single lookup whatever the number of layers: an entry of an upper layer shadows the entry
+ * of the same name below it. Whiteout files of a layer hide the entries of the layers below it:
+ * "dir/.wh.name" hides dir/name and everything under it, "dir/.wh..wh..opq" everything under dir/.
+ * The whiteout files themselves are not part of the union.
+ * tar_read_file() reads each file from the layer it comes from, tar_map() and tar_index_save() are refused.
+ *
+ * @param fds File descriptors of the layers, the base layer first and the top layer last. They are not closed
+ *            by tar_close(), a layer may be compressed.
+ * @param n The number of layers.
+ *
+ * @return a handle to pass to the tar_* queries, or NULL if a layer could not be read, n is zero or memory is exhausted.
+ */
+tar_handle_t *tar_union_open(int *fds, size_t n) {
+    tar_call_t call;
+    call_begin(&call, TAR_FN_UNION_OPEN);
+    tar_handle_t *result = tar_union_open_impl(fds, n);
+    call_end(&call);
+    return result;
+}
+
+static int tar_refresh_impl(tar_handle_t *handle) {
+    if (handle->gz || handle->layers) return -1;
+    struct stat st;
+    if (fstat(handle->tar_fd, &st) != 0) return -1;
+    if (st.st_size < handle->end) return -2; // rewritten, not appended to
+    tar_walk_t walk;
+    if (walk_init(&walk, handle->tar_fd) != 0) {
+        walk_free(&walk);
+        return -1;
+    }
+    walk.pos = handle->end; // the new headers overwrite the end of archive marker
+    size_t first = handle->no_entries;
+    off_t last_header = handle->last_header;
+    int result = 0;
+    while (walk_header(&walk) != NULL) {
+        last_header = walk.pos;
+        int status = walk_step(&walk);
+        if (status < 0 || (status > 0 && add_entry(handle, &walk) != 0)) {
+            result = -1;
+            break;
+        }
+    }
+    if (result == 0) {
+        if (handle->cache) cache_drop(handle->cache, handle->dev, handle->ino, handle->end);
+        handle->end = walk.pos;
+        handle->last_header = last_header;
+    }
+    walk_free(&walk);
+    size_t added = handle->no_entries - first; // before the implicit directories the tree may add
+    if (added > 0 && build_tree(handle) != 0) result = -1; // also forgets the resolved symlinks
+    return result < 0 ? -1 : (int) added;
+}
+
+/**
+ * Brings a handle up to date with an archive that was appended to since it was opened, as "tar -r" does.
+ * Only the headers written after the end of archive known to the handle are read, so the cost grows with
+ * the appended bytes and not with the size of the archive. Appended entries shadow the earlier entries
+ * of the same name, as they would have when opening the archive anew.
+ * The handle must not be queried by other threads during the call.
+ *
+ * @param handle A handle returned by tar_open(), tar_open_indexed() or tar_open_cached().
+ *
+ * @return the number of entries appended, zero if there is none,
+ *         -1 if the archive could not be read, memory is exhausted or the handle is compressed or a union,
+ *         -2 if the archive is now shorter than its known end, it must then be opened again.
+ */
+int tar_refresh(tar_handle_t *handle) {
+    tar_call_t call;
+    call_begin(&call, TAR_FN_REFRESH);
+    int result = tar_refresh_impl(handle);
+    call_end(&call);
+    return result;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp((*(tar_entry_t* const*) a)->name, (*(tar_entry_t* const*) b)->name);
+}
+
+/**
+ * Sorts the visible entries by name on first use, so that a prefix maps to a range of the array.
+ *
+ * @return the sorted entries, NULL if memory is exhausted
+ */
+static tar_entry_t **get_sorted(tar_handle_t *handle, size_t *no_sorted) {
+    pthread_mutex_lock(&handle->lock);
+    if (!handle->sorted) {
+        handle->sorted = (tar_entry_t**) malloc(sizeof(tar_entry_t*) * (handle->no_entries + 1));
+        handle->no_sorted = 0;
+        for (size_t i = 0; handle->sorted && i < handle->no_entries; i++) {
+            if (is_visible(handle, i)) handle->sorted[handle->no_sorted++] = &handle->entries[i];
+        }
+        if (handle->sorted) qsort(handle->sorted, handle->no_sorted, sizeof(tar_entry_t*), compare_entries);
+    }
+    tar_entry_t **sorted = handle->sorted;
+    *no_sorted = handle->no_sorted;
+    pthread_mutex_unlock(&handle->lock);
+    return sorted;
+}
+
+/**
+ * Matches name[0..end) against a glob where '*' and '?' stay within a path component and '**' crosses them,
+ * '**' followed by a slash matching zero or more whole directories.
+ */
+static int glob_match(const char *pattern, const char *name, const char *end) {
+    for (; *pattern; pattern++, name++) {
+        if (pattern[0] == '*' && pattern[1] == '*') {
+            if (pattern[2] == '/') {
+                for (const char *p = name;; p++) { // at each component start
+                    if (glob_match(pattern + 3, p, end)) return 1;
+                    while (p < end && *p != '/') p++;
+                    if (p == end) return 0;
+                }
+            }
+            for (const char *p = name; p <= end; p++) if (glob_match(pattern + 2, p, end)) return 1;
+            return 0;
+        }
+        if (*pattern == '*') {
+            for (const char *p = name;; p++) {
+                if (glob_match(pattern + 1, p, end)) return 1;
+                if (p == end || *p == '/') return 0;
+            }
+        }
+        if (name == end || (*pattern == '?' ? *name == '/' : *pattern != *name)) return 0;
+    }
+    return name == end;
+}
+
+static int type_matches(char typeflag, int types) {
+    if (typeflag == REGTYPE || typeflag == AREGTYPE) return types & TAR_FIND_FILE;
+    if (typeflag == DIRTYPE) return types & TAR_FIND_DIR;
+    if (typeflag == SYMTYPE) return types & TAR_FIND_SYMLINK;
+    return types & TAR_FIND_OTHER;
+}
+
+static int tar_find_impl(tar_handle_t *handle, const char *pattern, int types, tar_find_cb_t callback, void *arg) {
+    size_t no_sorted;
+    tar_entry_t **sorted = get_sorted(handle, &no_sorted);
+    if (!sorted) return -1;
+    size_t prefix_len = strcspn(pattern, "*?");
+    size_t low = 0, high = no_sorted; // first name not below the prefix
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (strncmp(sorted[mid]->name, pattern, prefix_len) < 0) low = mid + 1;
+        else high = mid;
+    }
+    int found = 0;
+    for (size_t i = low; i < no_sorted && strncmp(sorted[i]->name, pattern, prefix_len) == 0; i++) {
+        const tar_entry_t *entry = sorted[i];
+        size_t len = strlen(entry->name);
+        if (len > 1 && entry->name[len - 1] == '/') len--; // "etc/" is matched as "etc"
+        if (!type_matches(entry->typeflag, types) || !glob_match(pattern, entry->name, entry->name + len)) continue;
+        found++;
+        if (callback(entry, arg) != 0) break;
+    }
+    return found;
+}
+
+/**
+ * Calls a function on every entry whose name matches a glob pattern, in name order.
+ * The part of the pattern before its first wildcard is looked up in a name index sorted on first use,
+ * so that only the entries starting with it are visited, e.g. "usr/lib/libc*" never looks at "etc/".
+ * '*' and '?' match within a path component, '**' matches across components and, followed by a slash,
+ * zero or more whole directories. A trailing slash of a directory name is ignored when matching.
+ * The callback may run any query on the handle except tar_refresh().
+ *
+ * @param handle A handle returned by tar_open() or one of its variants.
+ * @param pattern A glob over the whole name, e.g. "etc/a?.conf", "usr/lib/libc*" or "src**.c".
+ * @param types A combination of TAR_FIND_FILE, TAR_FIND_DIR, TAR_FIND_SYMLINK and TAR_FIND_OTHER, or TAR_FIND_ANY.
+ * @param callback Called once per matching entry with the entry and arg. A non-zero return value stops the search.
+ * @param arg Passed to callback unchanged.
+ *
+ * @return the number of entries passed to callback, or -1 if memory is exhausted.
+ */
+int tar_find(tar_handle_t *handle, const char *pattern, int types, tar_find_cb_t callback, void *arg) {
+    tar_call_t call;
+    call_begin(&call, TAR_FN_FIND);
+    int result = tar_find_impl(handle, pattern, types, callback, arg);
+    call_end(&call);
+    return result;
+}
+
+static uint32_t crc32c_table[256];
+
+/**
+ * Reference implementation, one byte per step through a table, also used on machines without SSE4.2.
+ */
+static uint32_t crc32c_scalar(uint32_t crc, const uint8_t *buf, size_t len) {
+    for (size_t i = 0; i < len; i++) crc = crc32c_table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *buf, size_t len) {
+    uint64_t wide = crc;
+    for (; len >= 8; buf += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, buf, 8);
+        wide = _mm_crc32_u64(wide, word);
+    }
+    crc = (uint32_t) wide;
+    for (; len > 0; buf++, len--) crc = _mm_crc32_u8(crc, *buf);
+    return crc;
+}
+#endif
+
+static uint32_t (*crc32c_kernel)(uint32_t crc, const uint8_t *buf, size_t len) = crc32c_scalar;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Fills the table of the reflected Castagnoli polynomial and picks the crc32 instruction if the CPU has it.
+ */
+static void pick_crc32c_kernel(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        crc32c_table[i] = crc;
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) crc32c_kernel = crc32c_sse42;
+#endif
+}
+
+/**
+ * Computes the CRC-32C (Castagnoli) of a buffer, with the crc32 instruction of SSE4.2 where available.
+ *
+ * @param crc Zero to start, or the result of the previous call to continue over a following buffer.
+ * @param buf The bytes to add.
+ * @param len The number of bytes.
+ *
+ * @return the CRC-32C of everything added so far, e.g. 0xe3069283 for "123456789".
+ */
+uint32_t tar_crc32c(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&crc32c_once, pick_crc32c_kernel);
+    return ~crc32c_kernel(~crc, (const uint8_t*) buf, len);
+}
+
+/* Payloads are hashed by every thread through its own buffer of this size */
+#define TAR_VERIFY_CHUNK (1024 * 1024)
+
+typedef struct verify_job {
+    tar_handle_t *handle;
+    const size_t *files;    // regular files in archive order, the threads take the next one in turn
+    size_t no_files;
+    size_t *next;           // shared by all jobs, advanced atomically
+    uint32_t *crcs;         // digest of each file
+    int *statuses;          // TAR_DIGEST_UNREADABLE for a file that could not be read whole
+    uint64_t bytes;
+    tar_call_t *call;       // call of the caller, counting the reads of every thread
+} verify_job_t;
+
+static void *verify_worker(void *arg) {
+    verify_job_t *job = (verify_job_t*) arg;
+    tar_call_t *previous = call_adopt(job->call);
+    uint8_t *buffer = (uint8_t*) malloc(TAR_VERIFY_CHUNK);
+    size_t k;
+    while (buffer && (k = __atomic_fetch_add(job->next, 1, __ATOMIC_RELAXED)) < job->no_files) {
+        const tar_entry_t *entry = &job->handle->entries[job->files[k]];
+        uint32_t crc = 0;
+        size_t done = 0;
+        while (done < entry->size) {
+            size_t want = entry->size - done < TAR_VERIFY_CHUNK ? entry->size - done : TAR_VERIFY_CHUNK;
+            if (handle_read(job->handle, buffer, want, entry->data_offset + done) != (ssize_t) want) break;
+            crc = tar_crc32c(crc, buffer, want);
+            done += want;
+        }
+        job->crcs[k] = crc;
+        job->statuses[k] = done == entry->size ? TAR_DIGEST_OK : TAR_DIGEST_UNREADABLE;
+        job->bytes += done;
+    }
+    free(buffer);
+    call_adopt(previous);
+    return buffer ? NULL : (void*) -1;
+}
+
+static int compare_digests(const void *a, const void *b) {
+    return strcmp((*(tar_digest_t* const*) a)->name, (*(tar_digest_t* const*) b)->name);
+}
+
+static int tar_verify_contents_impl(int tar_fd, int no_threads, const tar_digest_t *manifest, size_t no_manifest,
+                                    tar_digest_t **digests, size_t *no_digests, tar_verify_stats_t *stats) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    tar_verify_stats_t local;
+    if (!stats) stats = &local;
+    memset(stats, 0, sizeof(*stats));
+    if (digests) *digests = NULL;
+    if (no_digests) *no_digests = 0;
+    tar_handle_t *handle = tar_open(tar_fd);
+    if (!handle) return -1;
+    size_t cap = handle->no_entries + 1;
+    size_t *files = (size_t*) malloc(sizeof(size_t) * cap);
+    uint32_t *crcs = (uint32_t*) malloc(sizeof(uint32_t) * cap);
+    int *statuses = (int*) malloc(sizeof(int) * cap);
+    const tar_digest_t **expected = (const tar_digest_t**) malloc(sizeof(tar_digest_t*) * (no_manifest + 1));
+    char *matched = (char*) calloc(no_manifest + 1, 1); // manifest entries found in the archive, by sorted position
+    int result = files && crcs && statuses && expected && matched ? 0 : -1;
+    size_t no_files = 0, names_len = 0;
+    for (size_t i = 0; result == 0 && i < handle->no_entries; i++) {
+        tar_entry_t *entry = &handle->entries[i];
+        if ((entry->typeflag != REGTYPE && entry->typeflag != AREGTYPE) || !is_live(handle, i)) continue;
+        files[no_files++] = i;
+        names_len += strlen(entry->name) + 1;
+    }
+
+    if (result == 0 && no_files > 0) {
+        if (no_threads < 1) no_threads = 1;
+        if ((size_t) no_threads > no_files) no_threads = no_files;
+        size_t next = 0;
+        verify_job_t *jobs = (verify_job_t*) malloc(sizeof(verify_job_t) * no_threads);
+        pthread_t *threads = (pthread_t*) malloc(sizeof(pthread_t) * no_threads);
+        if (!jobs || !threads) result = -1;
+        for (int t = 0; result == 0 && t < no_threads; t++) {
+            jobs[t] = (verify_job_t) {handle, files, no_files, &next, crcs, statuses, 0, current_call};
+        }
+        int started = 1; // the calling thread runs the first job, and takes over if no thread could start
+        while (result == 0 && started < no_threads
+               && pthread_create(&threads[started], NULL, verify_worker, &jobs[started]) == 0) started++;
+        if (result == 0 && verify_worker(&jobs[0]) != NULL) result = -1;
+        for (int t = 1; t < started; t++) {
+            void *status;
+            pthread_join(threads[t], &status);
+            if (status != NULL) result = -1;
+        }
+        for (int t = 0; result == 0 && t < started; t++) stats->bytes += jobs[t].bytes;
+        free(jobs);
+        free(threads);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->no_files = no_files;
+    stats->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    stats->gb_per_s = stats->seconds > 0 ? stats->bytes / stats->seconds / 1e9 : 0;
+
+    if (result == 0 && manifest) {
+        for (size_t m = 0; m < no_manifest; m++) expected[m] = &manifest[m];
+        qsort(expected, no_manifest, sizeof(tar_digest_t*), compare_digests);
+    }
+    for (size_t k = 0; result == 0 && manifest && k < no_files; k++) {
+        tar_digest_t key = {handle->entries[files[k]].name, 0, 0, 0};
+        const tar_digest_t *key_ptr = &key;
+        const tar_digest_t **found = (const tar_digest_t**) bsearch(&key_ptr, expected, no_manifest,
+                                                                     sizeof(tar_digest_t*), compare_digests);
+        if (found) matched[found - expected] = 1;
+        if (statuses[k] != TAR_DIGEST_OK) continue;
+        if (!found) statuses[k] = TAR_DIGEST_UNLISTED;
+        else if ((*found)->crc32c != crcs[k] || (*found)->size != handle->entries[files[k]].size) {
+            statuses[k] = TAR_DIGEST_MISMATCH;
+        }
+    }
+    for (size_t m = 0; result == 0 && manifest && m < no_manifest; m++) stats->missing += !matched[m];
+    for (size_t k = 0; result == 0 && k < no_files; k++) {
+        stats->mismatches += statuses[k] == TAR_DIGEST_MISMATCH;
+        stats->unlisted += statuses[k] == TAR_DIGEST_UNLISTED;
+        stats->unreadable += statuses[k] == TAR_DIGEST_UNREADABLE;
+    }
+
+    if (result == 0 && digests) { // one block, the names after the array
+        tar_digest_t *out = (tar_digest_t*) malloc(sizeof(tar_digest_t) * no_files + names_len + 1);
+        char *names = (char*) (out + no_files);
+        for (size_t k = 0; out && k < no_files; k++) {
+            tar_entry_t *entry = &handle->entries[files[k]];
+            out[k] = (tar_digest_t) {strcpy(names, entry->name), entry->size, crcs[k], statuses[k]};
+            names += strlen(entry->name) + 1;
+        }
+        if (!out) result = -1;
+        *digests = out;
+        if (no_digests) *no_digests = out ? no_files : 0;
+    }
+    free(files); free(crcs); free(statuses); free(expected); free(matched);
+    tar_close(handle);
+    return result == 0 ? (int) (stats->mismatches + stats->unlisted + stats->unreadable + stats->missing) : -1;
+}
+
+/**
+ * Verifies the contents of every regular file of an archive, which check_archive() does not look at.
+ * The payloads are hashed with CRC-32C by a pool of threads, each taking the next file in archive order
+ * when it is done with one, and the digests are optionally compared with a manifest, e.g. the digests
+ * returned by an earlier call on a known good copy. A file is hashed by a single thread, however large.
+ * Where a name appears several times, the last entry is verified, as the other queries see it.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file, plain or gzip-compressed.
+ * @param no_threads The number of threads hashing files, values below 1 count as 1.
+ * @param manifest The expected name, size and crc32c of the files, or NULL to only compute the digests.
+ * @param no_manifest The number of entries of manifest.
+ * @param digests Set to the digest and status of every regular file in archive order, in one block the caller
+ *                releases with free(), or NULL if not wanted.
+ * @param no_digests Set to the number of digests, may be NULL.
+ * @param stats Set to the counts, the time taken and the hashing throughput, may be NULL.
+ *
+ * @return the number of problems: files that differ from the manifest, are missing from it or could not be read,
+ *         and names of the manifest absent from the archive; -1 if the archive could not be read or memory is exhausted.
+ */
+int tar_verify_contents(int tar_fd, int no_threads, const tar_digest_t *manifest, size_t no_manifest,
+                        tar_digest_t **digests, size_t *no_digests, tar_verify_stats_t *stats) {
+    tar_call_t call;
+    call_begin(&call, TAR_FN_VERIFY_CONTENTS);
+    int result = tar_verify_contents_impl(tar_fd, no_threads, manifest, no_manifest, digests, no_digests, stats);
+    call_end(&call);
+    return result;
+}
+
+#define TAR_FOOTER_MAGIC "TARIDXF"  /* 7 characters and a null */
+
+/*
+ * Last block of an archive written by tar_writer_close(). The index is stored after the end of archive
+ * marker, where tar programs stop reading, padded to whole blocks and followed by this block.
+ */
+typedef struct index_footer {
+    char magic[8];
+    uint64_t index_offset;      // offset of the index, just after the end of archive marker
+    uint64_t index_len;         // bytes of index, the rest of its blocks is padding
+    uint32_t index_crc;         // tar_crc32c() of those bytes
+} index_footer_t;
+
+/**
+ * Loads the index that tar_writer_close() stores after the end of an archive, with one read of the last
+ * block, one read of the end of archive marker and the index, and the two reads of archive_hash().
+ * The index is checked against its CRC-32C and, as an index file, against the first and the last header
+ * it describes.
+ *
+ * @return a handle on tar_fd, or NULL if the archive does not end with an index that matches it
+ *         or memory is exhausted
+ */
+static tar_handle_t *load_embedded(int tar_fd) {
+    struct stat st;
+    index_footer_t footer;
+    if (fstat(tar_fd, &st) != 0 || st.st_size < 4 * 512 || st.st_size % 512 != 0
+        || read_at(tar_fd, &footer, sizeof(footer), st.st_size - 512) != (ssize_t) sizeof(footer)) return NULL;
+    if (memcmp(footer.magic, TAR_FOOTER_MAGIC, sizeof(footer.magic)) != 0 || footer.index_offset % 512 != 0
+        || footer.index_offset < 1024 || footer.index_len < sizeof(index_file_header_t)
+        || footer.index_len > (uint64_t) st.st_size - 512 - footer.index_offset
+        || footer.index_offset + 512 * TAR_BLOCKS(footer.index_len) + 512 != (uint64_t) st.st_size) return NULL;
+    off_t end = footer.index_offset - 1024; // the end of archive marker
+    size_t len = 1024 + footer.index_len;
+    char *buffer = (char*) malloc(len);
+    if (!buffer) return NULL;
+    index_file_header_t *index = (index_file_header_t*) (buffer + 1024);
+    int valid = read_at(tar_fd, buffer, len, end) == (ssize_t) len
+                && tar_crc32c(0, buffer + 1024, footer.index_len) == footer.index_crc
+                && index->archive_size == (uint64_t) end && index->archive_end == (uint64_t) end;
+    for (int i = 0; valid && i < 1024; i++) valid = buffer[i] == '\0'; // not overwritten by an append
+    if (!valid) {
+        free(buffer);
+        return NULL;
+    }
+    uint64_t header_hash = index->header_hash;
+    memmove(buffer, buffer + 1024, footer.index_len); // the names of the handle point into this buffer
+    tar_handle_t *handle = index_parse(tar_fd, buffer, footer.index_len, end);
+    if (handle && archive_hash(tar_fd, handle->last_header, handle->end) != header_hash) {
+        tar_close(handle);
+        return NULL;
+    }
+    return handle;
+}
+
+/* Writes go out in multiples of this size, itself a multiple of the block size */
+#define TAR_WRITER_BUFFER (64 * 1024)
+
+struct tar_writer {
+    int fd;
+    off_t pos;              // offset of the next byte given to the buffer
+    char *buffer;
+    size_t used;
+    tar_handle_t *index;    // entries written so far, embedded by tar_writer_close()
+    time_t mtime;           // of every entry, the time the writer was opened
+    int failed;             // a write failed, the output is not a valid archive any more
+    off_t last_header;      // offset of the last header written
+    char headers[1024];     // the first and the last header written, for the hash of the embedded index
+};
+
+/**
+ * Starts writing an archive, from the current position of a file descriptor.
+ * Headers and payloads are buffered and written in multiples of 64 KiB, so the archive may go to a pipe;
+ * only a regular file can be opened with its index afterwards.
+ *
+ * @param fd A file descriptor the archive is written to with write(). It is not closed by tar_writer_close().
+ *
+ * @return a writer to pass to tar_writer_add_*(), or NULL if memory is exhausted.
+ */
+tar_writer_t *tar_writer_open(int fd) {
+    tar_writer_t *writer = (tar_writer_t*) calloc(1, sizeof(tar_writer_t));
+    if (!writer) return NULL;
+    writer->fd = fd;
+    writer->mtime = time(NULL);
+    writer->buffer = (char*) malloc(TAR_WRITER_BUFFER);
+    writer->index = new_handle(-1);
+    if (!writer->buffer || !writer->index || grow_buckets(writer->index) != 0) {
+        free(writer->buffer);
+        tar_close(writer->index);
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+static void writer_flush(tar_writer_t *writer) {
+    size_t done = 0;
+    while (!writer->failed && done < writer->used) {
+        ssize_t written = write(writer->fd, writer->buffer + done, writer->used - done);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) writer->failed = 1;
+        else done += written;
+    }
+    writer->used = 0;
+}
+
+/**
+ * Appends len bytes of data, or of zeros if data is NULL, to the archive.
+ */
+static void writer_put(tar_writer_t *writer, const void *data, size_t len) {
+    while (len > 0) {
+        size_t chunk = TAR_WRITER_BUFFER - writer->used < len ? TAR_WRITER_BUFFER - writer->used : len;
+        if (data) {
+            memcpy(writer->buffer + writer->used, data, chunk);
+            data = (const char*) data + chunk;
+        } else memset(writer->buffer + writer->used, 0, chunk);
+        writer->used += chunk;
+        writer->pos += chunk;
+        len -= chunk;
+        if (writer->used == TAR_WRITER_BUFFER) writer_flush(writer);
+    }
+}
+
+/**
+ * Appends one record "length key=value\n" of a PAX extended header, the length counting its own digits.
+ */
+static size_t pax_record(char *out, const char *key, const char *value) {
+    size_t len = strlen(key) + strlen(value) + 3; // space, equal sign and newline
+    size_t total = len + 1;
+    while (total != len + snprintf(NULL, 0, "%zu", total)) total = len + snprintf(NULL, 0, "%zu", total);
+    return sprintf(out, "%zu %s=%s\n", total, key, value);
+}
+
+/**
+ * Writes a ustar header, its checksum computed by checksum() as check_archive() verifies it.
+ */
+static void writer_ustar(tar_writer_t *writer, const char *name, size_t name_len, const char *prefix,
+                         size_t prefix_len, const char *linkname, char typeflag, size_t size, mode_t mode) {
+    char block[512];
+    tar_header_t *header = (tar_header_t*) block;
+    memset(block, 0, sizeof(block));
+    memcpy(header->name, name, name_len);
+    memcpy(header->prefix, prefix, prefix_len);
+    snprintf(header->mode, sizeof(header->mode), "%07o", (unsigned) (mode & 07777));
+    snprintf(header->uid, sizeof(header->uid), "%07o", 0);
+    snprintf(header->gid, sizeof(header->gid), "%07o", 0);
+    snprintf(header->size, sizeof(header->size), "%011llo", (unsigned long long) size);
+    snprintf(header->mtime, sizeof(header->mtime), "%011llo", (unsigned long long) writer->mtime);
+    header->typeflag = typeflag;
+    memcpy(header->linkname, linkname, strnlen(linkname, sizeof(header->linkname)));
+    memcpy(header->magic, TMAGIC, TMAGLEN);
+    memcpy(header->version, TVERSION, TVERSLEN);
+    snprintf(header->chksum, sizeof(header->chksum), "%06lo", checksum(block));
+    header->chksum[7] = ' ';
+    if (writer->pos == 0) memcpy(writer->headers, block, 512);
+    writer->last_header = writer->pos;
+    memcpy(writer->headers + 512, block, 512);
+    writer_put(writer, block, 512);
+}
+
+/* Largest payload whose size fits the 11 octal digits of a ustar header */
+#define TAR_USTAR_SIZE_MAX 077777777777ULL
+
+/**
+ * Writes the header of an entry: a ustar header alone when the name fits its name and prefix fields,
+ * the link name its linkname field and the size its size field, otherwise a PAX extended header before it
+ * with a record for each of them that does not fit.
+ *
+ * @return the offset of the payload of the entry
+ */
+static off_t writer_header(tar_writer_t *writer, const char *name, const char *linkname, char typeflag,
+                           size_t size, mode_t mode) {
+    size_t len = strlen(name);
+    size_t split = len; // slash between prefix and name, len if the name fits alone
+    if (len > sizeof(((tar_header_t*) 0)->name)) {
+        const char *slash = strchr(name + len - 101, '/'); // first slash leaving at most 100 characters after it
+        if (slash && slash - name <= 155 && slash[1] != '\0') split = slash - name;
+    }
+    int long_name = split == len && len > sizeof(((tar_header_t*) 0)->name);
+    int long_link = strlen(linkname) > sizeof(((tar_header_t*) 0)->linkname);
+    if (long_name || long_link || size > TAR_USTAR_SIZE_MAX) {
+        char *records = (char*) malloc(len + strlen(linkname) + 128);
+        if (!records) {
+            writer->failed = 1;
+            return writer->pos;
+        }
+        size_t used = long_name ? pax_record(records, "path", name) : 0;
+        if (long_link) used += pax_record(records + used, "linkpath", linkname);
+        char value[32];
+        snprintf(value, sizeof(value), "%zu", size);
+        if (size > TAR_USTAR_SIZE_MAX) used += pax_record(records + used, "size", value);
+        writer_ustar(writer, "PaxHeader", 9, "", 0, "", XHDTYPE, used, 0644);
+        writer_put(writer, records, used);
+        writer_put(writer, NULL, 512 * TAR_BLOCKS(used) - used);
+        free(records);
+        if (long_name) split = len = sizeof(((tar_header_t*) 0)->name); // a truncated name, the record wins
+    }
+    size_t ustar_size = size > TAR_USTAR_SIZE_MAX ? 0 : size; // the record wins over a size that does not fit
+    if (split == len) writer_ustar(writer, name, len, "", 0, linkname, typeflag, ustar_size, mode);
+    else writer_ustar(writer, name + split + 1, len - split - 1, name, split, linkname, typeflag, ustar_size, mode);
+    return writer->pos;
+}
+
+/**
+ * Writes an entry and indexes it under the name that a reader of its headers would find.
+ */
+static int writer_add(tar_writer_t *writer, const char *name, const char *linkname, char typeflag,
+                      const void *data, size_t size, mode_t mode) {
+    if (writer->failed || !name[0]) return -1;
+    off_t data_offset = writer_header(writer, name, linkname, typeflag, size, mode);
+    if (data) {
+        writer_put(writer, data, size);
+        writer_put(writer, NULL, 512 * TAR_BLOCKS(size) - size);
+    }
+    if (push_entry(writer->index, name, linkname, typeflag, size, data_offset) != 0) writer->failed = 1;
+    return writer->failed ? -1 : 0;
+}
+
+/**
+ * Adds a regular file to the archive.
+ *
+ * @param writer A writer returned by tar_writer_open().
+ * @param name The path of the file in the archive, names that do not fit a ustar header are written with
+ *             a PAX extended header.
+ * @param data The content of the file.
+ * @param size The number of bytes of data.
+ * @param mode The permission bits stored in the header.
+ *
+ * @return zero on success, -1 if a write failed or memory is exhausted, every later call then fails too.
+ */
+int tar_writer_add_file(tar_writer_t *writer, const char *name, const void *data, size_t size, mode_t mode) {
+    if (!data && size > 0) return -1;
+    return writer_add(writer, name, "", REGTYPE, data ? data : "", size, mode);
+}
+
+/**
+ * Adds a directory to the archive, under its name with a trailing slash as tar writes it.
+ *
+ * @param writer A writer returned by tar_writer_open().
+ * @param name The path of the directory in the archive, with or without its trailing slash.
+ * @param mode The permission bits stored in the header.
+ *
+ * @return zero on success, -1 if a write failed or memory is exhausted, every later call then fails too.
+ */
+int tar_writer_add_dir(tar_writer_t *writer, const char *name, mode_t mode) {
+    size_t len = strlen(name);
+    if (len > 0 && name[len - 1] == '/') return writer_add(writer, name, "", DIRTYPE, NULL, 0, mode);
+    char *dir_name = (char*) malloc(len + 2);
+    if (!dir_name) return -1;
+    sprintf(dir_name, "%s/", name);
+    int result = len > 0 ? writer_add(writer, dir_name, "", DIRTYPE, NULL, 0, mode) : -1;
+    free(dir_name);
+    return result;
+}
+
+/**
+ * Adds a symlink to the archive.
+ *
+ * @param writer A writer returned by tar_writer_open().
+ * @param name The path of the symlink in the archive.
+ * @param target The target of the symlink, relative to the directory holding it or absolute.
+ *
+ * @return zero on success, -1 if a write failed or memory is exhausted, every later call then fails too.
+ */
+int tar_writer_add_symlink(tar_writer_t *writer, const char *name, const char *target) {
+    return writer_add(writer, name, target, SYMTYPE, NULL, 0, 0777);
+}
+
+/**
+ * Ends the archive and releases the writer.
+ * The index of the entries is stored after the end of archive marker, laid out as the files of
+ * tar_index_save() and followed by a block locating it, so that tar_open() loads it with four reads
+ * instead of walking every header, unless it no longer matches the archive. Other tar programs stop
+ * at the end of archive marker and never see it, appending to the archive as tar -r does overwrites it.
+ *
+ * @param writer A writer returned by tar_writer_open(), may be NULL.
+ *
+ * @return zero once the whole archive was written, -1 if a write failed or memory is exhausted.
+ */
+int tar_writer_close(tar_writer_t *writer) {
+    if (!writer) return 0;
+    index_file_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.archive_size = writer->pos; // the index describes the archive up to its end of archive marker
+    header.last_header = writer->last_header;
+    header.archive_end = writer->pos;
+    header.header_hash = writer->pos > 0 ? headers_hash(writer->headers) : 1; // as archive_hash() would
+    size_t len = 0;
+    char *index = writer->failed || build_tree(writer->index) != 0 ? NULL : index_serialize(writer->index, &header, &len);
+    writer_put(writer, NULL, 1024); // end of archive, still valid without the index if memory ran out
+    if (index) {
+        index_footer_t footer = {TAR_FOOTER_MAGIC, writer->pos, len, tar_crc32c(0, index, len)};
+        char block[512] = {0};
+        memcpy(block, &footer, sizeof(footer));
+        writer_put(writer, index, len);
+        writer_put(writer, NULL, 512 * TAR_BLOCKS(len) - len);
+        writer_put(writer, block, 512);
+        free(index);
     }
+    writer_flush(writer);
+    int result = writer->failed || !index ? -1 : 0;
+    free(writer->buffer);
+    tar_close(writer->index);
+    free(writer);
     return result;
 }
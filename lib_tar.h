@@ -38,10 +38,26 @@ typedef struct posix_header
 #define AREGTYPE '\0'           /* regular file */
 #define LNKTYPE  '1'            /* link */
 #define SYMTYPE  '2'            /* reserved */
+#define CHRTYPE  '3'            /* character device */
+#define BLKTYPE  '4'            /* block device */
 #define DIRTYPE  '5'            /* directory */
+#define FIFOTYPE '6'            /* FIFO */
+#define XHDTYPE  'x'            /* PAX extended header for the next entry */
+#define XGLTYPE  'g'            /* PAX global extended header for all the entries that follow */
+#define GNUTYPE_LONGNAME 'L'    /* GNU long name of the next entry */
+#define GNUTYPE_LONGLINK 'K'    /* GNU long link name of the next entry */
 
-/* Converts an ASCII-encoded octal-based number into a regular integer */
-#define TAR_INT(char_ptr) strtol(char_ptr, NULL, 8)
+/* Converts an ASCII-encoded octal-based number held in a char array field of a header into a regular integer */
+#define TAR_INT(field) tar_octal(field, sizeof(field))
+
+/*
+ * Thread safety: every function below reads the archive with pread() at explicit offsets and never moves
+ * the file offset of tar_fd. Any number of threads may therefore query the same tar_fd, or the same
+ * tar_handle_t, at the same time, and the file offset of tar_fd is left untouched for the caller.
+ * The tar_iter_* functions are the exception: they consume a stream with read() and an iterator belongs
+ * to one thread. The statistics are global and updated counter by counter with atomic operations, the
+ * tracing hook is replaced as a whole: both may be read, reset or replaced while other threads make calls.
+ */
 
 /**
  * Checks whether the archive is valid.
@@ -60,6 +76,20 @@ typedef struct posix_header
  */
 int check_archive(int tar_fd);
 
+/**
+ * Same as check_archive(), with the headers checked by several threads.
+ * Each thread takes a byte range of the file, finds its first valid header and walks the headers from there.
+ * The walks are then chained in archive order, a range whose first header was found in the payload of a file
+ * is walked again from the header the previous ranges lead to.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ * @param no_threads The number of threads checking headers, 1 or less falls back to check_archive().
+ *
+ * @return the same value as check_archive(): the number of non-null headers,
+ *         or the error of the first invalid header in archive order.
+ */
+int check_archive_parallel(int tar_fd, int no_threads);
+
 /**
  * Checks whether an entry exists in the archive.
  *
@@ -149,8 +179,44 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries);
  */
 ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len);
 
+/**
+ * Copies a file at a given path in the archive to another file descriptor, e.g. a socket or a file,
+ * without bringing its bytes through user space. copy_file_range() is tried first, then sendfile(),
+ * and only when the kernel refuses both are the bytes moved with pread() and write().
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive to copy. If the entry is a symlink, it is resolved as read_file() does.
+ * @param out_fd A file descriptor written at its current position, which is advanced.
+ * @param offset An offset in the file from which to start copying from, zero indicates the start of the file.
+ * @param len An in-out argument.
+ *            The caller set it to the number of bytes to copy at most.
+ *            The callee set it to the number of bytes written to out_fd.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the offset is outside the file total length,
+ *         -3 if out_fd could not be written, len is then set to the bytes written before the error,
+ *         zero if the file was copied in its entirety,
+ *         a positive value if the file was partially copied, representing the remaining bytes left to be copied to reach
+ *         the end of the file.
+ */
+ssize_t tar_sendfile(int tar_fd, char *path, int out_fd, size_t offset, size_t *len);
+
 long checksum(char* buffer);
 
+/**
+ * Parses an octal numeric field of a header without calling strtol().
+ * Leading spaces are skipped and parsing stops at the first byte that is not an octal digit,
+ * so fields written by tar give the same value as strtol(field, NULL, 8), without reading past the field.
+ * A field whose first byte has its high bit set holds a big-endian two's complement number instead,
+ * the base-256 encoding GNU tar uses for sizes of 8 GiB and more.
+ *
+ * @param field The first byte of the field.
+ * @param len The length of the field, e.g. 8 for mode or chksum and 12 for size or mtime.
+ *
+ * @return the value of the field
+ */
+int64_t tar_octal(const char *field, size_t len);
+
 /**
  * Search if headerPath is in the good path file and not in a other directory or subdirectory
  *
@@ -163,4 +229,643 @@ int path_helper(char *path, char* headerPath);
 
 int not_in_entries(char** entries, char* path, int len);
 
+/* Indexed view of an archive, built by tar_open() with a single walk over the headers */
+typedef struct tar_handle tar_handle_t;
+
+typedef struct tar_entry
+{
+    char *name;                   /* path of the entry as stored in its header */
+    char *linkname;               /* target of a link, empty string otherwise */
+    char typeflag;
+    size_t size;                  /* size of the payload in bytes */
+    off_t data_offset;            /* offset of the first payload byte in the archive */
+} tar_entry_t;
+
+/**
+ * Walks the headers of an archive once and builds an in-memory index keyed on the entry names.
+ * When the same name appears several times, the last header wins, as with tar itself.
+ * Hard links are indexed with the type, size and data offset of the entry they point to.
+ * A directory that holds entries but has no header of its own is indexed as well, with a data offset of -1.
+ * An archive written by tar_writer_close() is not walked: the index it ends with is loaded instead,
+ * provided its checksum and the headers it describes still match.
+ * A gzip-compressed archive (.tar.gz) is inflated once to keep a checkpoint every MiB of output,
+ * after which every read of the handle only inflates from the checkpoint before it.
+ * A file of several gzip members, as written by appending to it with gzip, reads as their concatenation.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file. It is not closed by tar_close().
+ *
+ * @return a handle to pass to the tar_* queries, or NULL if the archive could not be read or memory is exhausted.
+ */
+tar_handle_t *tar_open(int tar_fd);
+
+/**
+ * Releases the index built by tar_open().
+ *
+ * @param handle A handle returned by tar_open(), may be NULL.
+ */
+void tar_close(tar_handle_t *handle);
+
+/**
+ * Looks an entry up in the index.
+ * A path without a trailing slash also matches the directory of the same name.
+ *
+ * @param handle A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ *
+ * @return the indexed entry, or NULL if no entry at the given path exists in the archive.
+ */
+const tar_entry_t *tar_lookup(tar_handle_t *handle, char *path);
+
+/**
+ * Resolves a path to the entry it designates, following symlinks met on the way.
+ * Targets are taken relative to the directory holding the symlink, with "." and ".." resolved; a target that
+ * does not exist there is looked up from the root of the archive. Each symlink is resolved once for the life
+ * of the handle.
+ *
+ * @param handle A handle returned by tar_open().
+ * @param path A path to an entry in the archive.
+ * @param entry Set to the entry reached, which is not a symlink, or NULL.
+ *
+ * @return zero on success,
+ *         -1 if no entry at the given path exists in the archive or a symlink on the way is dangling,
+ *         -2 if more than 40 symlinks had to be followed, which includes every symlink loop.
+ */
+int tar_resolve(tar_handle_t *handle, char *path, const tar_entry_t **entry);
+
+/**
+ * Same as exists(), answered from the index without touching the file descriptor.
+ */
+int tar_exists(tar_handle_t *handle, char *path);
+
+/**
+ * Same as is_dir(), answered from the index without touching the file descriptor.
+ */
+int tar_is_dir(tar_handle_t *handle, char *path);
+
+/**
+ * Same as is_file(), answered from the index without touching the file descriptor.
+ */
+int tar_is_file(tar_handle_t *handle, char *path);
+
+/**
+ * Same as is_symlink(), answered from the index without touching the file descriptor.
+ */
+int tar_is_symlink(tar_handle_t *handle, char *path);
+
+/**
+ * Same as list(), answered from the index without touching the file descriptor, in time proportional
+ * to the number of entries listed. The listed directory itself is not part of the result, and a symlink
+ * in the directory is listed by its own name, where list() gives its link name.
+ */
+int tar_list(tar_handle_t *handle, char *path, char **entries, size_t *no_entries);
+
+/**
+ * Same as read_file(). The entry is found through the index, only its payload is read from the archive.
+ */
+ssize_t tar_read_file(tar_handle_t *handle, char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/**
+ * Lists the entries at a given path one at a time, so that a directory of any size can be paged through.
+ *
+ * @param handle A handle returned by tar_open().
+ * @param path A path to a directory in the archive. If the entry is a symlink, it is resolved as list() does.
+ * @param cursor An in-out argument. The caller sets it to zero to start listing, then passes it back unchanged.
+ * @param entry Set to the next entry of the directory.
+ *
+ * @return 1 if an entry was returned,
+ *         zero if every entry of the directory was already returned,
+ *         -1 if no directory at the given path exists in the archive.
+ */
+int tar_list_next(tar_handle_t *handle, char *path, size_t *cursor, const tar_entry_t **entry);
+
+/* Access patterns accepted by tar_map() */
+#define TAR_MAP_SEQUENTIAL 1    /* the archive will be read from start to end */
+#define TAR_MAP_RANDOM     2    /* entries will be read in no particular order */
+
+/**
+ * Maps the whole archive in memory. Once mapped, tar_read_file() copies straight from the mapping
+ * without any system call and tar_map_entry() can hand out pointers into it.
+ * Mapping twice only updates the access pattern hint.
+ *
+ * @param handle A handle returned by tar_open().
+ * @param advice TAR_MAP_SEQUENTIAL or TAR_MAP_RANDOM, passed to the kernel with madvise().
+ *
+ * @return zero on success, -1 if the archive could not be mapped, is compressed or is a union of archives.
+ */
+int tar_map(tar_handle_t *handle, int advice);
+
+/**
+ * Gives access to the content of a file without copying it.
+ * The archive is mapped with TAR_MAP_RANDOM if tar_map() was not called before.
+ *
+ * @param handle A handle returned by tar_open().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved as read_file() does.
+ * @param ptr Set to the first byte of the file inside the mapping, valid until tar_close().
+ * @param len Set to the size of the file.
+ *
+ * @return zero on success,
+ *         -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the archive could not be mapped.
+ */
+int tar_map_entry(tar_handle_t *handle, char *path, const uint8_t **ptr, size_t *len);
+
+/**
+ * Writes the index of a handle to a file, so that tar_open_indexed() can load it instead of walking the archive.
+ * The file is written next to its final path and renamed, a reader never sees it half written.
+ *
+ * @param handle A handle returned by tar_open().
+ * @param idx_path The path of the index file, e.g. "archive.tar.idx".
+ *
+ * @return zero on success, -1 if the file could not be written, the archive is compressed or is a union of archives.
+ */
+int tar_index_save(tar_handle_t *handle, const char *idx_path);
+
+/**
+ * Opens an archive through an index file kept next to it.
+ * The index is loaded when it matches the size, the modification time and the first and last headers
+ * of the archive. Otherwise the archive is walked as tar_open() does and the index file is rewritten.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file. It is not closed by tar_close().
+ * @param idx_path The path of the index file, e.g. "archive.tar.idx".
+ *
+ * @return a handle to pass to the tar_* queries, or NULL if the archive could not be read or memory is exhausted.
+ */
+tar_handle_t *tar_open_indexed(int tar_fd, const char *idx_path);
+
+/* Forward-only reader of an archive, see tar_iter_open() */
+typedef struct tar_iter tar_iter_t;
+
+/* Called by tar_iter_each() on each entry, a non-zero return value stops the walk */
+typedef int (*tar_iter_cb_t)(tar_iter_t *iter, const tar_entry_t *entry, void *arg);
+
+/**
+ * Starts reading an archive from the current position of a file descriptor.
+ * Headers and payloads are read strictly forward through a fixed 64 KiB window and nothing is ever
+ * seeked, so the archive may arrive on a pipe, a socket or the output of a decompressor.
+ *
+ * @param fd A file descriptor the archive is read from with read(), e.g. a pipe. It is not closed by tar_iter_close().
+ *
+ * @return an iterator to pass to tar_iter_next(), or NULL if memory is exhausted.
+ */
+tar_iter_t *tar_iter_open(int fd);
+
+/**
+ * Moves to the next entry of the archive. Whatever is left of the payload of the current entry is read and dropped.
+ *
+ * @param iter An iterator returned by tar_iter_open().
+ * @param entry Set to the next entry, valid until the next call. Its data offset counts from the start of the stream.
+ *
+ * @return 1 if an entry was returned,
+ *         zero at the end of the archive,
+ *         -1, -2 or -3 as check_archive() if the header is invalid,
+ *         -4 if the stream ends in the middle of an entry or cannot be read.
+ */
+int tar_iter_next(tar_iter_t *iter, const tar_entry_t **entry);
+
+/**
+ * Reads the payload of the entry last returned by tar_iter_next(), continuing where the previous call stopped.
+ *
+ * @param iter An iterator returned by tar_iter_open().
+ * @param dest A destination buffer to read the payload into.
+ * @param len The size of dest.
+ *
+ * @return the number of bytes copied to dest, zero once the whole payload was read, -1 on error or a truncated stream.
+ */
+ssize_t tar_iter_read(tar_iter_t *iter, uint8_t *dest, size_t len);
+
+/**
+ * Releases an iterator. The file descriptor is left open, positioned somewhere after the last entry returned.
+ *
+ * @param iter An iterator returned by tar_iter_open(), may be NULL.
+ */
+void tar_iter_close(tar_iter_t *iter);
+
+/**
+ * Calls a function on every entry of an archive read in one forward pass, as tar_iter_next() does.
+ * The callback may read the payload of the entry with tar_iter_read(), what it leaves is dropped.
+ *
+ * @param fd A file descriptor the archive is read from with read(), e.g. a pipe.
+ * @param callback Called once per entry with the iterator, the entry and arg. A non-zero return value stops the walk.
+ * @param arg Passed to callback unchanged.
+ *
+ * @return the number of entries passed to callback, or the negative value of tar_iter_next() on error,
+ *         or -5 if memory is exhausted.
+ */
+int tar_iter_each(int fd, tar_iter_cb_t callback, void *arg);
+
+/* What tar_stat_many() finds about one path */
+typedef struct tar_stat
+{
+    int exists;                   /* 1 if a header has this name, 0 otherwise and the other fields are unset */
+    char typeflag;
+    size_t size;                  /* size field of the header */
+    off_t data_offset;            /* offset of the first payload byte in the archive */
+} tar_stat_t;
+
+/**
+ * Finds the type, size and data offset of many paths in a single pass over the archive, without an index.
+ * The requested names are kept in a temporary hash set, so the cost is one scan plus a lookup per header.
+ * When the same name appears several times, the last header wins, as with tar_open().
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param paths The paths to look up, each equal to the name of a header to match it: unlike exists(),
+ *              a directory is only found with the trailing slash of its header, e.g. "dir/".
+ * @param n The number of paths.
+ * @param results An array of n results, results[i] is set for paths[i].
+ *
+ * @return the number of paths found in the archive, or -1 if the archive could not be read or memory is exhausted.
+ */
+int tar_stat_many(int tar_fd, char **paths, size_t n, tar_stat_t *results);
+
+/* One read of read_files_batch() */
+typedef struct tar_read
+{
+    char *path;                   /* as the arguments of read_file() */
+    size_t offset;
+    uint8_t *dest;
+    size_t len;                   /* in-out, as with read_file() */
+    ssize_t status;               /* set to what read_file() would return: -1, -2, zero or the bytes left to read */
+} tar_read_t;
+
+/* Flags of read_files_batch() */
+#define TAR_BATCH_PREAD   1       /* read from a pool of threads with pread(), even where io_uring is available */
+#define TAR_BATCH_THREADS 8       /* threads of that pool */
+
+/**
+ * Reads many files of an archive at once, the way read_file() reads one.
+ * The entries are found in a single pass over the archive, then every payload read is issued through
+ * io_uring with up to 256 reads in flight, or from a pool of threads calling pread() where io_uring is not
+ * available. Symlinks and hard links are read with read_file() itself.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param reqs The reads to do. For each one, path, offset, dest and len are the arguments of read_file(),
+ *             len is set to the number of bytes read and status to what read_file() would return.
+ *             A read that failed has status -1, its dest may have been written in part.
+ * @param n The number of reads.
+ * @param flags Zero, or TAR_BATCH_PREAD to use the pool of threads even where io_uring is available.
+ *
+ * @return zero once every read has its status, -1 if the archive could not be read or memory is exhausted.
+ */
+int read_files_batch(int tar_fd, tar_read_t *reqs, size_t n, int flags);
+
+/* What tar_extract() did, and the time taken by each of its phases */
+typedef struct tar_extract_stats
+{
+    size_t no_dirs;
+    size_t no_files;
+    size_t no_links;
+    uint64_t bytes;               /* payload bytes written to files */
+    double plan_ms;               /* index of the archive and walk of the subtree */
+    double dirs_ms;
+    double files_ms;
+    double links_ms;              /* symlinks, then permissions of the directories */
+} tar_extract_stats_t;
+
+/**
+ * Extracts a whole archive, or the subtree at a path, below a directory of the file system.
+ * Directories are created first, parents before children, then regular files are written by a pool of
+ * threads that take work from each other when they run out, copying inside the kernel where it can.
+ * Symlinks are created last, and the permission bits of the headers are applied, to directories at the very end
+ * so that a read-only directory can still be filled. As tar does without -p, the umask of the process is taken
+ * off these bits, 0755 for a directory without header, and setuid, setgid and sticky bits are never applied.
+ * An existing file is replaced, an existing directory keeps its mode. Hard links are extracted as copies of their target.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param subtree A path to an entry in the archive, or NULL or "" for the whole archive.
+ *                The entry itself is extracted, it is not followed if it is a symlink.
+ * @param dest_dir An existing directory. Each entry is written at dest_dir/name, a name that would
+ *                 escape dest_dir through ".." or a leading '/' is refused.
+ * @param no_threads The number of threads writing files, values below 1 count as 1.
+ * @param stats Set to the counts and the time taken by each phase, may be NULL.
+ *
+ * @return the number of entries that could not be extracted,
+ *         -1 if the archive could not be read, memory is exhausted or no entry exists at subtree.
+ */
+int tar_extract(int tar_fd, char *subtree, const char *dest_dir, int no_threads, tar_extract_stats_t *stats);
+
+typedef struct tar_cache tar_cache_t;
+
+typedef struct tar_cache_stats
+{
+    uint64_t hits;                /* blocks found in the cache */
+    uint64_t misses;              /* blocks read from an archive and added */
+    uint64_t evictions;           /* least recently used blocks dropped to make room */
+    size_t bytes;                 /* memory held by cached blocks */
+    size_t budget;
+} tar_cache_stats_t;
+
+/**
+ * Creates a block cache that handles opened with tar_open_cached() share, on the same archive or on different ones.
+ * Blocks of the archives are kept in memory as they are read by tar_read_file() and the least recently used
+ * ones are evicted once the budget is used up, so that hot entries are read again without any system call.
+ *
+ * @param budget The memory given to cached contents, in bytes. It is rounded down to blocks of 16 KiB.
+ *
+ * @return the cache, or NULL if the budget is below one block or memory is exhausted.
+ */
+tar_cache_t *tar_cache_create(size_t budget);
+
+/**
+ * Releases a cache and every block in it. The handles using it must be closed first.
+ *
+ * @param cache A cache returned by tar_cache_create(), may be NULL.
+ */
+void tar_cache_destroy(tar_cache_t *cache);
+
+/**
+ * Reads the counters of a cache, which are kept since its creation.
+ *
+ * @param cache A cache returned by tar_cache_create().
+ * @param stats Set to the counters and the memory in use.
+ */
+void tar_cache_stats(tar_cache_t *cache, tar_cache_stats_t *stats);
+
+/**
+ * Opens an archive as tar_open() does and serves tar_read_file() through a shared block cache.
+ * Blocks are keyed on the device and inode of the archive and their offset, so that handles opened on the
+ * same file through different descriptors share them. An archive must not be rewritten while cached.
+ * Reads of files larger than an eighth of the budget bypass the cache, as do reads of a mapped archive.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file. It is not closed by tar_close().
+ * @param cache A cache returned by tar_cache_create(), which must outlive the handle.
+ *
+ * @return a handle to pass to the tar_* queries, or NULL if the archive could not be read or memory is exhausted.
+ */
+tar_handle_t *tar_open_cached(int tar_fd, tar_cache_t *cache);
+
+/* Functions counted by tar_stats_get(), the public functions that read archives */
+#define TAR_FN_CHECK_ARCHIVE          0
+#define TAR_FN_CHECK_ARCHIVE_PARALLEL 1
+#define TAR_FN_EXISTS                 2
+#define TAR_FN_IS_DIR                 3
+#define TAR_FN_IS_FILE                4
+#define TAR_FN_IS_SYMLINK             5
+#define TAR_FN_LIST                   6
+#define TAR_FN_READ_FILE              7
+#define TAR_FN_SENDFILE               8
+#define TAR_FN_OPEN                   9
+#define TAR_FN_HANDLE_LIST            10
+#define TAR_FN_HANDLE_READ_FILE       11
+#define TAR_FN_OPEN_INDEXED           12
+#define TAR_FN_ITER_NEXT              13
+#define TAR_FN_ITER_READ              14
+#define TAR_FN_STAT_MANY              15
+#define TAR_FN_READ_FILES_BATCH       16
+#define TAR_FN_EXTRACT                17
+#define TAR_FN_UNION_OPEN             18
+#define TAR_FN_REFRESH                19
+#define TAR_FN_FIND                   20
+#define TAR_FN_VERIFY_CONTENTS        21
+#define TAR_FN_COUNT                  22
+
+/* Buckets of the latency histograms: bucket 0 counts calls under 1 us, bucket i calls from 2^(i-1) to 2^i us,
+ * the last one every longer call */
+#define TAR_HIST_BUCKETS 24
+
+typedef struct tar_fn_stats
+{
+    uint64_t calls;
+    uint64_t syscalls;            /* read(), pread(), copy and io_uring system calls on the archive, lseek() is never used */
+    uint64_t bytes;               /* bytes of the archive read by those system calls */
+    uint64_t headers;             /* headers decoded, extended headers included */
+    uint64_t wall_ns;             /* time spent in the calls, summed */
+    uint64_t latency[TAR_HIST_BUCKETS];
+} tar_fn_stats_t;
+
+typedef struct tar_stats
+{
+    tar_fn_stats_t fn[TAR_FN_COUNT];
+} tar_stats_t;
+
+/**
+ * Reads the statistics of every counted function, accumulated since the start or the last tar_stats_reset().
+ * The counters are updated as calls end and are read one by one, the copy is not a snapshot of a single instant.
+ *
+ * @param stats Set to the counters, stats->fn[TAR_FN_*] for each function.
+ */
+void tar_stats_get(tar_stats_t *stats);
+
+/**
+ * Sets every counter back to zero. Calls in progress are counted when they end.
+ */
+void tar_stats_reset(void);
+
+/**
+ * @param fn One of TAR_FN_*.
+ *
+ * @return the name of the counted function, e.g. "read_file", or NULL if fn is out of range.
+ */
+const char *tar_fn_name(int fn);
+
+#ifdef TAR_TRACE
+typedef struct tar_trace
+{
+    int fn;                       /* one of TAR_FN_* */
+    uint64_t syscalls;            /* same counters as tar_fn_stats_t, for this call only */
+    uint64_t bytes;
+    uint64_t headers;
+    uint64_t wall_ns;
+} tar_trace_t;
+
+typedef void (*tar_trace_cb_t)(const tar_trace_t *trace, void *arg);
+
+/**
+ * Installs a hook called at the end of every counted call, with what that call did.
+ * Only built when the library is compiled with -DTAR_TRACE, e.g. with "make clean trace".
+ * The callback and its argument are published together, so this may be called while other threads use
+ * the library: a call ending meanwhile sees either the previous pair or the new one, and may still run
+ * the previous callback after this returns. Each hook installed stays allocated until the process exits.
+ *
+ * @param callback Called on the thread that made the call, NULL to remove the hook.
+ * @param arg Passed to callback.
+ *
+ * @return zero, or -1 if memory is exhausted and the previous hook was kept.
+ */
+int tar_trace_set(tar_trace_cb_t callback, void *arg);
+#endif
+
+/**
+ * Opens a stack of archives, such as the layers of a container image, as one archive.
+ * Each layer is indexed as tar_open() does, then the layers are merged into one index, so that a query is
+ * answered by a single lookup whatever the number of layers: an entry of an upper layer shadows the entry
+ * of the same name below it. Whiteout files of a layer hide the entries of the layers below it:
+ * "dir/.wh.name" hides dir/name and everything under it, "dir/.wh..wh..opq" everything under dir/.
+ * The whiteout files themselves are not part of the union.
+ * tar_read_file() reads each file from the layer it comes from, tar_map() and tar_index_save() are refused.
+ *
+ * @param fds File descriptors of the layers, the base layer first and the top layer last. They are not closed
+ *            by tar_close(), a layer may be compressed.
+ * @param n The number of layers.
+ *
+ * @return a handle to pass to the tar_* queries, or NULL if a layer could not be read, n is zero or memory is exhausted.
+ */
+tar_handle_t *tar_union_open(int *fds, size_t n);
+
+/**
+ * Brings a handle up to date with an archive that was appended to since it was opened, as "tar -r" does.
+ * Only the headers written after the end of archive known to the handle are read, so the cost grows with
+ * the appended bytes and not with the size of the archive. Appended entries shadow the earlier entries
+ * of the same name, as they would have when opening the archive anew.
+ * The handle must not be queried by other threads during the call.
+ *
+ * @param handle A handle returned by tar_open(), tar_open_indexed() or tar_open_cached().
+ *
+ * @return the number of entries appended, zero if there is none,
+ *         -1 if the archive could not be read, memory is exhausted or the handle is compressed or a union,
+ *         -2 if the archive is now shorter than its known end, it must then be opened again.
+ */
+int tar_refresh(tar_handle_t *handle);
+
+/* Entry types selected by tar_find() */
+#define TAR_FIND_FILE     1
+#define TAR_FIND_DIR      2
+#define TAR_FIND_SYMLINK  4
+#define TAR_FIND_OTHER    8     /* hard links, devices and fifos */
+#define TAR_FIND_ANY      15
+
+/* Called by tar_find() on each matching entry, a non-zero return value stops the search */
+typedef int (*tar_find_cb_t)(const tar_entry_t *entry, void *arg);
+
+/**
+ * Calls a function on every entry whose name matches a glob pattern, in name order.
+ * The part of the pattern before its first wildcard is looked up in a name index sorted on first use,
+ * so that only the entries starting with it are visited, e.g. "usr/lib/libc*" never looks at "etc/".
+ * '*' and '?' match within a path component, '**' matches across components and, followed by a slash,
+ * zero or more whole directories. A trailing slash of a directory name is ignored when matching.
+ * The callback may run any query on the handle except tar_refresh().
+ *
+ * @param handle A handle returned by tar_open() or one of its variants.
+ * @param pattern A glob over the whole name, e.g. "etc/a?.conf", "usr/lib/libc*" or "src**.c".
+ * @param types A combination of TAR_FIND_FILE, TAR_FIND_DIR, TAR_FIND_SYMLINK and TAR_FIND_OTHER, or TAR_FIND_ANY.
+ * @param callback Called once per matching entry with the entry and arg. A non-zero return value stops the search.
+ * @param arg Passed to callback unchanged.
+ *
+ * @return the number of entries passed to callback, or -1 if memory is exhausted.
+ */
+int tar_find(tar_handle_t *handle, const char *pattern, int types, tar_find_cb_t callback, void *arg);
+
+/**
+ * Computes the CRC-32C (Castagnoli) of a buffer, with the crc32 instruction of SSE4.2 where available.
+ *
+ * @param crc Zero to start, or the result of the previous call to continue over a following buffer.
+ * @param buf The bytes to add.
+ * @param len The number of bytes.
+ *
+ * @return the CRC-32C of everything added so far, e.g. 0xe3069283 for "123456789".
+ */
+uint32_t tar_crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* Outcome of the verification of one file, see tar_verify_contents() */
+#define TAR_DIGEST_OK           0
+#define TAR_DIGEST_MISMATCH     1     /* size or crc32c differs from the manifest */
+#define TAR_DIGEST_UNLISTED     2     /* the manifest has no entry of that name */
+#define TAR_DIGEST_UNREADABLE   3     /* the archive ends before the end of the payload */
+
+/* Digest of the payload of a regular file */
+typedef struct tar_digest
+{
+    const char *name;
+    uint64_t size;
+    uint32_t crc32c;              /* tar_crc32c() of the whole payload */
+    int status;                   /* TAR_DIGEST_*, ignored in a manifest */
+} tar_digest_t;
+
+/* What tar_verify_contents() found */
+typedef struct tar_verify_stats
+{
+    size_t no_files;
+    size_t mismatches;
+    size_t unlisted;
+    size_t unreadable;
+    size_t missing;               /* names of the manifest without a regular file in the archive */
+    uint64_t bytes;               /* payload bytes hashed */
+    double seconds;               /* index of the archive and hashing, the comparison is not counted */
+    double gb_per_s;              /* bytes / seconds, in 10^9 bytes per second */
+} tar_verify_stats_t;
+
+/**
+ * Verifies the contents of every regular file of an archive, which check_archive() does not look at.
+ * The payloads are hashed with CRC-32C by a pool of threads, each taking the next file in archive order
+ * when it is done with one, and the digests are optionally compared with a manifest, e.g. the digests
+ * returned by an earlier call on a known good copy. A file is hashed by a single thread, however large.
+ * Where a name appears several times, the last entry is verified, as the other queries see it.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file, plain or gzip-compressed.
+ * @param no_threads The number of threads hashing files, values below 1 count as 1.
+ * @param manifest The expected name, size and crc32c of the files, or NULL to only compute the digests.
+ * @param no_manifest The number of entries of manifest.
+ * @param digests Set to the digest and status of every regular file in archive order, in one block the caller
+ *                releases with free(), or NULL if not wanted.
+ * @param no_digests Set to the number of digests, may be NULL.
+ * @param stats Set to the counts, the time taken and the hashing throughput, may be NULL.
+ *
+ * @return the number of problems: files that differ from the manifest, are missing from it or could not be read,
+ *         and names of the manifest absent from the archive; -1 if the archive could not be read or memory is exhausted.
+ */
+int tar_verify_contents(int tar_fd, int no_threads, const tar_digest_t *manifest, size_t no_manifest,
+                        tar_digest_t **digests, size_t *no_digests, tar_verify_stats_t *stats);
+
+/* Writer of an archive, see tar_writer_open() */
+typedef struct tar_writer tar_writer_t;
+
+/**
+ * Starts writing an archive, from the current position of a file descriptor.
+ * Headers and payloads are buffered and written in multiples of 64 KiB, so the archive may go to a pipe;
+ * only a regular file can be opened with its index afterwards.
+ *
+ * @param fd A file descriptor the archive is written to with write(). It is not closed by tar_writer_close().
+ *
+ * @return a writer to pass to tar_writer_add_*(), or NULL if memory is exhausted.
+ */
+tar_writer_t *tar_writer_open(int fd);
+
+/**
+ * Adds a regular file to the archive.
+ *
+ * @param writer A writer returned by tar_writer_open().
+ * @param name The path of the file in the archive, names that do not fit a ustar header are written with
+ *             a PAX extended header.
+ * @param data The content of the file.
+ * @param size The number of bytes of data.
+ * @param mode The permission bits stored in the header.
+ *
+ * @return zero on success, -1 if a write failed or memory is exhausted, every later call then fails too.
+ */
+int tar_writer_add_file(tar_writer_t *writer, const char *name, const void *data, size_t size, mode_t mode);
+
+/**
+ * Adds a directory to the archive, under its name with a trailing slash as tar writes it.
+ *
+ * @param writer A writer returned by tar_writer_open().
+ * @param name The path of the directory in the archive, with or without its trailing slash.
+ * @param mode The permission bits stored in the header.
+ *
+ * @return zero on success, -1 if a write failed or memory is exhausted, every later call then fails too.
+ */
+int tar_writer_add_dir(tar_writer_t *writer, const char *name, mode_t mode);
+
+/**
+ * Adds a symlink to the archive.
+ *
+ * @param writer A writer returned by tar_writer_open().
+ * @param name The path of the symlink in the archive.
+ * @param target The target of the symlink, relative to the directory holding it or absolute.
+ *
+ * @return zero on success, -1 if a write failed or memory is exhausted, every later call then fails too.
+ */
+int tar_writer_add_symlink(tar_writer_t *writer, const char *name, const char *target);
+
+/**
+ * Ends the archive and releases the writer.
+ * The index of the entries is stored after the end of archive marker, laid out as the files of
+ * tar_index_save() and followed by a block locating it, so that tar_open() loads it with four reads
+ * instead of walking every header, unless it no longer matches the archive. Other tar programs stop
+ * at the end of archive marker and never see it, appending to the archive as tar -r does overwrites it.
+ *
+ * @param writer A writer returned by tar_writer_open(), may be NULL.
+ *
+ * @return zero once the whole archive was written, -1 if a write failed or memory is exhausted.
+ */
+int tar_writer_close(tar_writer_t *writer);
+
 #endif
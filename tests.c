@@ -2,6 +2,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <zlib.h>
 
 #include "lib_tar.h"
 
@@ -23,6 +28,1574 @@ void debug_dump(const uint8_t *bytes, size_t len) {
         printf("\n");
     }
 }
+/**
+ * The byte-by-byte checksum the SIMD kernels must agree with.
+ */
+long reference_checksum(char *buffer) {
+    long result = 0;
+    for (int i = 0; i < 512; i++) {
+        if (i >= 148 && i <= 155) result += 32;
+        else result += buffer[i];
+    }
+    return result;
+}
+
+/**
+ * Compares checksum() and tar_octal() with the byte loop and strtol() on every block of the fixtures,
+ * on random blocks and on hand-written fields.
+ *
+ * @return the number of mismatches
+ */
+int header_decoding_test(void) {
+    int errors = 0;
+    char *fixtures[] = {"./archive.tar", "./archive2.tar", "./archive3.tar", "./archive4.tar"};
+    char block[512];
+    for (int f = 0; f < 4; f++) {
+        int fd = open(fixtures[f], O_RDONLY);
+        for (off_t pos = 0; pread(fd, block, 512, pos) == 512; pos += 512) {
+            tar_header_t *header = (tar_header_t*) block;
+            if (checksum(block) != reference_checksum(block)) errors++;
+            if (header->name[0] == '\0') continue;
+            if (TAR_INT(header->size) != strtol(header->size, NULL, 8)) errors++;
+            if (TAR_INT(header->mode) != strtol(header->mode, NULL, 8)) errors++;
+            if (TAR_INT(header->mtime) != strtol(header->mtime, NULL, 8)) errors++;
+            if (TAR_INT(header->chksum) != strtol(header->chksum, NULL, 8)) errors++;
+        }
+        close(fd);
+    }
+    srand(42);
+    for (int i = 0; i < 1000; i++) {
+        for (int j = 0; j < 512; j++) block[j] = (char) rand();
+        if (checksum(block) != reference_checksum(block)) errors++;
+    }
+    char *fields[] = {"0000644", "   644 ", "00000000017", "", "7", "  ", "0001238", "00000026\0002", "77777777777", " 1 2"};
+    for (int i = 0; i < 10; i++) {
+        char field[12] = {0};
+        strncpy(field, fields[i], 11);
+        if (tar_octal(field, 12) != strtol(field, NULL, 8)) errors++;
+        if (strlen(field) < 8 && tar_octal(field, 8) != strtol(field, NULL, 8)) errors++;
+    }
+    return errors;
+}
+
+/**
+ * Fills a ustar header the way tar writes it, checksum included.
+ */
+void fill_header(tar_header_t *header, const char *name, char typeflag, size_t size, const char *linkname) {
+    memset(header, 0, sizeof(tar_header_t));
+    strncpy(header->name, name, sizeof(header->name));
+    snprintf(header->mode, sizeof(header->mode), "%07o", typeflag == DIRTYPE ? 0755 : 0644);
+    snprintf(header->uid, sizeof(header->uid), "%07o", 1000);
+    snprintf(header->gid, sizeof(header->gid), "%07o", 1000);
+    snprintf(header->size, sizeof(header->size), "%011zo", size);
+    snprintf(header->mtime, sizeof(header->mtime), "%011o", 1639688000);
+    header->typeflag = typeflag;
+    if (linkname) strncpy(header->linkname, linkname, sizeof(header->linkname));
+    memcpy(header->magic, TMAGIC, TMAGLEN);
+    memcpy(header->version, TVERSION, TVERSLEN);
+    snprintf(header->chksum, sizeof(header->chksum), "%06lo", checksum((char*) header));
+    header->chksum[7] = ' ';
+}
+
+/**
+ * Recomputes the checksum of a header after fill_header() once its fields were edited.
+ */
+void seal_header(tar_header_t *header) {
+    snprintf(header->chksum, sizeof(header->chksum), "%06lo", checksum((char*) header));
+    header->chksum[7] = ' ';
+}
+
+/**
+ * Writes an archive of no_files small files spread over directories of 100 files.
+ *
+ * @return the number of headers written
+ */
+int write_synthetic_archive(const char *path, int no_files) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    char block[512], name[100];
+    uint8_t data[1536];
+    memset(data, 'x', sizeof(data));
+    int no_headers = 0;
+    for (int i = 0; i < no_files; i++) {
+        if (i % 100 == 0) {
+            snprintf(name, sizeof(name), "synthetic/d%d/", i / 100);
+            fill_header((tar_header_t*) block, name, DIRTYPE, 0, NULL);
+            write(fd, block, 512);
+            no_headers++;
+        }
+        size_t size = 1 + (i * 37) % 1500;
+        if (size % 512 == 0) size++;
+        snprintf(name, sizeof(name), "synthetic/d%d/f%d.txt", i / 100, i);
+        fill_header((tar_header_t*) block, name, REGTYPE, size, NULL);
+        write(fd, block, 512);
+        write(fd, data, 512 * ((size + 511) / 512));
+        no_headers++;
+    }
+    memset(block, 0, sizeof(block));
+    write(fd, block, 512);
+    write(fd, block, 512);
+    close(fd);
+    return no_headers;
+}
+
+double elapsed_ms(struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e3 + (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/**
+ * Compares check_archive_parallel() with check_archive() on the fixtures and on a synthetic archive,
+ * valid and corrupted, then prints the time taken with 1 to 8 threads.
+ */
+void parallel_check_test(void) {
+    char *fixtures[] = {"./archive.tar", "./archive2.tar", "./archive3.tar", "./archive4.tar"};
+    int mismatches = 0;
+    for (int f = 0; f < 4; f++) {
+        int fd = open(fixtures[f], O_RDONLY);
+        if (check_archive(fd) != check_archive_parallel(fd, 4)) mismatches++;
+        close(fd);
+    }
+    printf("PARALLEL CHECK fixtures mismatches -- %d (0)\n", mismatches);
+
+    int no_headers = write_synthetic_archive("./synthetic.tar", 20000);
+    int fd = open("./synthetic.tar", O_RDWR);
+    printf("PARALLEL CHECK synthetic -- %d (%d)\n", check_archive_parallel(fd, 4), no_headers);
+    for (int no_threads = 1; no_threads <= 8; no_threads *= 2) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int result = 0;
+        for (int i = 0; i < 10; i++) result = check_archive_parallel(fd, no_threads);
+        printf("PARALLEL CHECK threads=%d result=%d ms/scan=%.2f\n", no_threads, result, elapsed_ms(&start) / 10);
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < 10; i++) check_archive(fd);
+    printf("PARALLEL CHECK sequential ms/scan=%.2f\n", elapsed_ms(&start) / 10);
+
+    // break the checksum of a late header, then the magic of an earlier one: the earlier one must be reported
+    tar_handle_t *handle = tar_open(fd);
+    off_t late = tar_lookup(handle, "synthetic/d150/f15000.txt")->data_offset - 512;
+    off_t early = tar_lookup(handle, "synthetic/d30/f3000.txt")->data_offset - 512;
+    tar_close(handle);
+    pwrite(fd, "9", 1, late + 148);
+    printf("PARALLEL CHECK bad checksum -- %d (%d)\n", check_archive_parallel(fd, 4), check_archive(fd));
+    pwrite(fd, "ustaR", 5, early + 257);
+    printf("PARALLEL CHECK bad magic first -- %d (%d)\n", check_archive_parallel(fd, 4), check_archive(fd));
+    close(fd);
+
+    // an archive stored as a file spans several ranges, its headers must not be counted
+    write_synthetic_archive("./synthetic.tar", 4000);
+    fd = open("./synthetic.tar", O_RDONLY);
+    struct stat st;
+    fstat(fd, &st);
+    char *inner = (char*) malloc(st.st_size);
+    pread(fd, inner, st.st_size, 0);
+    close(fd);
+    fd = open("./nested.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    char block[512];
+    fill_header((tar_header_t*) block, "inner.tar", REGTYPE, st.st_size, NULL);
+    write(fd, block, 512);
+    write(fd, inner, st.st_size);
+    fill_header((tar_header_t*) block, "after.txt", REGTYPE, 0, NULL);
+    write(fd, block, 512);
+    memset(block, 0, sizeof(block));
+    write(fd, block, 512);
+    write(fd, block, 512);
+    free(inner);
+    int nested = check_archive_parallel(fd, 4);
+    printf("PARALLEL CHECK nested archive -- %d (%d)\n", nested, check_archive(fd));
+    close(fd);
+    unlink("./nested.tar");
+    unlink("./synthetic.tar");
+}
+
+/**
+ * Lists directories of an archive whose directories have no header, and a directory of 1000 files page by page.
+ */
+void tree_test(void) {
+    int fd = open("./tree.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    char block[512], name[100];
+    char *names[] = {"implicit/a/b.txt", "implicit/a/c.txt", "top.txt", "implicit/d.txt"};
+    for (int i = 0; i < 4; i++) {
+        fill_header((tar_header_t*) block, names[i], REGTYPE, 0, NULL);
+        write(fd, block, 512);
+    }
+    fill_header((tar_header_t*) block, "big/", DIRTYPE, 0, NULL);
+    write(fd, block, 512);
+    for (int i = 0; i < 1000; i++) {
+        snprintf(name, sizeof(name), "big/f%d", i);
+        fill_header((tar_header_t*) block, name, REGTYPE, 0, NULL);
+        write(fd, block, 512);
+    }
+    memset(block, 0, sizeof(block));
+    write(fd, block, 512);
+    write(fd, block, 512);
+
+    tar_handle_t *handle = tar_open(fd);
+    printf("TREE implicit dir -- %d (1)\n", tar_is_dir(handle, "implicit/a/"));
+    printf("TREE implicit top dir -- %d (1)\n", tar_is_dir(handle, "implicit"));
+    char *entries[4];
+    char storage[4][100];
+    for (int i = 0; i < 4; i++) entries[i] = storage[i];
+    size_t no_entries = 4;
+    printf("TREE LIST implicit -- %d (1)\n", tar_list(handle, "implicit/", entries, &no_entries));
+    printf("TREE LIST implicit count -- %zu (2)\n", no_entries);
+    for (int i = 0; i < no_entries; i++) printf("TREE LIST: %s\n", entries[i]);
+    no_entries = 4;
+    tar_list(handle, "implicit/a/", entries, &no_entries);
+    printf("TREE LIST nested -- %zu (2) %s %s\n", no_entries, entries[0], no_entries > 1 ? entries[1] : "");
+
+    size_t cursor = 0, listed = 0;
+    const tar_entry_t *entry;
+    int order = 1;
+    while (tar_list_next(handle, "big/", &cursor, &entry) == 1) {
+        snprintf(name, sizeof(name), "big/f%zu", listed++);
+        if (strcmp(entry->name, name) != 0) order = 0;
+    }
+    printf("TREE LIST NEXT count -- %zu (1000)\n", listed);
+    printf("TREE LIST NEXT archive order -- %d (1)\n", order);
+    printf("TREE LIST NEXT after end -- %d (0)\n", tar_list_next(handle, "big/", &cursor, &entry));
+    cursor = 0;
+    printf("TREE LIST NEXT file -- %d (-1)\n", tar_list_next(handle, "top.txt", &cursor, &entry));
+    tar_close(handle);
+    close(fd);
+    unlink("./tree.tar");
+}
+
+/**
+ * Resolves relative, absolute and chained symlinks, symlinked directories in the middle of a path and loops.
+ */
+void symlink_test(int archive4_fd) {
+    int fd = open("./links.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    char block[512];
+    char *links[][2] = {{"loop/a", "b"}, {"loop/b", "./a"}, {"chain/1", "2"}, {"chain/2", "../chain/3"},
+                        {"chain/3", "/real/file.txt"}, {"chain/dirlink", "../real/"}, {"self", "self"}};
+    for (int i = 0; i < 7; i++) {
+        fill_header((tar_header_t*) block, links[i][0], SYMTYPE, 0, links[i][1]);
+        write(fd, block, 512);
+    }
+    for (int i = 0; i <= 40; i++) { // long/0 is one link too many, long/1 a chain of exactly 40 links
+        char name[16], target[32];
+        snprintf(name, sizeof(name), "long/%d", i);
+        if (i < 40) snprintf(target, sizeof(target), "%d", i + 1);
+        else snprintf(target, sizeof(target), "/real/file.txt");
+        fill_header((tar_header_t*) block, name, SYMTYPE, 0, target);
+        write(fd, block, 512);
+    }
+    fill_header((tar_header_t*) block, "real/file.txt", REGTYPE, 5, NULL);
+    write(fd, block, 512);
+    memset(block, 0, sizeof(block));
+    memcpy(block, "hello", 5);
+    write(fd, block, 512);
+    memset(block, 0, sizeof(block));
+    write(fd, block, 512);
+    write(fd, block, 512);
+
+    tar_handle_t *handle = tar_open(fd);
+    const tar_entry_t *entry;
+    printf("SYMLINK chain -- %d (0)\n", tar_resolve(handle, "chain/1", &entry));
+    printf("SYMLINK chain target -- %s (real/file.txt)\n", entry ? entry->name : "NULL");
+    printf("SYMLINK chain cached -- %d (0)\n", tar_resolve(handle, "chain/1", &entry));
+    printf("SYMLINK loop -- %d (-2)\n", tar_resolve(handle, "loop/a", &entry));
+    printf("SYMLINK loop again -- %d (-2)\n", tar_resolve(handle, "loop/b", &entry));
+    printf("SYMLINK self -- %d (-2)\n", tar_resolve(handle, "self", &entry));
+    printf("SYMLINK missing -- %d (-1)\n", tar_resolve(handle, "chain/4", &entry));
+    printf("SYMLINK too long -- %d (-2)\n", tar_resolve(handle, "long/0", &entry));
+    printf("SYMLINK 40 links after too long -- %d (0)\n", tar_resolve(handle, "long/1", &entry));
+    printf("SYMLINK middle after too long -- %d (0)\n", tar_resolve(handle, "long/20", &entry));
+    printf("SYMLINK too long again -- %d (-2)\n", tar_resolve(handle, "long/0", &entry));
+    uint8_t dest[16];
+    size_t len = sizeof(dest);
+    printf("SYMLINK READ through dir link -- %zd (0)\n", tar_read_file(handle, "chain/dirlink/file.txt", 0, dest, &len));
+    printf("SYMLINK READ through dir link content -- %d (1)\n", len == 5 && memcmp(dest, "hello", 5) == 0);
+    len = sizeof(dest);
+    printf("SYMLINK READ loop -- %zd (-1)\n", tar_read_file(handle, "loop/a", 0, dest, &len));
+    tar_close(handle);
+    len = sizeof(dest);
+    printf("SYMLINK legacy READ chain -- %zd (0)\n", read_file(fd, "chain/1", 0, dest, &len));
+    len = sizeof(dest);
+    printf("SYMLINK legacy READ loop -- %zd (-1)\n", read_file(fd, "loop/a", 0, dest, &len));
+    close(fd);
+    unlink("./links.tar");
+
+    handle = tar_open(archive4_fd); // archive/link -> ../archive/dir
+    char *entries[4];
+    char storage[4][100];
+    for (int i = 0; i < 4; i++) entries[i] = storage[i];
+    size_t no_entries = 4;
+    printf("SYMLINK LIST relative -- %d (1)\n", tar_list(handle, "archive/link", entries, &no_entries));
+    printf("SYMLINK LIST relative count -- %zu (3)\n", no_entries);
+    len = sizeof(dest);
+    printf("SYMLINK READ under link -- %zd (0)\n", tar_read_file(handle, "archive/link/file2.txt", 0, dest, &len));
+    printf("SYMLINK READ under link content -- %d (1)\n", len == 6 && memcmp(dest, "Hello", 5) == 0);
+    tar_close(handle);
+    no_entries = 4;
+    printf("SYMLINK legacy LIST relative -- %d (1)\n", list(archive4_fd, "archive/link", entries, &no_entries));
+}
+
+/**
+ * Writes a whole file into a pipe, in small pieces so that reads on the other end come back short.
+ */
+void *pipe_feeder(void *arg) {
+    int *fds = (int*) arg;
+    char buffer[700];
+    ssize_t got;
+    while ((got = read(fds[0], buffer, sizeof(buffer))) > 0) write(fds[1], buffer, got);
+    close(fds[1]);
+    return NULL;
+}
+
+/**
+ * @return the read end of a pipe fed with the content of the file at path
+ */
+int pipe_from(const char *path, pthread_t *feeder, int *fds) {
+    int ends[2];
+    pipe(ends);
+    fds[0] = open(path, O_RDONLY);
+    fds[1] = ends[1];
+    pthread_create(feeder, NULL, pipe_feeder, fds);
+    return ends[0];
+}
+
+typedef struct iter_count {
+    int files;
+    int hello;
+} iter_count_t;
+
+int count_files(tar_iter_t *iter, const tar_entry_t *entry, void *arg) {
+    iter_count_t *count = (iter_count_t*) arg;
+    if (entry->typeflag == REGTYPE) count->files++;
+    uint8_t dest[8];
+    if (strcmp(entry->name, "archive/dir/file2.txt") == 0 && entry->size == 6
+        && tar_iter_read(iter, dest, 3) == 3 && tar_iter_read(iter, dest + 3, 8) == 3
+        && tar_iter_read(iter, dest, 8) == 0 && memcmp(dest + 3, "lo\n", 3) == 0) count->hello++;
+    return 0;
+}
+
+/**
+ * Streams archives through pipes, which cannot seek, and compares with what the handle sees.
+ */
+void iter_test(int archive4_fd) {
+    int fds[2];
+    pthread_t feeder;
+    int fd = pipe_from("./archive4.tar", &feeder, fds);
+    tar_iter_t *iter = tar_iter_open(fd);
+    const tar_entry_t *entry;
+    int no_entries = 0, status;
+    uint8_t dest[64];
+    ssize_t read_len = 0;
+    while ((status = tar_iter_next(iter, &entry)) > 0) {
+        no_entries++;
+        if (strcmp(entry->name, "archive/file.txt") == 0 && entry->size > 0) read_len = tar_iter_read(iter, dest, sizeof(dest));
+    }
+    printf("ITER entries -- %d (%d)\n", no_entries, check_archive(archive4_fd));
+    printf("ITER end -- %d (0)\n", status);
+    printf("ITER end again -- %d (0)\n", tar_iter_next(iter, &entry));
+    printf("ITER READ -- %zd (22)\n", read_len);
+    printf("ITER READ content -- %d (1)\n", memcmp(dest, "Hello file.txt world!", 21) == 0);
+    tar_iter_close(iter);
+    pthread_join(feeder, NULL);
+    close(fds[0]); close(fd);
+
+    fd = pipe_from("./archive4.tar", &feeder, fds);
+    iter_count_t count = {0, 0};
+    printf("ITER EACH -- %d (18)\n", tar_iter_each(fd, count_files, &count));
+    printf("ITER EACH files -- %d (4)\n", count.files);
+    printf("ITER EACH partial reads -- %d (1)\n", count.hello);
+    pthread_join(feeder, NULL);
+    close(fds[0]); close(fd);
+
+    write_synthetic_archive("./iter.tar", 2000);
+    int tar = open("./iter.tar", O_RDONLY);
+    int expected = check_archive(tar);
+    close(tar);
+    fd = pipe_from("./iter.tar", &feeder, fds);
+    count = (iter_count_t) {0, 0};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    printf("ITER EACH synthetic -- %d (%d)\n", tar_iter_each(fd, count_files, &count), expected);
+    printf("ITER EACH synthetic ms=%.1f\n", elapsed_ms(&start));
+    pthread_join(feeder, NULL);
+    close(fds[0]); close(fd);
+
+    int truncated = open("./iter.tar", O_RDWR);
+    ftruncate(truncated, 512 * 10 + 100);
+    close(truncated);
+    fd = pipe_from("./iter.tar", &feeder, fds);
+    printf("ITER truncated -- %d (-4)\n", tar_iter_each(fd, count_files, &count));
+    pthread_join(feeder, NULL);
+    close(fds[0]); close(fd);
+    unlink("./iter.tar");
+}
+
+/**
+ * Looks many paths up in one pass and compares with the same number of exists() calls.
+ */
+void stat_many_test(void) {
+    int fd = open("./archive4.tar", O_RDONLY);
+    char *paths[] = {"archive/dir/not_dir/", "archive/dir/archive.tar", "missing", "archive/file.txt",
+                     "archive/dir/not_dir/"};
+    tar_stat_t results[5];
+    printf("STAT MANY archive4 -- %d (4)\n", tar_stat_many(fd, paths, 5, results));
+    printf("STAT MANY dir -- %c (5)\n", results[0].typeflag);
+    printf("STAT MANY repeated -- %c (5)\n", results[4].typeflag);
+    printf("STAT MANY last header wins -- %c (1)\n", results[1].typeflag);
+    printf("STAT MANY missing -- %d (0)\n", results[2].exists);
+    close(fd);
+
+    write_synthetic_archive("./stat.tar", 20000);
+    fd = open("./stat.tar", O_RDONLY);
+    char names[64][100];
+    char *many[64];
+    for (int i = 0; i < 64; i++) {
+        snprintf(names[i], sizeof(names[i]), "synthetic/d%d/f%d.txt", i * 311 / 100, i * 311);
+        many[i] = names[i];
+    }
+    snprintf(names[63], sizeof(names[63]), "synthetic/none.txt");
+    tar_stat_t stats[64];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int found = tar_stat_many(fd, many, 64, stats);
+    double one_pass = elapsed_ms(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int found_exists = 0;
+    for (int i = 0; i < 64; i++) found_exists += exists(fd, many[i]) != 0;
+    double scans = elapsed_ms(&start);
+    printf("STAT MANY synthetic -- %d (%d)\n", found, found_exists);
+    printf("STAT MANY synthetic size -- %zu (%d)\n", stats[1].size, 1 + (311 * 37) % 1500);
+    uint8_t dest[4];
+    printf("STAT MANY synthetic offset -- %zd (4)\n", pread(fd, dest, 4, stats[1].data_offset));
+    printf("STAT MANY 64 paths one pass ms=%.2f exists() ms=%.2f\n", one_pass, scans);
+    close(fd);
+    unlink("./stat.tar");
+}
+
+/**
+ * Reads many files of a synthetic archive at once, through io_uring and through the pool of threads,
+ * and compares every status and byte with read_file().
+ */
+void batch_test(void) {
+    int fd = open("./archive4.tar", O_RDONLY);
+    uint8_t dest[4][64];
+    char *file3 = "archive/dir/not_dir/file3.txt";
+    tar_read_t small[4] = {{file3, 0, dest[0], 64}, {file3, 4, dest[1], 3}, {file3, 16, dest[2], 64},
+                           {"missing", 0, dest[3], 64}};
+    printf("BATCH archive4 -- %d (0)\n", read_files_batch(fd, small, 4, 0));
+    printf("BATCH whole -- %zd %zu (0 16)\n", small[0].status, small[0].len);
+    printf("BATCH middle -- %zd %zu (9 3)\n", small[1].status, small[1].len);
+    printf("BATCH past end -- %zd (-2)\n", small[2].status);
+    printf("BATCH missing -- %zd (-1)\n", small[3].status);
+    printf("BATCH content -- %d (1)\n", memcmp(dest[0] + 4, dest[1], 3) == 0);
+    close(fd);
+
+    write_synthetic_archive("./batch.tar", 20000);
+    fd = open("./batch.tar", O_RDONLY);
+    int no_reqs = 1000;
+    tar_read_t *reqs = (tar_read_t*) malloc(sizeof(tar_read_t) * no_reqs);
+    char (*names)[100] = malloc(100 * no_reqs);
+    uint8_t *buffers = (uint8_t*) malloc(1600 * no_reqs), expected[1600];
+    for (int flags = 0; flags <= TAR_BATCH_PREAD; flags++) {
+        for (int i = 0; i < no_reqs; i++) {
+            int file = i * 19;
+            snprintf(names[i], 100, "synthetic/d%d/f%d.txt", file / 100, file);
+            reqs[i] = (tar_read_t) {names[i], i % 7, buffers + 1600 * i, 1000};
+        }
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int result = read_files_batch(fd, reqs, no_reqs, flags);
+        double ms = elapsed_ms(&start);
+        int errors = 0;
+        for (int i = 0; i < no_reqs; i++) {
+            size_t len = 1000;
+            ssize_t status = read_file(fd, names[i], i % 7, expected, &len);
+            if (status != reqs[i].status) errors++;
+            else if (status >= 0 && (len != reqs[i].len || memcmp(expected, reqs[i].dest, len) != 0)) errors++;
+        }
+        printf("BATCH %s -- %d %d (0 0)\n", flags ? "pread pool" : "io_uring", result, errors);
+        printf("BATCH %s reads=%d ms=%.2f\n", flags ? "pread pool" : "io_uring", no_reqs, ms);
+    }
+    free(reqs);
+    free(names);
+    free(buffers);
+    close(fd);
+    unlink("./batch.tar");
+}
+
+/**
+ * Copies a file of the archive to a regular file, a pipe, a socket and a file opened in append mode,
+ * which each take a different path through the kernel.
+ */
+void sendfile_test(void) {
+    int fd = open("./archive4.tar", O_RDONLY);
+    int out = open("./sendfile.out", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    char copy[64];
+    size_t len = 64;
+    printf("SENDFILE file -- %zd (0)\n", tar_sendfile(fd, "archive/dir/not_dir/file3.txt", out, 0, &len));
+    ssize_t got = pread(out, copy, sizeof(copy), 0);
+    printf("SENDFILE file content -- %zd %d (16 1)\n", got, len == 16 && memcmp(copy, "file3.txt Hello\n", 16) == 0);
+    len = 5;
+    printf("SENDFILE partial -- %zd (5)\n", tar_sendfile(fd, "archive/dir/not_dir/file3.txt", out, 6, &len));
+    got = pread(out, copy, sizeof(copy), 0);
+    printf("SENDFILE partial content -- %zd %d (21 1)\n", got, len == 5 && memcmp(copy + 16, "txt H", 5) == 0);
+    printf("SENDFILE past end -- %zd (-2)\n", tar_sendfile(fd, "archive/dir/not_dir/file3.txt", out, 16, &len));
+    printf("SENDFILE dir -- %zd (-1)\n", tar_sendfile(fd, "archive/dir/", out, 0, &len));
+    close(out);
+    out = open("./sendfile.out", O_WRONLY | O_APPEND);
+    len = 64;
+    printf("SENDFILE append -- %zd (0)\n", tar_sendfile(fd, "archive/file.txt", out, 0, &len));
+    printf("SENDFILE append length -- %zu %lld (22 43)\n", len, (long long) lseek(out, 0, SEEK_END));
+    close(out);
+    unlink("./sendfile.out");
+
+    int ends[2];
+    pipe(ends);
+    len = 64;
+    printf("SENDFILE pipe -- %zd (0)\n", tar_sendfile(fd, "archive/dir/file2.txt", ends[1], 0, &len));
+    got = read(ends[0], copy, sizeof(copy));
+    printf("SENDFILE pipe content -- %zd %d (6 1)\n", got, memcmp(copy, "Hello\n", 6) == 0);
+    close(ends[0]); close(ends[1]);
+    socketpair(AF_UNIX, SOCK_STREAM, 0, ends);
+    len = 64;
+    printf("SENDFILE socket -- %zd (0)\n", tar_sendfile(fd, "archive/file.txt", ends[0], 0, &len));
+    printf("SENDFILE socket content -- %zd (22)\n", read(ends[1], copy, sizeof(copy)));
+    close(ends[0]); close(ends[1]);
+    close(fd);
+}
+
+/**
+ * Extracts archive4.tar whole and by subtree, then a synthetic archive with 1 and 4 threads.
+ */
+void extract_test(void) {
+    int fd = open("./archive4.tar", O_RDONLY);
+    char dir[] = "./extract.XXXXXX";
+    mkdtemp(dir);
+    tar_extract_stats_t stats;
+    printf("EXTRACT archive4 -- %d (0)\n", tar_extract(fd, NULL, dir, 2, &stats));
+    printf("EXTRACT counts -- %zu %zu %zu (3 4 1)\n", stats.no_dirs, stats.no_files, stats.no_links);
+    char path[256], target[256];
+    snprintf(path, sizeof(path), "%s/archive/dir/not_dir/file3.txt", dir);
+    struct stat st;
+    int status = stat(path, &st);
+    printf("EXTRACT file -- %d %lld %o (0 16 644)\n", status, (long long) st.st_size, st.st_mode & 0777);
+    snprintf(path, sizeof(path), "%s/archive/link", dir);
+    ssize_t got = readlink(path, target, sizeof(target));
+    printf("EXTRACT hard link to symlink -- %zd %d (14 1)\n", got, got == 14 && memcmp(target, "../archive/dir", 14) == 0);
+
+    char sub[] = "./extract.XXXXXX";
+    mkdtemp(sub);
+    printf("EXTRACT subtree -- %d (0)\n", tar_extract(fd, "archive/dir/not_dir/", sub, 1, &stats));
+    snprintf(path, sizeof(path), "%s/archive/dir/not_dir/file3.txt", sub);
+    printf("EXTRACT subtree file -- %d (0)\n", access(path, R_OK));
+    snprintf(path, sizeof(path), "%s/archive/file.txt", sub);
+    printf("EXTRACT subtree only -- %d (-1)\n", access(path, F_OK));
+    printf("EXTRACT missing subtree -- %d (-1)\n", tar_extract(fd, "nothing/", sub, 1, NULL));
+    close(fd);
+
+    fd = open("./extract.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    char block[512];
+    fill_header((tar_header_t*) block, "ro/", DIRTYPE, 0, NULL);
+    memcpy(((tar_header_t*) block)->mode, "0000555", 8);
+    snprintf(((tar_header_t*) block)->chksum, 8, "%06o", (unsigned) checksum(block));
+    write(fd, block, 512);
+    fill_header((tar_header_t*) block, "ro/a.txt", REGTYPE, 3, NULL);
+    memcpy(((tar_header_t*) block)->mode, "0006777", 8); // setuid and setgid
+    seal_header((tar_header_t*) block);
+    write(fd, block, 512);
+    memset(block, 0, sizeof(block));
+    memcpy(block, "abc", 3);
+    write(fd, block, 512);
+    fill_header((tar_header_t*) block, "ro/b", SYMTYPE, 0, "a.txt");
+    write(fd, block, 512);
+    fill_header((tar_header_t*) block, "implicit/c", SYMTYPE, 0, "../ro/a.txt"); // its directory has no header
+    write(fd, block, 512);
+    fill_header((tar_header_t*) block, "../escape.txt", REGTYPE, 0, NULL);
+    write(fd, block, 512);
+    memset(block, 0, sizeof(block));
+    write(fd, block, 512);
+    write(fd, block, 512);
+    // "../escape.txt" and the directory "../" indexed for it are both refused
+    mode_t mask = umask(027);
+    printf("EXTRACT escape refused -- %d (2)\n", tar_extract(fd, NULL, sub, 1, &stats));
+    umask(mask);
+    snprintf(path, sizeof(path), "%s/ro/b", sub);
+    got = readlink(path, target, sizeof(target));
+    printf("EXTRACT symlink -- %zd %d (5 1)\n", got, got == 5 && memcmp(target, "a.txt", 5) == 0);
+    snprintf(path, sizeof(path), "%s/ro", sub);
+    stat(path, &st);
+    printf("EXTRACT read-only dir -- %o (550)\n", st.st_mode & 0777); // without the bits of the umask
+    snprintf(path, sizeof(path), "%s/ro/a.txt", sub);
+    stat(path, &st);
+    printf("EXTRACT no special bits -- %o (750)\n", st.st_mode & 07777);
+    snprintf(path, sizeof(path), "%s/implicit", sub);
+    stat(path, &st);
+    printf("EXTRACT implicit dir -- %o (750)\n", st.st_mode & 07777);
+    close(fd);
+    unlink("./extract.tar");
+
+    write_synthetic_archive("./extract.tar", 5000);
+    fd = open("./extract.tar", O_RDONLY);
+    for (int no_threads = 1; no_threads <= 4; no_threads *= 4) {
+        char big[] = "./extract.XXXXXX";
+        mkdtemp(big);
+        int errors = tar_extract(fd, "synthetic/", big, no_threads, &stats);
+        printf("EXTRACT synthetic threads=%d -- %d %zu (0 5000)\n", no_threads, errors, stats.no_files);
+        printf("EXTRACT synthetic threads=%d plan=%.1fms dirs=%.1fms files=%.1fms links=%.1fms bytes=%llu\n",
+               no_threads, stats.plan_ms, stats.dirs_ms, stats.files_ms, stats.links_ms, (unsigned long long) stats.bytes);
+        snprintf(path, sizeof(path), "rm -rf %s", big);
+        system(path);
+    }
+    close(fd);
+    unlink("./extract.tar");
+    snprintf(path, sizeof(path), "chmod -R u+w %s %s && rm -rf %s %s", dir, sub, dir, sub);
+    system(path);
+}
+
+/**
+ * Writes an extended header of the given type followed by its payload.
+ */
+void write_extended(int fd, char typeflag, const char *payload) {
+    char block[512];
+    size_t len = strlen(payload) + (typeflag == GNUTYPE_LONGNAME || typeflag == GNUTYPE_LONGLINK); // GNU counts the nul
+    fill_header((tar_header_t*) block, "././@LongLink", typeflag, len, NULL);
+    write(fd, block, 512);
+    for (size_t done = 0; done < len; done += 512) {
+        memset(block, 0, sizeof(block));
+        memcpy(block, payload + done, len - done < 512 ? len - done : 512);
+        write(fd, block, 512);
+    }
+}
+
+/**
+ * Reads names longer than 100 bytes from PAX headers, GNU long names and the ustar prefix, sizes from PAX
+ * headers and base-256 fields, and payloads of every type, through the scans, the handle and the iterator.
+ */
+void large_archive_test(void) {
+    char field[12];
+    memset(field, 0, sizeof(field));
+    field[0] = (char) 0x80;
+    field[7] = 0x02; field[8] = (char) 0x80; // 10 GiB = 0x280000000
+    printf("LARGE base-256 -- %lld (10737418240)\n", (long long) tar_octal(field, sizeof(field)));
+    memset(field, 0xff, sizeof(field));
+    field[11] = (char) 0xfe;
+    printf("LARGE base-256 negative -- %lld (-2)\n", (long long) tar_octal(field, sizeof(field)));
+
+    char pax_name[200], gnu_name[300], gnu_link[300], prefix_name[200], record[512];
+    memset(pax_name, 'p', 150); strcpy(pax_name + 150, "/pax.txt");
+    memset(gnu_name, 'g', 250); strcpy(gnu_name + 250, "/gnu.txt");
+    memset(gnu_link, 'l', 250); strcpy(gnu_link + 250, "/link");
+    memset(prefix_name, 'u', 120); strcpy(prefix_name + 120, "/prefix.txt");
+    int fd = open("./large.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    char block[512], data[1536];
+    memset(data, 'd', sizeof(data));
+    tar_header_t *header = (tar_header_t*) block;
+
+    write_extended(fd, XGLTYPE, "21 comment=any value\n");
+    snprintf(record, sizeof(record), "%d path=%s\n", (int) (strlen(pax_name) + 10), pax_name); // 3 digits, space, path=, \n
+    write_extended(fd, XHDTYPE, record);
+    fill_header(header, "truncated", REGTYPE, 1000, NULL);
+    write(fd, block, 512);
+    write(fd, data, 1024);
+    write_extended(fd, XHDTYPE, "12 size=700\n"); // wins over the size field of the next header
+    write_extended(fd, GNUTYPE_LONGNAME, gnu_name);
+    fill_header(header, "gnu", REGTYPE, 0, NULL);
+    write(fd, block, 512);
+    write(fd, data, 1024);
+    write_extended(fd, GNUTYPE_LONGNAME, "gnu-link");
+    write_extended(fd, GNUTYPE_LONGLINK, gnu_link);
+    fill_header(header, "k", SYMTYPE, 0, "short");
+    write(fd, block, 512);
+    fill_header(header, "prefix.txt", REGTYPE, 512, NULL);
+    memcpy(header->prefix, prefix_name, 120);
+    seal_header(header);
+    write(fd, block, 512);
+    write(fd, data, 512);
+    fill_header(header, "fifo", FIFOTYPE, 0, NULL);
+    write(fd, block, 512);
+    fill_header(header, "base256.txt", REGTYPE, 0, NULL);
+    memset(header->size, 0, sizeof(header->size));
+    header->size[0] = (char) 0x80;
+    header->size[10] = 0x02; header->size[11] = (char) 0x01; // 513 bytes
+    seal_header(header);
+    write(fd, block, 512);
+    write(fd, data, 1024);
+    fill_header(header, "last.txt", REGTYPE, 1, NULL);
+    write(fd, block, 512);
+    write(fd, data, 512);
+    memset(block, 0, sizeof(block));
+    write(fd, block, 512);
+    write(fd, block, 512);
+
+    printf("LARGE check -- %d (13)\n", check_archive(fd));
+    printf("LARGE PAX name -- %d (1)\n", is_file(fd, pax_name));
+    printf("LARGE GNU name -- %d (1)\n", is_file(fd, gnu_name));
+    printf("LARGE ustar prefix -- %d (1)\n", is_file(fd, prefix_name));
+    printf("LARGE after base-256 -- %d (1)\n", is_file(fd, "last.txt"));
+    uint8_t dest[1024];
+    size_t len = sizeof(dest);
+    ssize_t status = read_file(fd, gnu_name, 0, dest, &len);
+    printf("LARGE PAX size -- %zd %zu (0 700)\n", status, len);
+    len = sizeof(dest);
+    status = read_file(fd, "base256.txt", 0, dest, &len);
+    printf("LARGE base-256 size -- %zd %zu (0 513)\n", status, len);
+
+    tar_handle_t *handle = tar_open(fd);
+    const tar_entry_t *entry = tar_lookup(handle, "gnu-link");
+    printf("LARGE HANDLE long link -- %d (1)\n", entry && strcmp(entry->linkname, gnu_link) == 0);
+    entry = tar_lookup(handle, pax_name);
+    printf("LARGE HANDLE PAX -- %zu (1000)\n", entry ? entry->size : 0);
+    len = sizeof(dest);
+    status = tar_read_file(handle, "last.txt", 0, dest, &len);
+    printf("LARGE HANDLE READ last -- %zd %zu (0 1)\n", status, len);
+    tar_close(handle);
+
+    lseek(fd, 0, SEEK_SET);
+    tar_iter_t *iter = tar_iter_open(fd);
+    int no_entries = 0, names = 0;
+    while (tar_iter_next(iter, &entry) > 0) {
+        no_entries++;
+        names += strcmp(entry->name, pax_name) == 0 || strcmp(entry->name, gnu_name) == 0
+                 || strcmp(entry->name, prefix_name) == 0;
+    }
+    printf("LARGE ITER -- %d %d (7 3)\n", no_entries, names);
+    tar_iter_close(iter);
+    close(fd);
+    unlink("./large.tar");
+}
+
+/**
+ * Compresses src into dst with gzip.
+ */
+void gzip_file(const char *src, const char *dst) {
+    int fd = open(src, O_RDONLY);
+    gzFile out = gzopen(dst, "wb6");
+    char buffer[64 * 1024];
+    ssize_t got;
+    while ((got = read(fd, buffer, sizeof(buffer))) > 0) gzwrite(out, buffer, got);
+    gzclose(out);
+    close(fd);
+}
+
+/**
+ * Queries archive4.tar and a synthetic archive through their gzip-compressed copies, then compares a read
+ * near the end of the compressed archive with decompressing the whole archive before reading it.
+ */
+void gzip_test(void) {
+    gzip_file("./archive4.tar", "./gzip.tar.gz");
+    int fd = open("./gzip.tar.gz", O_RDONLY);
+    tar_handle_t *handle = tar_open(fd);
+    printf("GZIP open -- %d (1)\n", handle != NULL);
+    printf("GZIP IS FILE -- %d (1)\n", tar_is_file(handle, "archive/dir/not_dir/file3.txt"));
+    printf("GZIP IS LINK -- %d (1)\n", tar_is_symlink(handle, "archive/link"));
+    uint8_t dest[2048];
+    size_t len = sizeof(dest);
+    ssize_t status = tar_read_file(handle, "archive/dir/not_dir/file3.txt", 0, dest, &len);
+    printf("GZIP READ -- %zd %zu %d (0 16 1)\n", status, len, memcmp(dest, "file3.txt Hello\n", 16) == 0);
+    len = 3;
+    status = tar_read_file(handle, "archive/file.txt", 6, dest, &len);
+    printf("GZIP READ offset -- %zd %d (13 1)\n", status, memcmp(dest, "fil", 3) == 0);
+    printf("GZIP map refused -- %d (-1)\n", tar_map(handle, TAR_MAP_RANDOM));
+    printf("GZIP index refused -- %d (-1)\n", tar_index_save(handle, "./gzip.tar.gz.idx"));
+    tar_close(handle);
+    close(fd);
+
+    write_synthetic_archive("./gzip.tar", 5000);
+    gzip_file("./gzip.tar", "./gzip.tar.gz");
+    int plain_fd = open("./gzip.tar", O_RDONLY);
+    fd = open("./gzip.tar.gz", O_RDONLY);
+    tar_handle_t *plain = tar_open(plain_fd);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    handle = tar_open(fd);
+    double open_ms = elapsed_ms(&start);
+    printf("GZIP synthetic open -- %d (1)\n", handle != NULL);
+    int same = 1;
+    uint8_t expected[2048];
+    for (int i = 0; i < 5000; i += 499) {
+        char name[100];
+        snprintf(name, sizeof(name), "synthetic/d%d/f%d.txt", i / 100, i);
+        size_t a = sizeof(dest), b = sizeof(expected);
+        same &= tar_read_file(handle, name, 0, dest, &a) == tar_read_file(plain, name, 0, expected, &b)
+                && a == b && memcmp(dest, expected, a) == 0;
+    }
+    printf("GZIP synthetic READ same -- %d (1)\n", same);
+    tar_close(plain);
+    close(plain_fd);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < 100; i++) {
+        len = sizeof(dest);
+        tar_read_file(handle, "synthetic/d49/f4999.txt", 0, dest, &len);
+    }
+    double read_ms = elapsed_ms(&start) / 100;
+    tar_close(handle);
+
+    clock_gettime(CLOCK_MONOTONIC, &start); // decompress-then-read
+    gzFile in = gzdopen(dup(fd), "rb");
+    int out = open("./gzip.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    char buffer[64 * 1024];
+    int got;
+    while ((got = gzread(in, buffer, sizeof(buffer))) > 0) write(out, buffer, got);
+    gzclose(in);
+    plain = tar_open(out);
+    len = sizeof(dest);
+    tar_read_file(plain, "synthetic/d49/f4999.txt", 0, dest, &len);
+    double full_ms = elapsed_ms(&start);
+    tar_close(plain);
+    close(out);
+    printf("GZIP synthetic open=%.1fms read=%.3fms decompress-then-read=%.1fms\n", open_ms, read_ms, full_ms);
+    close(fd);
+
+    // two gzip members split in the middle of a payload read as one archive
+    write_synthetic_archive("./gzip.tar", 5000);
+    plain_fd = open("./gzip.tar", O_RDONLY);
+    plain = tar_open(plain_fd);
+    const tar_entry_t *middle = tar_lookup(plain, "synthetic/d25/f2500.txt");
+    off_t split = middle->data_offset + middle->size / 2;
+    gzFile members = gzopen("./gzip.tar.gz", "wb6");
+    for (off_t done = 0; done < split;) {
+        got = pread(plain_fd, buffer, split - done < (off_t) sizeof(buffer) ? split - done : sizeof(buffer), done);
+        gzwrite(members, buffer, got);
+        done += got;
+    }
+    gzclose(members);
+    members = gzopen("./gzip.tar.gz", "ab6"); // appending starts a second member
+    for (off_t done = split; (got = pread(plain_fd, buffer, sizeof(buffer), done)) > 0; done += got) {
+        gzwrite(members, buffer, got);
+    }
+    gzclose(members);
+    fd = open("./gzip.tar.gz", O_RDONLY);
+    handle = tar_open(fd);
+    same = handle != NULL;
+    int crossing = 0;
+    for (int i = 0; i < 5000 && handle; i++) {
+        char name[100];
+        snprintf(name, sizeof(name), "synthetic/d%d/f%d.txt", i / 100, i);
+        const tar_entry_t *entry = tar_lookup(plain, name);
+        if (i % 499 != 0 && !(entry->data_offset <= split && split < entry->data_offset + (off_t) entry->size)) continue;
+        crossing += i % 499 != 0;
+        size_t a = sizeof(dest), b = sizeof(expected);
+        same &= tar_read_file(handle, name, 0, dest, &a) == tar_read_file(plain, name, 0, expected, &b)
+                && a == b && memcmp(dest, expected, a) == 0;
+    }
+    printf("GZIP members READ same -- %d %d (1 1)\n", same, crossing);
+    tar_close(handle);
+    tar_close(plain);
+    close(plain_fd);
+    close(fd);
+    unlink("./gzip.tar");
+    unlink("./gzip.tar.gz");
+}
+
+/**
+ * Shares a cache between two handles on archive4.tar, reads through it once the descriptor is closed,
+ * then fills a small cache from a synthetic archive until blocks are evicted.
+ */
+void cache_test(void) {
+    tar_cache_t *cache = tar_cache_create(1024 * 1024);
+    tar_cache_stats_t stats;
+    int fd1 = open("./archive4.tar", O_RDONLY), fd2 = open("./archive4.tar", O_RDONLY);
+    tar_handle_t *h1 = tar_open_cached(fd1, cache), *h2 = tar_open_cached(fd2, cache);
+    uint8_t dest[2048];
+    size_t len = sizeof(dest);
+    tar_read_file(h1, "archive/file.txt", 0, dest, &len);
+    tar_cache_stats(cache, &stats);
+    printf("CACHE first read -- %llu %llu (0 1)\n", (unsigned long long) stats.hits, (unsigned long long) stats.misses);
+    len = sizeof(dest);
+    tar_read_file(h2, "archive/dir/not_dir/file3.txt", 0, dest, &len);
+    tar_cache_stats(cache, &stats);
+    printf("CACHE shared -- %llu %llu %zu (1 1 16384)\n", (unsigned long long) stats.hits,
+           (unsigned long long) stats.misses, stats.bytes);
+    close(fd2); // hot entries are served from memory, the descriptor is not used anymore
+    len = sizeof(dest);
+    ssize_t status = tar_read_file(h2, "archive/file.txt", 6, dest, &len);
+    printf("CACHE without fd -- %zd %zu %d (0 16 1)\n", status, len, memcmp(dest, "file.txt", 8) == 0);
+    tar_close(h1);
+    tar_close(h2);
+    close(fd1);
+    tar_cache_destroy(cache);
+
+    printf("CACHE budget too small -- %d (1)\n", tar_cache_create(1024) == NULL);
+    write_synthetic_archive("./cache.tar", 500);
+    cache = tar_cache_create(4 * 16 * 1024);
+    int fd = open("./cache.tar", O_RDONLY);
+    tar_handle_t *handle = tar_open_cached(fd, cache), *plain = tar_open(fd);
+    int same = 1;
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < 500; i += 7) {
+            char name[100];
+            uint8_t expected[2048];
+            snprintf(name, sizeof(name), "synthetic/d%d/f%d.txt", i / 100, i);
+            size_t a = sizeof(dest), b = sizeof(expected);
+            same &= tar_read_file(handle, name, 0, dest, &a) == tar_read_file(plain, name, 0, expected, &b)
+                    && a == b && memcmp(dest, expected, a) == 0;
+        }
+    }
+    tar_cache_stats(cache, &stats);
+    printf("CACHE evicting reads -- %d (1)\n", same);
+    printf("CACHE evictions -- %d %zu (1 65536)\n", stats.evictions > 0, stats.bytes);
+    tar_close(handle);
+    tar_close(plain);
+    close(fd);
+    unlink("./cache.tar");
+    tar_cache_destroy(cache);
+}
+
+#ifdef TAR_TRACE
+void count_traces(const tar_trace_t *trace, void *arg) {
+    if (trace->fn == TAR_FN_IS_FILE) (*(int*) arg)++;
+}
+#endif
+
+/**
+ * Checks the counters of a few calls on archive4.tar, including calls made from inside other calls
+ * and reads done by worker threads, then prints the latency histogram of is_file().
+ */
+void stats_test(void) {
+    int fd = open("./archive4.tar", O_RDONLY);
+    tar_stats_t stats;
+    tar_stats_reset();
+    is_file(fd, "archive/file.txt");
+    is_file(fd, "missing");
+    tar_stats_get(&stats);
+    tar_fn_stats_t *fn = &stats.fn[TAR_FN_IS_FILE];
+    printf("STATS is_file -- %llu %d %d (2 1 1)\n", (unsigned long long) fn->calls, fn->syscalls >= 2,
+           fn->bytes >= 2 * 512 * 18);
+    printf("STATS is_file headers -- %llu (20)\n", (unsigned long long) fn->headers); // 2 then all 18 headers
+    uint64_t in_histogram = 0;
+    for (int i = 0; i < TAR_HIST_BUCKETS; i++) in_histogram += fn->latency[i];
+    printf("STATS histogram -- %llu %d (2 1)\n", (unsigned long long) in_histogram, fn->wall_ns > 0);
+    printf("STATS others untouched -- %llu (0)\n", (unsigned long long) stats.fn[TAR_FN_EXISTS].calls);
+
+    tar_handle_t *handle = tar_open(fd);
+    tar_stats_reset();
+    uint8_t dest[64];
+    size_t len = sizeof(dest);
+    tar_read_file(handle, "archive/file.txt", 0, dest, &len);
+    tar_stats_get(&stats);
+    fn = &stats.fn[TAR_FN_HANDLE_READ_FILE];
+    printf("STATS tar_read_file -- %llu %llu %llu %llu (1 1 22 0)\n", (unsigned long long) fn->calls,
+           (unsigned long long) fn->syscalls, (unsigned long long) fn->bytes, (unsigned long long) fn->headers);
+    tar_close(handle);
+
+    tar_stats_reset();
+    char *file3 = "archive/dir/not_dir/file3.txt";
+    tar_read_t reqs[2] = {{file3, 0, dest, 16}, {"archive/file.txt", 0, dest + 16, 22}};
+    read_files_batch(fd, reqs, 2, TAR_BATCH_PREAD); // tar_stat_many() inside and a thread reading
+    tar_stats_get(&stats);
+    fn = &stats.fn[TAR_FN_READ_FILES_BATCH];
+    printf("STATS batch -- %llu %llu %d (1 0 1)\n", (unsigned long long) fn->calls,
+           (unsigned long long) stats.fn[TAR_FN_STAT_MANY].calls, fn->bytes >= 512 * 18 + 16 + 22);
+    printf("STATS names -- %s %d (read_file 1)\n", tar_fn_name(TAR_FN_READ_FILE), tar_fn_name(TAR_FN_COUNT) == NULL);
+#ifdef TAR_TRACE
+    int traces = 0;
+    int set = tar_trace_set(count_traces, &traces);
+    is_file(fd, "archive/file.txt");
+    is_dir(fd, "archive/");
+    tar_trace_set(NULL, NULL);
+    is_file(fd, "archive/file.txt");
+    printf("STATS trace -- %d %d (0 1)\n", set, traces);
+#endif
+
+    write_synthetic_archive("./stats.tar", 2000);
+    int big = open("./stats.tar", O_RDONLY);
+    tar_stats_reset();
+    for (int i = 0; i < 2000; i += 20) {
+        char name[100];
+        snprintf(name, sizeof(name), "synthetic/d%d/f%d.txt", i / 100, i);
+        is_file(big, name);
+    }
+    tar_stats_get(&stats);
+    fn = &stats.fn[TAR_FN_IS_FILE];
+    printf("STATS synthetic is_file calls=%llu syscalls=%llu bytes=%llu headers=%llu mean=%.1fus histogram(us):",
+           (unsigned long long) fn->calls, (unsigned long long) fn->syscalls, (unsigned long long) fn->bytes,
+           (unsigned long long) fn->headers, fn->wall_ns / 1e3 / fn->calls);
+    for (int i = 0; i < TAR_HIST_BUCKETS; i++) if (fn->latency[i]) printf(" <%d:%llu", 1 << i, (unsigned long long) fn->latency[i]);
+    printf("\n");
+    close(big);
+    unlink("./stats.tar");
+    close(fd);
+}
+
+/**
+ * Appends a member to an archive being written, content being the payload of a file or the target of a symlink.
+ */
+void write_member(int fd, const char *name, char typeflag, const char *content) {
+    char block[512];
+    size_t size = typeflag == REGTYPE ? strlen(content) : 0;
+    fill_header((tar_header_t*) block, name, typeflag, size, typeflag == SYMTYPE ? content : NULL);
+    write(fd, block, 512);
+    if (size == 0) return;
+    memset(block, 0, sizeof(block));
+    memcpy(block, content, size);
+    write(fd, block, 512);
+}
+
+void end_archive(int fd) {
+    char block[1024] = {0};
+    write(fd, block, sizeof(block));
+    close(fd);
+}
+
+/**
+ * Stacks a base and two patch layers, with whiteouts of a file, of a directory and an opaque directory,
+ * and queries the union.
+ */
+void union_test(void) {
+    int fd = open("./layer0.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_member(fd, "etc/", DIRTYPE, NULL);
+    write_member(fd, "etc/a.txt", REGTYPE, "base-a");
+    write_member(fd, "etc/b.txt", REGTYPE, "base-b");
+    write_member(fd, "etc/sub/", DIRTYPE, NULL);
+    write_member(fd, "etc/sub/c.txt", REGTYPE, "base-c");
+    write_member(fd, "usr/x.txt", REGTYPE, "base-x");
+    write_member(fd, "opq/", DIRTYPE, NULL);
+    write_member(fd, "opq/old.txt", REGTYPE, "old");
+    end_archive(fd);
+    fd = open("./layer1.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_member(fd, "etc/a.txt", REGTYPE, "patch-a");
+    write_member(fd, "etc/.wh.b.txt", REGTYPE, "");
+    write_member(fd, "etc/.wh.sub", REGTYPE, "");
+    write_member(fd, "opq/.wh..wh..opq", REGTYPE, "");
+    write_member(fd, "opq/new.txt", REGTYPE, "new");
+    end_archive(fd);
+    fd = open("./layer2.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_member(fd, "etc/b.txt", REGTYPE, "again-b");
+    write_member(fd, "link", SYMTYPE, "etc/a.txt");
+    end_archive(fd);
+    gzip_file("./layer2.tar", "./layer2.tar.gz");
+
+    int fds[3] = {open("./layer0.tar", O_RDONLY), open("./layer1.tar", O_RDONLY), open("./layer2.tar.gz", O_RDONLY)};
+    tar_handle_t *handle = tar_union_open(fds, 3);
+    printf("UNION open -- %d (1)\n", handle != NULL);
+    uint8_t dest[64];
+    size_t len = sizeof(dest);
+    ssize_t status = tar_read_file(handle, "etc/a.txt", 0, dest, &len);
+    printf("UNION top wins -- %zd %d (0 1)\n", status, len == 7 && memcmp(dest, "patch-a", 7) == 0);
+    len = sizeof(dest);
+    status = tar_read_file(handle, "etc/b.txt", 0, dest, &len);
+    printf("UNION whiteout then added again -- %zd %d (0 1)\n", status, len == 7 && memcmp(dest, "again-b", 7) == 0);
+    len = sizeof(dest);
+    status = tar_read_file(handle, "usr/x.txt", 0, dest, &len);
+    printf("UNION base only -- %zd %d (0 1)\n", status, len == 6 && memcmp(dest, "base-x", 6) == 0);
+    len = sizeof(dest);
+    status = tar_read_file(handle, "link", 0, dest, &len);
+    printf("UNION symlink across layers -- %zd %d (0 1)\n", status, len == 7 && memcmp(dest, "patch-a", 7) == 0);
+    printf("UNION removed dir -- %d %d %d (0 0 0)\n", tar_exists(handle, "etc/sub/"), tar_exists(handle, "etc/sub"),
+           tar_exists(handle, "etc/sub/c.txt"));
+    printf("UNION whiteout files hidden -- %d %d (0 0)\n", tar_exists(handle, "etc/.wh.b.txt"),
+           tar_exists(handle, "opq/.wh..wh..opq"));
+    printf("UNION opaque -- %d %d %d (1 0 1)\n", tar_is_dir(handle, "opq/"), tar_exists(handle, "opq/old.txt"),
+           tar_is_file(handle, "opq/new.txt"));
+    char **entries = (char**) malloc(sizeof(char*) * 10);
+    for (int i = 0; i < 10; i++) entries[i] = (char*) malloc(100);
+    size_t no_entries = 10;
+    int listed = tar_list(handle, "etc/", entries, &no_entries);
+    printf("UNION LIST etc -- %d %zu (1 2)", listed, no_entries);
+    for (size_t i = 0; i < no_entries; i++) printf(" %s", entries[i]);
+    printf("\n");
+    printf("UNION implicit dir -- %d (1)\n", tar_is_dir(handle, "usr/"));
+    for (int i = 0; i < 10; i++) free(entries[i]);
+    free(entries);
+    printf("UNION map refused -- %d (-1)\n", tar_map(handle, TAR_MAP_RANDOM));
+    tar_close(handle);
+    int swapped[2] = {fds[1], fds[0]}; // the base on top: its files come back, the whiteouts are below
+    handle = tar_union_open(swapped, 2);
+    len = sizeof(dest);
+    status = tar_read_file(handle, "etc/a.txt", 0, dest, &len);
+    printf("UNION order -- %zd %d %d (0 1 1)\n", status, len == 6 && memcmp(dest, "base-a", 6) == 0,
+           tar_exists(handle, "etc/sub/c.txt"));
+    tar_close(handle);
+    printf("UNION no layer -- %d (1)\n", tar_union_open(fds, 0) == NULL);
+    for (int i = 0; i < 3; i++) close(fds[i]);
+    unlink("./layer0.tar");
+    unlink("./layer1.tar");
+    unlink("./layer2.tar");
+    unlink("./layer2.tar.gz");
+}
+
+/**
+ * Appends to an open archive as "tar -r" does, overwriting its end of archive marker, and refreshes the handle.
+ */
+void refresh_test(void) {
+    int fd = open("./append.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    for (int i = 0; i < 50; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "log/%02d.txt", i);
+        write_member(fd, name, REGTYPE, "old");
+    }
+    write_member(fd, "log/last.txt", REGTYPE, "first");
+    end_archive(fd);
+    int tar_fd = open("./append.tar", O_RDONLY);
+    tar_handle_t *handle = tar_open(tar_fd);
+    printf("REFRESH unchanged -- %d (0)\n", tar_refresh(handle));
+    fd = open("./append.tar", O_WRONLY);
+    lseek(fd, 51 * 1024, SEEK_SET);
+    write_member(fd, "new/added.txt", REGTYPE, "added");
+    write_member(fd, "log/last.txt", REGTYPE, "second");
+    end_archive(fd);
+    tar_stats_reset();
+    int added = tar_refresh(handle);
+    tar_stats_t stats;
+    tar_stats_get(&stats);
+    printf("REFRESH appended -- %d (2)\n", added);
+    printf("REFRESH headers read -- %llu (2)\n", (unsigned long long) stats.fn[TAR_FN_REFRESH].headers);
+    uint8_t dest[16];
+    size_t len = sizeof(dest);
+    ssize_t status = tar_read_file(handle, "log/last.txt", 0, dest, &len);
+    printf("REFRESH shadowed -- %zd %d (0 1)\n", status, len == 6 && memcmp(dest, "second", 6) == 0);
+    printf("REFRESH new dir -- %d %d (1 1)\n", tar_is_dir(handle, "new/"), tar_is_file(handle, "new/added.txt"));
+    char **entries = (char**) malloc(sizeof(char*) * 60);
+    for (int i = 0; i < 60; i++) entries[i] = (char*) malloc(100);
+    size_t no_entries = 60;
+    tar_list(handle, "log/", entries, &no_entries);
+    printf("REFRESH LIST log -- %zu (51)\n", no_entries);
+    for (int i = 0; i < 60; i++) free(entries[i]);
+    free(entries);
+    printf("REFRESH again -- %d (0)\n", tar_refresh(handle));
+    tar_close(handle);
+    tar_close(tar_open_indexed(tar_fd, "./append.idx"));
+    handle = tar_open_indexed(tar_fd, "./append.idx"); // loaded, no walk
+    fd = open("./append.tar", O_WRONLY);
+    lseek(fd, 53 * 1024, SEEK_SET);
+    write_member(fd, "new/later.txt", REGTYPE, "later");
+    end_archive(fd);
+    added = tar_refresh(handle);
+    printf("REFRESH indexed -- %d %d (1 1)\n", added, tar_is_file(handle, "new/later.txt"));
+    truncate("./append.tar", 10 * 1024);
+    printf("REFRESH shrunk -- %d (-2)\n", tar_refresh(handle));
+    tar_close(handle);
+    close(tar_fd);
+    unlink("./append.tar");
+    unlink("./append.idx");
+}
+
+typedef struct find_arg {
+    int calls;
+    int stop_after;     // stops the search after that many calls, never if zero
+    char names[256];    // matched names, space separated
+} find_arg_t;
+
+int collect_found(const tar_entry_t *entry, void *arg) {
+    find_arg_t *found = (find_arg_t*) arg;
+    found->calls++;
+    size_t used = strlen(found->names);
+    snprintf(found->names + used, sizeof(found->names) - used, "%s%s", used ? " " : "", entry->name);
+    return found->calls == found->stop_after;
+}
+
+/**
+ * @return the number of entries matching a pattern, -1 if it differs from the number of callbacks
+ */
+int count_found(tar_handle_t *handle, const char *pattern, int types) {
+    find_arg_t found = {0};
+    int result = tar_find(handle, pattern, types, collect_found, &found);
+    return result == found.calls ? result : -1;
+}
+
+/**
+ * Searches an archive with globs, prefixes and type filters, before and after it is appended to.
+ */
+void find_test(void) {
+    int fd = open("./find.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_member(fd, "src/", DIRTYPE, NULL);
+    write_member(fd, "src/b.h", REGTYPE, "b");
+    write_member(fd, "src/a.c", REGTYPE, "a");
+    write_member(fd, "src/lib/", DIRTYPE, NULL);
+    write_member(fd, "src/lib/x.c", REGTYPE, "x");
+    write_member(fd, "src/lib/deep/y.c", REGTYPE, "y");
+    write_member(fd, "src/link", SYMTYPE, "a.c");
+    write_member(fd, "doc/readme.txt", REGTYPE, "readme");
+    write_member(fd, "srcx.c", REGTYPE, "srcx");
+    end_archive(fd);
+    int tar_fd = open("./find.tar", O_RDONLY);
+    tar_handle_t *handle = tar_open(tar_fd);
+    printf("FIND star -- %d (1)\n", count_found(handle, "src/*.c", TAR_FIND_ANY));
+    printf("FIND double star -- %d (3)\n", count_found(handle, "src/**.c", TAR_FIND_ANY));
+    printf("FIND any dirs -- %d (3)\n", count_found(handle, "src/**/*.c", TAR_FIND_ANY));
+    printf("FIND children -- %d (4)\n", count_found(handle, "src/*", TAR_FIND_ANY));
+    printf("FIND types -- %d %d %d (1 1 2)\n", count_found(handle, "src/*", TAR_FIND_DIR),
+           count_found(handle, "src/*", TAR_FIND_SYMLINK), count_found(handle, "src/*", TAR_FIND_FILE));
+    printf("FIND implicit dir -- %d (2)\n", count_found(handle, "*", TAR_FIND_DIR));
+    printf("FIND subtree -- %d (3)\n", count_found(handle, "src/lib/**", TAR_FIND_ANY));
+    printf("FIND question -- %d %d (2 0)\n", count_found(handle, "src/?.?", TAR_FIND_ANY),
+           count_found(handle, "src/??.c", TAR_FIND_ANY));
+    printf("FIND exact -- %d %d (1 0)\n", count_found(handle, "srcx.c", TAR_FIND_ANY),
+           count_found(handle, "src/missing", TAR_FIND_ANY));
+    find_arg_t found = {0};
+    tar_find(handle, "src/**.c", TAR_FIND_FILE, collect_found, &found);
+    printf("FIND order -- %s (src/a.c src/lib/deep/y.c src/lib/x.c)\n", found.names);
+    found = (find_arg_t) {0};
+    found.stop_after = 1;
+    int result = tar_find(handle, "**", TAR_FIND_ANY, collect_found, &found);
+    printf("FIND stop -- %d %d (1 1)\n", result, found.calls);
+    fd = open("./find.tar", O_WRONLY);
+    lseek(fd, -1024, SEEK_END); // over the end of archive marker
+    write_member(fd, "src/new.c", REGTYPE, "new");
+    end_archive(fd);
+    tar_refresh(handle);
+    printf("FIND refreshed -- %d (2)\n", count_found(handle, "src/*.c", TAR_FIND_ANY));
+    tar_close(handle);
+    close(tar_fd);
+    unlink("./find.tar");
+}
+
+/**
+ * Hashes the files of an archive on several threads, then checks a corrupted copy against the digests.
+ */
+void verify_test(void) {
+    printf("CRC32C vector -- %08x (e3069283)\n", tar_crc32c(0, "123456789", 9));
+    printf("CRC32C chained -- %08x (e3069283)\n", tar_crc32c(tar_crc32c(0, "1234", 4), "56789", 5));
+    size_t big_len = 3 * 1024 * 1024 + 123; // over several chunks of the workers
+    char *big = (char*) malloc(big_len);
+    for (size_t i = 0; i < big_len; i++) big[i] = (char) (i * 2654435761u >> 13);
+    int fd = open("./verify.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    char block[512];
+    fill_header((tar_header_t*) block, "data/big.bin", REGTYPE, big_len, NULL);
+    write(fd, block, 512);
+    write(fd, big, big_len);
+    memset(block, 0, sizeof(block));
+    write(fd, block, 512 - big_len % 512);
+    for (int i = 0; i < 20; i++) {
+        char name[32], content[32];
+        snprintf(name, sizeof(name), "data/%02d.txt", i);
+        snprintf(content, sizeof(content), "content of file %d", i);
+        write_member(fd, name, REGTYPE, content);
+    }
+    write_member(fd, "data/link", SYMTYPE, "00.txt");
+    end_archive(fd);
+    int tar_fd = open("./verify.tar", O_RDONLY);
+    tar_digest_t *digests = NULL;
+    size_t no_digests = 0;
+    tar_verify_stats_t stats;
+    int result = tar_verify_contents(tar_fd, 4, NULL, 0, &digests, &no_digests, &stats);
+    printf("VERIFY digests -- %d %zu %zu %d (0 21 21 1)\n", result, no_digests, stats.no_files,
+           stats.bytes > big_len && stats.gb_per_s > 0);
+    printf("VERIFY big -- %s %d (data/big.bin 1)\n", digests[0].name,
+           digests[0].crc32c == tar_crc32c(0, big, big_len) && digests[0].size == big_len);
+    printf("VERIFY small -- %d (1)\n", digests[5].crc32c == tar_crc32c(0, "content of file 4", 17));
+    tar_digest_t *single = NULL;
+    tar_verify_contents(tar_fd, 1, NULL, 0, &single, &no_digests, NULL);
+    int same = no_digests == 21;
+    for (size_t i = 0; same && i < no_digests; i++) same = single[i].crc32c == digests[i].crc32c;
+    printf("VERIFY one thread -- %d (1)\n", same);
+    free(single);
+    printf("VERIFY manifest -- %d (0)\n", tar_verify_contents(tar_fd, 4, digests, 21, NULL, NULL, NULL));
+    close(tar_fd);
+
+    fd = open("./verify.tar", O_WRONLY);
+    pwrite(fd, "X", 1, 512 + 2 * 1024 * 1024); // a byte in the middle of the second chunk of big.bin
+    close(fd);
+    tar_fd = open("./verify.tar", O_RDONLY);
+    tar_digest_t *checked = NULL;
+    result = tar_verify_contents(tar_fd, 4, digests, 21, &checked, &no_digests, &stats);
+    printf("VERIFY corrupted -- %d %zu %d %d (1 1 1 0)\n", result, stats.mismatches, checked[0].status,
+           checked[1].status);
+    free(checked);
+    tar_digest_t partial[2] = {digests[1], {"data/missing.txt", 1, 0, 0}};
+    result = tar_verify_contents(tar_fd, 2, partial, 2, NULL, NULL, &stats);
+    printf("VERIFY partial manifest -- %d %zu %zu (21 20 1)\n", result, stats.unlisted, stats.missing);
+    close(tar_fd);
+    free(digests);
+    free(big);
+    unlink("./verify.tar");
+}
+
+/* Layout of the index files of tar_index_save(), see index_file_header_t in lib_tar.c */
+#define INDEX_HEADER_LEN 96
+#define INDEX_ENTRY_LEN 40
+
+/**
+ * Opens an archive and tells in *walked whether tar_open() walked its headers rather than load its index.
+ */
+tar_handle_t *walked_open(int fd, int *walked) {
+    tar_stats_reset();
+    tar_handle_t *handle = tar_open(fd);
+    tar_stats_t stats;
+    tar_stats_get(&stats);
+    *walked = handle && stats.fn[TAR_FN_OPEN].headers > 0;
+    return handle;
+}
+
+/**
+ * Looks up a directory whose name, 700 characters long, only fits a PAX record, with and without its slash.
+ */
+void long_dir_test(void) {
+    int fd = open("./long_dir.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    char long_dir[701];
+    for (int i = 0; i < 700; i++) long_dir[i] = i % 100 == 99 ? '/' : 'd';
+    long_dir[699] = 'd';
+    long_dir[700] = '\0';
+    tar_writer_t *writer = tar_writer_open(fd);
+    tar_writer_add_dir(writer, long_dir, 0755);
+    tar_writer_close(writer);
+    tar_handle_t *handle = tar_open(fd);
+    char with_slash[702];
+    snprintf(with_slash, sizeof(with_slash), "%s/", long_dir);
+    printf("LOOKUP long dir -- %d %d (1 1)\n", tar_is_dir(handle, long_dir), tar_is_dir(handle, with_slash));
+    tar_close(handle);
+    close(fd);
+    unlink("./long_dir.tar");
+}
+
+typedef struct pipe_head {
+    int fd;
+    char head[4096];        // first bytes read from the pipe
+    size_t len;
+} pipe_head_t;
+
+/**
+ * Keeps the first bytes written to a pipe and drains the rest until it is closed.
+ */
+void *drain_pipe(void *arg) {
+    pipe_head_t *pipe_head = (pipe_head_t*) arg;
+    char buffer[65536];
+    ssize_t got;
+    while ((got = read(pipe_head->fd, buffer, sizeof(buffer))) > 0) {
+        size_t keep = sizeof(pipe_head->head) - pipe_head->len;
+        if ((size_t) got < keep) keep = got;
+        memcpy(pipe_head->head + pipe_head->len, buffer, keep);
+        pipe_head->len += keep;
+    }
+    return NULL;
+}
+
+/**
+ * Writes a file over 8 GiB whose name goes in the prefix and name fields to a pipe, from zero pages that
+ * are never allocated, and checks the headers: a PAX size record and a zero ustar size beside the prefix.
+ */
+void writer_huge_test(void) {
+    size_t huge = 077777777777ULL + 2;
+    char *zeros = (char*) mmap(NULL, huge, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    int fds[2];
+    pipe(fds);
+    pipe_head_t pipe_head = {fds[0], {0}, 0};
+    pthread_t reader;
+    pthread_create(&reader, NULL, drain_pipe, &pipe_head);
+    char huge_path[200];
+    snprintf(huge_path, sizeof(huge_path), "huge/%0120d/zeros.bin", 7);
+    tar_writer_t *writer = tar_writer_open(fds[1]);
+    int status = zeros == MAP_FAILED ? -1 : tar_writer_add_file(writer, huge_path, zeros, huge, 0644);
+    status |= tar_writer_close(writer);
+    close(fds[1]);
+    pthread_join(reader, NULL);
+    close(fds[0]);
+    if (zeros != MAP_FAILED) munmap(zeros, huge);
+    tar_header_t *pax = (tar_header_t*) pipe_head.head;
+    size_t records = strtoull(pax->size, NULL, 8);
+    tar_header_t *header = (tar_header_t*) (pipe_head.head + 512 + 512 * ((records + 511) / 512));
+    int size_record = pax->typeflag == XHDTYPE && strstr(pipe_head.head + 512, " size=8589934593\n") != NULL;
+    printf("WRITER huge -- %d %d %llu %d (0 1 0 1)\n", status, size_record, strtoull(header->size, NULL, 8),
+           strncmp(header->prefix, huge_path, 125) == 0 && strcmp(header->name, "zeros.bin") == 0);
+}
+
+/**
+ * Writes an archive with the writer, then opens it through its embedded index and by walking its headers.
+ */
+void writer_test(void) {
+    int fd = open("./written.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    tar_writer_t *writer = tar_writer_open(fd);
+    size_t big_len = 100 * 1000;
+    char *big = (char*) malloc(big_len);
+    for (size_t i = 0; i < big_len; i++) big[i] = 'a' + i % 26;
+    char long_path[200], long_name[160], long_link[200], long_target[160];
+    snprintf(long_path, sizeof(long_path), "pkg/%0120d/file.txt", 7); // fits the prefix and name fields
+    snprintf(long_link, sizeof(long_link), "lnk/%0120d/link", 7); // fits them too, only its target needs PAX
+    memset(long_target, 't', sizeof(long_target) - 1);
+    long_target[sizeof(long_target) - 1] = '\0';
+    memset(long_name, 'n', sizeof(long_name) - 1); // a single component too long for ustar, written with PAX
+    long_name[sizeof(long_name) - 1] = '\0';
+    long_name[0] = 'p'; long_name[1] = 'k'; long_name[2] = 'g'; long_name[3] = '/';
+    int status = tar_writer_add_dir(writer, "pkg", 0755);
+    status |= tar_writer_add_file(writer, "pkg/a.txt", "first", 5, 0644);
+    status |= tar_writer_add_file(writer, "pkg/big.bin", big, big_len, 0600);
+    status |= tar_writer_add_symlink(writer, "pkg/link", "a.txt");
+    status |= tar_writer_add_file(writer, long_path, "long path", 9, 0644);
+    status |= tar_writer_add_file(writer, long_name, "long name", 9, 0644);
+    status |= tar_writer_add_symlink(writer, long_link, long_target);
+    status |= tar_writer_add_file(writer, "pkg/a.txt", "second", 6, 0644);
+    status |= tar_writer_add_file(writer, "loose/empty", NULL, 0, 0644);
+    printf("WRITER add -- %d %d (0 0)\n", status, tar_writer_close(writer));
+    printf("WRITER check_archive -- %d (11)\n", check_archive(fd)); // 9 entries and 2 PAX headers
+    off_t written_len = lseek(fd, 0, SEEK_END);
+    char *raw = (char*) malloc(written_len);
+    pread(fd, raw, written_len, 0);
+    int prefix_kept = 0, path_record = 0;
+    for (off_t i = 0; i + 1024 <= written_len; i += 512) {
+        tar_header_t *header = (tar_header_t*) (raw + i);
+        if (header->typeflag == XHDTYPE && strstr(raw + i + 512, " path=lnk/")) path_record = 1;
+        if (header->typeflag == SYMTYPE && strncmp(header->prefix, long_link, 124) == 0
+            && strcmp(header->name, "link") == 0) prefix_kept = 1;
+    }
+    printf("WRITER long target -- %d %d (1 0)\n", prefix_kept, path_record);
+    free(raw);
+    tar_stats_reset();
+    tar_handle_t *handle = tar_open(fd);
+    tar_stats_t stats;
+    tar_stats_get(&stats);
+    printf("WRITER embedded open -- %d %llu %llu (1 0 5)\n", handle != NULL, // gzip magic, last blocks, index, 2 headers
+           (unsigned long long) stats.fn[TAR_FN_OPEN].headers, (unsigned long long) stats.fn[TAR_FN_OPEN].syscalls);
+    uint8_t dest[16];
+    size_t len = sizeof(dest);
+    ssize_t left = tar_read_file(handle, "pkg/link", 0, dest, &len);
+    printf("WRITER last wins -- %zd %d (0 1)\n", left, len == 6 && memcmp(dest, "second", 6) == 0);
+    uint8_t *copy = (uint8_t*) malloc(big_len);
+    len = big_len;
+    left = tar_read_file(handle, "pkg/big.bin", 0, copy, &len);
+    printf("WRITER big -- %zd %d (0 1)\n", left, len == big_len && memcmp(copy, big, big_len) == 0);
+    printf("WRITER long names -- %d %d (1 1)\n", tar_is_file(handle, long_path), tar_is_file(handle, long_name));
+    printf("WRITER long target open -- %d (1)\n", tar_is_symlink(handle, long_link));
+    printf("WRITER implicit dir -- %d (1)\n", tar_is_dir(handle, "loose/"));
+    printf("WRITER scans agree -- %d %d (1 1)\n", is_symlink(fd, "pkg/link"), is_file(fd, long_name));
+    tar_close(handle);
+
+    struct stat written_st;
+    fstat(fd, &written_st);
+    uint64_t index_offset, size, damaged = 12345;
+    pread(fd, &index_offset, 8, written_st.st_size - 512 + 8); // in the footer, the last block after the index
+    off_t size_offset = index_offset + INDEX_HEADER_LEN + INDEX_ENTRY_LEN + 16; // size of the second entry
+    pread(fd, &size, 8, size_offset);
+    pwrite(fd, &damaged, 8, size_offset); // the index no longer matches its CRC-32C
+    handle = walked_open(fd, &status);
+    len = sizeof(dest);
+    tar_read_file(handle, "pkg/a.txt", 0, dest, &len);
+    printf("WRITER damaged index -- %d %d (1 1)\n", status, len == 6 && memcmp(dest, "second", 6) == 0);
+    tar_close(handle);
+    pwrite(fd, &size, 8, size_offset);
+    char first[512];
+    pread(fd, first, 512, 0);
+    ((tar_header_t*) first)->mode[4] = '0'; // pkg/ rewritten in place with another mode, the index still matches its CRC
+    seal_header((tar_header_t*) first);
+    pwrite(fd, first, 512, 0);
+    handle = walked_open(fd, &status);
+    printf("WRITER rewritten header -- %d %d (1 1)\n", status, tar_is_dir(handle, "pkg/"));
+    tar_close(handle);
+    uint64_t index_len, no_buckets, no_entries, strings_len;
+    pread(fd, &index_len, 8, written_st.st_size - 512 + 16);
+    char *index = (char*) malloc(index_len);
+    pread(fd, index, index_len, index_offset);
+    memcpy(&no_buckets, index + 48, 8);
+    no_entries = (index_len - INDEX_HEADER_LEN - 8 * no_buckets) / INDEX_ENTRY_LEN + 1; // tree just past the end
+    strings_len = index_len - (INDEX_HEADER_LEN + (INDEX_ENTRY_LEN + 16) * no_entries + 8 * no_buckets); // wraps
+    memcpy(index + 40, &no_entries, 8);
+    memcpy(index + 72, &strings_len, 8);
+    uint32_t crc = tar_crc32c(0, index, index_len); // crafted by the writer of the archive, the footer agrees
+    pwrite(fd, index, index_len, index_offset);
+    pwrite(fd, &crc, 4, written_st.st_size - 512 + 24);
+    handle = walked_open(fd, &status);
+    printf("WRITER crafted index -- %d %d (1 1)\n", status, tar_is_symlink(handle, "pkg/link"));
+    tar_close(handle);
+    free(index);
+
+    lseek(fd, index_offset - 1024, SEEK_SET); // appended to as tar -r does, over the end of archive marker
+    write_member(fd, "pkg/appended.txt", REGTYPE, "appended");
+    end_archive(fd);
+    fd = open("./written.tar", O_RDONLY);
+    tar_stats_reset();
+    handle = tar_open(fd);
+    tar_stats_get(&stats);
+    printf("WRITER walked open -- %d %d (1 1)\n", handle != NULL, stats.fn[TAR_FN_OPEN].headers > 10);
+    len = sizeof(dest);
+    tar_read_file(handle, "pkg/a.txt", 0, dest, &len);
+    printf("WRITER walked -- %d %d (1 1)\n", len == 6 && memcmp(dest, "second", 6) == 0,
+           tar_is_file(handle, "pkg/appended.txt"));
+    tar_close(handle);
+    close(fd);
+    free(copy);
+    free(big);
+    unlink("./written.tar");
+}
+
+typedef struct stress_arg {
+    int tar_fd;
+    tar_handle_t *handle;
+    int iterations;
+    int errors;
+} stress_arg_t;
+
+/**
+ * Reads two files of archive4.tar in a loop through the same file descriptor and handle as the other threads.
+ */
+void *stress_worker(void *arg) {
+    stress_arg_t *s = (stress_arg_t*) arg;
+    uint8_t dest[64];
+    for (int i = 0; i < s->iterations; i++) {
+        size_t len = sizeof(dest);
+        if (read_file(s->tar_fd, "archive/file.txt", 0, dest, &len) != 0 || len != 22
+            || memcmp(dest, "Hello file.txt world!", 21) != 0) s->errors++;
+        len = sizeof(dest);
+        if (tar_read_file(s->handle, "archive/dir/file2.txt", 0, dest, &len) != 0 || len != 6
+            || memcmp(dest, "Hello", 5) != 0) s->errors++;
+    }
+    return NULL;
+}
+
+/**
+ * Runs the same number of reads per thread with 1, 2, 4 and 8 threads sharing tar_fd and prints the throughput.
+ */
+void stress_test(int tar_fd) {
+    tar_handle_t *handle = tar_open(tar_fd);
+    for (int no_threads = 1; no_threads <= 8; no_threads *= 2) {
+        pthread_t threads[8];
+        stress_arg_t args[8];
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < no_threads; i++) {
+            args[i] = (stress_arg_t) {tar_fd, handle, 2000, 0};
+            pthread_create(&threads[i], NULL, stress_worker, &args[i]);
+        }
+        int errors = 0;
+        for (int i = 0; i < no_threads; i++) {
+            pthread_join(threads[i], NULL);
+            errors += args[i].errors;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("STRESS threads=%d reads/s=%.0f errors=%d (0)\n", no_threads, 2.0 * 2000 * no_threads / elapsed, errors);
+    }
+    tar_close(handle);
+}
+
+/**
+ * Writes a fresh index of an archive, overwrites one 64-bit value of it and opens the archive through it.
+ *
+ * @param what 0 to fill every bucket, 1 to make the first top-level entry its own sibling,
+ *             2 to move the payload of the first entry past the end of the archive,
+ *             3 to claim more entries with a strings_len that wraps the sum of the sections to the file size
+ * @return 1 if the damaged index was refused and the archive walked instead, 0 otherwise
+ */
+int damaged_index_walks(int tar_fd, const char *idx_path, int what) {
+    unlink(idx_path);
+    tar_close(tar_open_indexed(tar_fd, idx_path));
+    int idx_fd = open(idx_path, O_RDWR);
+    uint64_t no_entries, no_buckets, first_root, value = 0;
+    pread(idx_fd, &no_entries, 8, 40);
+    pread(idx_fd, &no_buckets, 8, 48);
+    pread(idx_fd, &first_root, 8, 64);
+    off_t buckets = INDEX_HEADER_LEN + INDEX_ENTRY_LEN * no_entries;
+    off_t next_sibling = buckets + 8 * no_buckets + 8 * no_entries;
+    if (what == 0) for (uint64_t i = 0; i < no_buckets; i++) pwrite(idx_fd, &value, 8, buckets + 8 * i);
+    if (what == 1) pwrite(idx_fd, &first_root, 8, next_sibling + 8 * first_root);
+    value = 1ULL << 40;
+    if (what == 2) pwrite(idx_fd, &value, 8, INDEX_HEADER_LEN + 24);
+    if (what == 3) {
+        struct stat idx_st;
+        fstat(idx_fd, &idx_st);
+        no_entries = (idx_st.st_size - INDEX_HEADER_LEN - 8 * no_buckets) / INDEX_ENTRY_LEN + 1; // tree just past the end
+        value = idx_st.st_size - (INDEX_HEADER_LEN + (INDEX_ENTRY_LEN + 16) * no_entries + 8 * no_buckets);
+        pwrite(idx_fd, &no_entries, 8, 40);
+        pwrite(idx_fd, &value, 8, 72);
+    }
+    close(idx_fd);
+    tar_stats_reset();
+    tar_handle_t *handle = tar_open_indexed(tar_fd, idx_path);
+    tar_stats_t stats;
+    tar_stats_get(&stats);
+    int walked = handle && stats.fn[TAR_FN_OPEN_INDEXED].headers > 0 && tar_is_file(handle, "archive/file.txt");
+    tar_close(handle);
+    return walked;
+}
+
 /*
 int main(int argc, char **argv) {
     if (argc < 2) {
@@ -96,6 +1669,126 @@ int main(int argc, char **argv){
     for (int i = 99; i >= 0; i--) free(entries[i]);
     free(entries);
     free(no_entries);
+
+    tar_handle_t *handle = tar_open(tar_fd);
+    printf("HANDLE open -- %d (1)\n", handle != NULL);
+    printf("HANDLE IS DIR with dir? -- %d (1)\n", tar_is_dir(handle, "archive/dir/not_dir/"));
+    printf("HANDLE IS DIR without slash? -- %d (1)\n", tar_is_dir(handle, "archive/dir"));
+    printf("HANDLE IS DIR with file? -- %d (0)\n", tar_is_dir(handle, "archive/file.txt"));
+    printf("HANDLE IS FILE with file? -- %d (1)\n", tar_is_file(handle, "archive/dir/not_dir/file3.txt"));
+    printf("HANDLE IS FILE with dir? -- %d (0)\n", tar_is_file(handle, "archive/dir/"));
+    printf("HANDLE IS LINK with symlink -- %d (1)\n", tar_is_symlink(handle, "archive/link"));
+    printf("HANDLE EXISTS missing -- %d (0)\n", tar_exists(handle, "archive/dir/no_dir/"));
+    printf("HANDLE EXISTS prefix only -- %d (0)\n", tar_exists(handle, "archive/di"));
+    printf("HANDLE fd untouched -- %d (0)\n", (int) lseek(tar_fd, 0, SEEK_CUR));
+
+    uint8_t hdest[512];
+    size_t hlen = sizeof(hdest);
+    printf("HANDLE READ -- %zd (0)\n", tar_read_file(handle, "archive/file.txt", 0, hdest, &hlen));
+    printf("HANDLE READ len -- %zu (22)\n", hlen);
+    hlen = 5;
+    printf("HANDLE READ partial -- %zd (11)\n", tar_read_file(handle, "archive/dir/not_dir/file3.txt", 0, hdest, &hlen));
+    hlen = sizeof(hdest);
+    printf("HANDLE READ offset too far -- %zd (-2)\n", tar_read_file(handle, "archive/file.txt", 22, hdest, &hlen));
+    printf("HANDLE READ dir -- %zd (-1)\n", tar_read_file(handle, "archive/dir/", 0, hdest, &hlen));
+
+    char **hentries = (char**) malloc(sizeof(char*) * 10);
+    for (int i = 0; i < 10; i++) hentries[i] = (char*) malloc(sizeof(char)*100);
+    size_t no_hentries = 10;
+    printf("HANDLE LIST -- %d (1)\n", tar_list(handle, "archive/dir/", hentries, &no_hentries));
+    printf("HANDLE LIST count -- %zu (3)\n", no_hentries);
+    for (int i = 0; i < no_hentries; i++) printf("HANDLE LIST: %s\n", hentries[i]);
+    no_hentries = 10;
+    printf("HANDLE LIST file -- %d (0)\n", tar_list(handle, "archive/file.txt", hentries, &no_hentries));
+    for (int i = 0; i < 10; i++) free(hentries[i]);
+    free(hentries);
+
+    const uint8_t *mapped = NULL;
+    size_t mapped_len = 0;
+    printf("MAP ENTRY -- %d (0)\n", tar_map_entry(handle, "archive/file.txt", &mapped, &mapped_len));
+    printf("MAP ENTRY content -- %d (1)\n", mapped_len == 22 && memcmp(mapped, "Hello file.txt world!", 21) == 0);
+    printf("MAP ENTRY dir -- %d (-1)\n", tar_map_entry(handle, "archive/dir/", &mapped, &mapped_len));
+    printf("MAP sequential -- %d (0)\n", tar_map(handle, TAR_MAP_SEQUENTIAL));
+    hlen = 3;
+    printf("MAP READ partial -- %zd (3)\n", tar_read_file(handle, "archive/dir/file2.txt", 0, hdest, &hlen));
+    printf("MAP READ content -- %d (1)\n", hlen == 3 && memcmp(hdest, "Hel", 3) == 0);
+    tar_close(handle);
+
+    unlink("./archive4.tar.idx");
+    handle = tar_open_indexed(tar_fd, "./archive4.tar.idx");
+    printf("INDEX FILE written -- %d (0)\n", access("./archive4.tar.idx", F_OK));
+    tar_close(handle);
+    handle = tar_open_indexed(tar_fd, "./archive4.tar.idx");
+    printf("INDEX FILE IS FILE -- %d (1)\n", tar_is_file(handle, "archive/dir/not_dir/file3.txt"));
+    printf("INDEX FILE IS DIR -- %d (1)\n", tar_is_dir(handle, "archive/dir/"));
+    printf("INDEX FILE IS LINK -- %d (1)\n", tar_is_symlink(handle, "archive/link"));
+    hlen = sizeof(hdest);
+    printf("INDEX FILE READ -- %zd (0)\n", tar_read_file(handle, "archive/file.txt", 6, hdest, &hlen));
+    printf("INDEX FILE READ content -- %d (1)\n", hlen == 16 && memcmp(hdest, "file.txt", 8) == 0);
+    tar_close(handle);
+    int idx_fd = open("./archive4.tar.idx", O_WRONLY);
+    pwrite(idx_fd, "X", 1, 0); // damaged magic: the archive is walked again and the index rewritten
+    close(idx_fd);
+    handle = tar_open_indexed(tar_fd, "./archive4.tar.idx");
+    printf("INDEX FILE damaged -- %d (1)\n", tar_is_file(handle, "archive/file.txt"));
+    tar_close(handle);
+    int stale_fd = open("./archive3.tar", O_RDONLY); // another archive, different size and mtime
+    handle = tar_open_indexed(stale_fd, "./archive4.tar.idx");
+    printf("INDEX FILE stale -- %d (0)\n", tar_is_symlink(handle, "archive/dir/file2.txt"));
+    printf("INDEX FILE stale rebuilt -- %d (1)\n", tar_is_file(handle, "archive/dir/file2.txt"));
+    tar_close(handle);
+    close(stale_fd);
+    printf("INDEX FILE full buckets -- %d (1)\n", damaged_index_walks(tar_fd, "./archive4.tar.idx", 0));
+    printf("INDEX FILE sibling cycle -- %d (1)\n", damaged_index_walks(tar_fd, "./archive4.tar.idx", 1));
+    printf("INDEX FILE offset past end -- %d (1)\n", damaged_index_walks(tar_fd, "./archive4.tar.idx", 2));
+    printf("INDEX FILE wrapped sizes -- %d (1)\n", damaged_index_walks(tar_fd, "./archive4.tar.idx", 3));
+    int rewritten_fd = open("./rewritten.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_member(rewritten_fd, "a.txt", REGTYPE, "aaaa");
+    write_member(rewritten_fd, "b.txt", REGTYPE, "bbbb");
+    end_archive(rewritten_fd);
+    rewritten_fd = open("./rewritten.tar", O_RDWR);
+    unlink("./rewritten.tar.idx");
+    tar_close(tar_open_indexed(rewritten_fd, "./rewritten.tar.idx"));
+    struct stat rewritten_st;
+    fstat(rewritten_fd, &rewritten_st);
+    char last[512];
+    fill_header((tar_header_t*) last, "c.txt", REGTYPE, 4, NULL); // same size and mtime, another last header
+    pwrite(rewritten_fd, last, 512, 1024);
+    struct timespec times[2] = {rewritten_st.st_atim, rewritten_st.st_mtim};
+    futimens(rewritten_fd, times);
+    handle = tar_open_indexed(rewritten_fd, "./rewritten.tar.idx");
+    printf("INDEX FILE last header rewritten -- %d (1)\n", tar_is_file(handle, "c.txt"));
+    tar_close(handle);
+    close(rewritten_fd);
+    unlink("./rewritten.tar.idx");
+    unlink("./rewritten.tar");
+    unlink("./archive4.tar.idx");
+
+    printf("HEADER DECODING mismatches -- %d (0)\n", header_decoding_test());
+
+    parallel_check_test();
+    tree_test();
+    symlink_test(tar_fd);
+    iter_test(tar_fd);
+    stat_many_test();
+    batch_test();
+    sendfile_test();
+    extract_test();
+    large_archive_test();
+    gzip_test();
+    cache_test();
+    stats_test();
+    union_test();
+    refresh_test();
+    find_test();
+    verify_test();
+    writer_test();
+    writer_huge_test();
+    long_dir_test();
+
+    stress_test(tar_fd);
+    printf("STRESS fd untouched -- %d (0)\n", (int) lseek(tar_fd, 0, SEEK_CUR));
+
     close(tar_fd);
     return EXIT_SUCCESS;
 }
\ No newline at end of file